@@ -0,0 +1,76 @@
+# Fans the output of a pty out to several readers with a Ruby thread
+# copying every chunk to a queue per reader, and with Termios::Broadcaster.
+require 'benchmark'
+require 'termios'
+
+SIZE = (ARGV[0] || 64 << 20).to_i
+READERS = (ARGV[1] || 8).to_i
+CHUNK = "x" * 4096
+
+def raw(io)
+  Termios.update(io) {|t|
+    t.iflag = 0
+    t.oflag = 0
+    t.lflag = 0
+    t.cflag = Termios::CS8 | Termios::CREAD | Termios::CLOCAL
+  }
+end
+
+def run
+  master, slave = Termios.openpty
+  raw(slave)
+  readers = yield(master)
+  writer = Thread.new {
+    (SIZE / CHUNK.bytesize).times { slave.write(CHUNK) }
+  }
+  before = GC.stat(:total_allocated_objects)
+  got = readers.map(&:value)
+  allocated = GC.stat(:total_allocated_objects) - before
+  writer.join
+  $bc&.close
+  puts "#{got.min} of #{SIZE} bytes" if got.min != SIZE
+  allocated
+ensure
+  master.close
+  slave.close
+end
+
+def ruby_fanout(master)
+  queues = Array.new(READERS) { Thread::Queue.new }
+  Thread.new {
+    begin
+      loop {
+        data = master.readpartial(4096)
+        queues.each {|q| q << data.dup }
+      }
+    rescue EOFError, Errno::EIO, IOError
+    end
+  }
+  queues.map {|q|
+    Thread.new {
+      n = 0
+      n += q.pop.bytesize while n < SIZE
+      n
+    }
+  }
+end
+
+def broadcaster(master)
+  $bc = Termios::Broadcaster.new(master, capacity: 16 << 20)
+  Array.new(READERS) { $bc.subscribe }.map {|sub|
+    Thread.new {
+      buf = String.new(capacity: 65536)
+      n = 0
+      n += sub.read(65536, buf).bytesize while n < SIZE
+      n
+    }
+  }
+end
+
+allocs = {}
+Benchmark.bm(12) do |x|
+  x.report('ruby fan-out') { allocs[:ruby] = run {|m| ruby_fanout(m) } }
+  x.report('broadcaster') { allocs[:native] = run {|m| broadcaster(m) } }
+end
+printf("objects allocated for %d readers: ruby %d, broadcaster %d\n",
+       READERS, allocs[:ruby], allocs[:native])
@@ -0,0 +1,25 @@
+# Reads the termios of a pty repeatedly with Termios.getattr and with
+# Termios.getattr_into, counting the objects allocated per call.
+require 'benchmark'
+require 'termios'
+
+N = (ARGV[0] || 100000).to_i
+master, slave = Termios.openpty
+
+def allocations
+  before = GC.stat(:total_allocated_objects)
+  yield
+  GC.stat(:total_allocated_objects) - before
+end
+
+t = Termios.getattr(slave)
+Termios.getattr_into(slave, t)		# warm up
+
+Benchmark.bm(14) do |x|
+  x.report('getattr') { N.times { Termios.getattr(slave) } }
+  x.report('getattr_into') { N.times { Termios.getattr_into(slave, t) } }
+end
+
+printf("objects per call: getattr %.1f, getattr_into %.1f\n",
+       allocations { N.times { Termios.getattr(slave) } }.fdiv(N),
+       allocations { N.times { Termios.getattr_into(slave, t) } }.fdiv(N))
@@ -0,0 +1,56 @@
+# Compares reading from many pseudo terminals with IO.select and
+# read_nonblock and with Termios::IOEngine on each available backend.
+require 'benchmark'
+require 'termios'
+
+PORTS = (ARGV[0] || 1000).to_i
+ROUNDS = (ARGV[1] || 20).to_i
+MESSAGE = 'x' * 64
+
+def session
+  tio = Termios.new_termios
+  tio.cflag = Termios::CS8 | Termios::CREAD
+  tio.ispeed = tio.ospeed = Termios::B38400
+  pairs = Array.new(PORTS) { Termios.openpty(termios: tio) }
+  yield pairs.map(&:first), lambda { pairs.each {|_, s| s.syswrite(MESSAGE) } }
+ensure
+  pairs.each {|m, s| m.close; s.close } if pairs
+end
+
+Process.setrlimit(:NOFILE, PORTS * 2 + 64) rescue nil
+total = PORTS * ROUNDS * MESSAGE.bytesize
+
+Benchmark.bm(20) do |x|
+  x.report('IO.select') {
+    session {|masters, produce|
+      n = 0
+      ROUNDS.times {
+        produce.call
+        want = n + PORTS * MESSAGE.bytesize
+        while n < want
+          IO.select(masters)[0].each {|m| n += m.read_nonblock(4096).bytesize }
+        end
+      }
+      raise "short read" unless n == total
+    }
+  }
+  Termios::IOEngine.backends.each {|backend|
+    engine = Termios::IOEngine.new(backend) rescue next
+    x.report("IOEngine #{engine.backend}") {
+      session {|masters, produce|
+        masters.each {|m| engine.register(m) }
+        n = 0
+        ROUNDS.times {
+          produce.call
+          want = n + PORTS * MESSAGE.bytesize
+          while n < want
+            engine.reap.each {|_, ev, data| n += data.bytesize if ev == :read }
+          end
+        }
+        masters.each {|m| engine.unregister(m) }
+        raise "short read" unless n == total
+      }
+    }
+    engine.close
+  }
+end
@@ -0,0 +1,33 @@
+# Decodes a 1 MB paste, bracketed and unbracketed, with Termios::KeyDecoder
+# and with a Ruby regexp scanner.
+require 'benchmark'
+require 'termios'
+
+LINE = ('x' * 79 + "\r")
+PASTE = LINE * ((1 << 20) / LINE.bytesize)
+BRACKETED = "\e[200~#{PASTE}\e[201~"
+CHUNK = 4096
+N = (ARGV[0] || 10).to_i
+
+TOKEN = /\e\[200~(.*?)\e\[201~|\e\[[0-9;]*[~A-Za-z]|\eO.|\e.?|[\x00-\x1f\x7f]|[^\x00-\x1f\x7f\e]+/m
+
+def ruby_decode(data)
+  data.scan(TOKEN).size
+end
+
+Benchmark.bm(28) do |x|
+  x.report('regexp, bracketed') { N.times { ruby_decode(BRACKETED) } }
+  x.report('KeyDecoder, bracketed') {
+    N.times {
+      d = Termios::KeyDecoder.new
+      0.step(BRACKETED.bytesize, CHUNK) {|i| d.feed(BRACKETED.byteslice(i, CHUNK)) }
+    }
+  }
+  x.report('regexp, unbracketed') { N.times { ruby_decode(PASTE) } }
+  x.report('KeyDecoder, unbracketed') {
+    N.times {
+      d = Termios::KeyDecoder.new
+      0.step(PASTE.bytesize, CHUNK) {|i| d.feed(PASTE.byteslice(i, CHUNK)) }
+    }
+  }
+end
@@ -0,0 +1,72 @@
+# Deframes RTU frames sent in bursts over a pty pair with Termios::Modbus
+# and with a Ruby framer splitting at the CRC.
+require 'benchmark'
+require 'termios'
+
+N = (ARGV[0] || 20000).to_i
+BATCH = 100
+
+def raw(io)
+  Termios.update(io) {|t|
+    t.iflag = 0
+    t.oflag = 0
+    t.lflag = 0
+    t.cflag = Termios::CS8 | Termios::CREAD | Termios::CLOCAL
+    t.ispeed = t.ospeed = Termios::B115200
+  }
+end
+
+CRC_TABLE = Array.new(256) {|i|
+  8.times { i = (i & 1) == 1 ? (i >> 1) ^ 0xA001 : i >> 1 }
+  i
+}
+
+# frames are cut where the running CRC reaches zero
+def ruby_read_frames(io, buf)
+  return [] unless io.wait_readable(0.5)
+  buf << io.readpartial(4096)
+  buf << io.readpartial(4096) while io.wait_readable(0)
+  frames = []
+  start = 0
+  crc = 0xFFFF
+  buf.each_byte.with_index {|b, i|
+    crc = (crc >> 8) ^ CRC_TABLE[(crc ^ b) & 0xff]
+    if crc == 0 && i + 1 - start >= 4
+      frames << [buf.getbyte(start), buf.byteslice(start + 1, i - start - 2)]
+      start = i + 1
+      crc = 0xFFFF
+    end
+  }
+  buf.replace(buf.byteslice(start..))
+  frames
+end
+
+def run(n)
+  master, slave = Termios.openpty
+  raw(slave)
+  enc = Termios::Modbus.new(master)
+  blob = Array.new(BATCH) {|i| enc.encode(17, "\x03" + [i, 10].pack("nn")) }.join
+  got = 0
+  reader = Thread.new {
+    while got < n && (count = yield(slave)) > 0
+      got += count
+    end
+  }
+  (n / BATCH).times { master.write(blob) }
+  reader.join
+  puts "#{got} of #{n} frames" if got != n
+ensure
+  master.close
+  slave.close
+end
+
+Benchmark.bm(20) do |x|
+  x.report('ruby') {
+    buf = String.new(encoding: Encoding::BINARY)
+    run(N) {|slave| ruby_read_frames(slave, buf).size }
+  }
+  x.report('Termios::Modbus') {
+    mb = nil
+    run(N) {|slave| (mb ||= Termios::Modbus.new(slave)).read_frames(256, timeout: 0.5).size }
+  }
+end
@@ -0,0 +1,33 @@
+# Compares session setup throughput of PTY.open + getattr + setattr +
+# TIOCSWINSZ with Termios.openpty.
+require 'benchmark'
+require 'pty'
+require 'termios'
+
+N = (ARGV[0] || 2000).to_i
+WINSIZE = [24, 80, 0, 0].pack('S4')
+
+base = PTY.open.last
+tio = Termios.getattr(base)
+tio.lflag &= ~(Termios::ECHO | Termios::ICANON)
+
+Benchmark.bm(16) do |x|
+  x.report('PTY.open') {
+    N.times {
+      master, slave = PTY.open
+      t = Termios.getattr(slave).dup
+      t.lflag = tio.lflag
+      Termios.setattr(slave, Termios::TCSANOW, t)
+      slave.ioctl(Termios::TIOCSWINSZ, WINSIZE)
+      master.close
+      slave.close
+    }
+  }
+  x.report('Termios.openpty') {
+    N.times {
+      master, slave = Termios.openpty(termios: tio, winsize: [24, 80])
+      master.close
+      slave.close
+    }
+  }
+end
@@ -0,0 +1,49 @@
+# Measures acquire latency of Termios::PtyPool under load and compares it
+# with opening a pair with Termios.openpty for every session.
+require 'termios'
+
+N = (ARGV[0] || 2000).to_i
+THREADS = (ARGV[1] || 4).to_i
+
+def percentiles(name, samples)
+  samples.sort!
+  p50 = samples[samples.size / 2] * 1e6
+  p99 = samples[(samples.size * 0.99).floor] * 1e6
+  printf("%-16s p50 %8.1f us  p99 %8.1f us\n", name, p50, p99)
+end
+
+def run(threads, n)
+  samples = Queue.new
+  threads.times.map {
+    Thread.new {
+      n.times {
+        t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        pair = yield :acquire
+        samples << Process.clock_gettime(Process::CLOCK_MONOTONIC) - t0
+        yield :release, pair
+      }
+    }
+  }.each(&:join)
+  Array.new(samples.size) { samples.pop }
+end
+
+tio = Termios.getattr(Termios.openpty.last)
+tio.lflag &= ~(Termios::ECHO | Termios::ICANON)
+
+percentiles('Termios.openpty', run(THREADS, N / THREADS) { |op, pair|
+  if op == :acquire
+    Termios.openpty(termios: tio, winsize: [24, 80])
+  else
+    pair.each(&:close)
+  end
+})
+
+pool = Termios::PtyPool.new(THREADS * 2, termios: tio, winsize: [24, 80])
+percentiles('PtyPool#acquire', run(THREADS, N / THREADS) { |op, pair|
+  if op == :acquire
+    pool.acquire
+  else
+    pool.release(*pair)
+  end
+})
+pool.close
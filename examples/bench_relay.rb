@@ -0,0 +1,49 @@
+# Compares throughput of relaying a pseudo terminal to a socket with
+# IO.copy_stream in a thread per direction and with Termios.relay.
+require 'benchmark'
+require 'socket'
+require 'termios'
+
+SIZE = (ARGV[0] || 64).to_i << 20
+CHUNK = 'x' * 4096
+
+def session
+  tio = Termios.new_termios
+  tio.cflag = Termios::CS8 | Termios::CREAD
+  tio.ispeed = tio.ospeed = Termios::B38400
+  master, slave = Termios.openpty(termios: tio)
+  near, far = UNIXSocket.pair
+  producer = Thread.new {
+    (SIZE / CHUNK.bytesize).times { slave.write(CHUNK) }
+    slave.close
+  }
+  consumer = Thread.new {
+    n = 0
+    while s = (far.readpartial(65536) rescue nil)
+      n += s.bytesize
+    end
+    n
+  }
+  yield master, near
+  near.close
+  producer.join
+  raise "short copy" unless consumer.value == SIZE
+ensure
+  [master, slave, near, far].each {|io| io.close unless io.closed? }
+end
+
+Benchmark.bm(16) do |x|
+  x.report('IO.copy_stream') {
+    session {|master, sock|
+      th = Thread.new { IO.copy_stream(sock, master) rescue nil }
+      begin
+        IO.copy_stream(master, sock)
+      rescue Errno::EIO
+      end
+      th.kill
+    }
+  }
+  x.report('Termios.relay') {
+    session {|master, sock| Termios.relay(master, sock) }
+  }
+end
@@ -7,6 +7,29 @@ end
 if have_header('termios.h') &&
     have_header('unistd.h')
   have_header('sys/ioctl.h')
+  have_header('linux/tty.h')
+
+  have_header('pty.h') || have_header('util.h') || have_header('libutil.h')
+  if have_func('openpty') || have_library('util', 'openpty')
+    $defs.push('-DHAVE_OPENPTY') unless $defs.include?('-DHAVE_OPENPTY')
+  end
+  have_func('posix_openpt')
+
+  if have_header('spawn.h')
+    have_func('posix_spawnp', 'spawn.h')
+    have_func('posix_spawn_file_actions_addtcsetpgrp_np', 'spawn.h')
+  end
+
+  have_header('sys/epoll.h')
+  if have_header('linux/io_uring.h') &&
+      have_macro('__NR_io_uring_setup', 'sys/syscall.h') &&
+      have_macro('IORING_FEAT_EXT_ARG', 'linux/io_uring.h')
+    $defs.push('-DHAVE_IO_URING')
+  end
+
+  if have_header('ruby/thread.h')
+    have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+  end
 
   if RUBY_VERSION >= '1.7'
     if have_header('ruby/io.h')
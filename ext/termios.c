@@ -8,6 +8,7 @@
 #include "ruby.h"
 #if defined(HAVE_RUBY_IO_H)
 #include "ruby/io.h"
+#include "ruby/encoding.h"
 #else
 #include "rubyio.h"
 #endif
@@ -16,7 +17,49 @@
 #if defined(HAVE_SYS_IOCTL_H)
 #include <unistd.h>
 #endif
+#if defined(HAVE_LINUX_TTY_H)
+#include <linux/tty.h>
+#endif
+#if defined(HAVE_PTY_H)
+#include <pty.h>
+#elif defined(HAVE_UTIL_H)
+#include <util.h>
+#elif defined(HAVE_LIBUTIL_H)
+#include <libutil.h>
+#endif
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#ifdef HAVE_SPAWN_H
+#include <spawn.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#if defined(HAVE_RUBY_THREAD_H)
+#include "ruby/thread.h"
+#endif
+
+extern char **environ;
+
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDTCSETPGRP_NP
+#define HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDTCSETPGRP_NP 0
+#endif
 
 #if defined(HAVE_TYPE_RB_IO_T) && !defined(HAVE_MACRO_OPENFILE)
 typedef rb_io_t OpenFile;
@@ -30,10 +73,20 @@ typedef rb_io_t OpenFile;
 
 #define validate_ulong(v) ULONG2NUM(NUM2ULONG(v))
 
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+#define termios_without_gvl(func, data, ubf, data2) \
+    rb_thread_call_without_gvl((func), (data), (ubf), (data2))
+#else
+#define termios_without_gvl(func, data, ubf, data2) (func)(data)
+#define RUBY_UBF_IO 0
+#endif
+
 static VALUE mTermios;
 static VALUE cTermios;
+static VALUE cPacedWriter;
 static VALUE tcsetattr_opt, tcflush_qs, tcflow_act;
 static ID id_iflag, id_oflag, id_cflag, id_lflag, id_cc, id_ispeed, id_ospeed;
+static ID id_new;
 
 /*
  * Document-class: Termios::Termios
@@ -235,32 +288,45 @@ termios_initialize(argc, argv, self)
  * termios(3)
  */
 
+/*
+ * Stores t into the Termios::Termios object obj.  The cc array of obj is
+ * updated in place, so that refreshing an object allocates nothing.
+ */
 static VALUE
-termios_to_Termios(t)
+termios_fill_Termios(obj, t)
+    VALUE obj;
     struct termios *t;
 {
     int i;
-    VALUE obj, cc_ary;
-
-    obj = rb_funcall(cTermios, rb_intern("new"), 0);
+    VALUE cc_ary;
 
-    termios_set_iflag(obj, ULONG2NUM(t->c_iflag));
-    termios_set_oflag(obj, ULONG2NUM(t->c_oflag));
-    termios_set_cflag(obj, ULONG2NUM(t->c_cflag));
-    termios_set_lflag(obj, ULONG2NUM(t->c_lflag));
+    rb_ivar_set(obj, id_iflag, ULONG2NUM(t->c_iflag));
+    rb_ivar_set(obj, id_oflag, ULONG2NUM(t->c_oflag));
+    rb_ivar_set(obj, id_cflag, ULONG2NUM(t->c_cflag));
+    rb_ivar_set(obj, id_lflag, ULONG2NUM(t->c_lflag));
 
-    cc_ary = rb_ary_new2(NCCS);
+    cc_ary = rb_ivar_get(obj, id_cc);
+    if (!RB_TYPE_P(cc_ary, T_ARRAY) || OBJ_FROZEN(cc_ary)) {
+	cc_ary = rb_ary_new2(NCCS);
+	rb_ivar_set(obj, id_cc, cc_ary);
+    }
     for (i = 0; i < NCCS; i++) {
 	rb_ary_store(cc_ary, i, CHR2FIX(t->c_cc[i]));
     }
-    termios_set_cc(obj, cc_ary);
 
-    termios_set_ispeed(obj, ULONG2NUM(cfgetispeed(t)));
-    termios_set_ospeed(obj, ULONG2NUM(cfgetospeed(t)));
+    rb_ivar_set(obj, id_ispeed, ULONG2NUM(cfgetispeed(t)));
+    rb_ivar_set(obj, id_ospeed, ULONG2NUM(cfgetospeed(t)));
 
     return obj;
 }
 
+static VALUE
+termios_to_Termios(t)
+    struct termios *t;
+{
+    return termios_fill_Termios(rb_funcall(cTermios, id_new, 0), t);
+}
+
 static void
 Termios_to_termios(obj, t)
     VALUE obj;
@@ -284,6 +350,17 @@ Termios_to_termios(obj, t)
     cfsetospeed(t, NUM2ULONG(rb_ivar_get(obj, id_ospeed)));
 }
 
+static int
+termios_io_fileno(io)
+    VALUE io;
+{
+    OpenFile *fptr;
+
+    Check_Type(io, T_FILE);
+    GetOpenFile(io, fptr);
+    return FILENO(fptr);
+}
+
 /*
  * call-seq:
  *   Termios.tcgetattr(io)
@@ -326,6 +403,39 @@ termios_s_tcgetattr(obj, io)
     return termios_tcgetattr(io);
 }
 
+static void termios_check_Termios(VALUE);
+
+/*
+ * call-seq:
+ *   Termios.getattr_into(io, termios)
+ *
+ * Reads the termios parameter of io into termios, a Termios::Termios
+ * object, and returns it.  Unlike Termios.tcgetattr it allocates no
+ * objects, so a loop watching a port makes no garbage.  The Array
+ * returned by termios.cc is updated in place.
+ *
+ *   t = Termios.getattr(port)
+ *   loop {
+ *     Termios.getattr_into(port, t)
+ *     ...
+ *   }
+ *
+ * See also: tcgetattr(3)
+ */
+static VALUE
+termios_s_getattr_into(obj, io, param)
+    VALUE obj, io, param;
+{
+    struct termios t;
+
+    termios_check_Termios(param);
+    if (tcgetattr(termios_io_fileno(io), &t) < 0) {
+	rb_sys_fail("tcgetattr");
+    }
+
+    return termios_fill_Termios(param, &t);
+}
+
 /*
  * call-seq:
  *   Termios.tcsetattr(io, option, termios)
@@ -396,254 +506,10016 @@ static VALUE
 termios_s_tcsetattr(obj, io, opt, param)
     VALUE obj, io, opt, param;
 {
-    return termios_tcsetattr(io, opt, param);
+    return termios_tcsetattr(io, opt, param);
+}
+
+static VALUE update_locks;	/* fd => [Mutex, number of users] */
+
+struct update_arg {
+    VALUE io;
+    int fd;
+    int opt;
+    VALUE entry;
+};
+
+static VALUE
+termios_update_locked(ptr)
+    VALUE ptr;
+{
+    struct update_arg *arg = (struct update_arg *)ptr;
+    struct termios old, new;
+    VALUE obj;
+
+    if (tcgetattr(arg->fd, &old) < 0) {
+	rb_sys_fail("tcgetattr");
+    }
+    obj = termios_to_Termios(&old);
+    rb_yield(obj);
+
+    /* fields without a counterpart in Termios::Termios are kept */
+    new = old;
+    Termios_to_termios(obj, &new);
+    if (memcmp(&old, &new, sizeof(new)) != 0 &&
+	tcsetattr(termios_io_fileno(arg->io), arg->opt, &new) < 0) {
+	rb_sys_fail("tcsetattr");
+    }
+
+    return obj;
+}
+
+static VALUE
+termios_update_synchronize(ptr)
+    VALUE ptr;
+{
+    struct update_arg *arg = (struct update_arg *)ptr;
+
+    return rb_mutex_synchronize(RARRAY_AREF(arg->entry, 0),
+				termios_update_locked, ptr);
+}
+
+/*
+ * Drops the lock of the descriptor when nobody else uses or waits for it,
+ * so that the table does not grow with every descriptor ever updated.
+ */
+static VALUE
+termios_update_release(ptr)
+    VALUE ptr;
+{
+    struct update_arg *arg = (struct update_arg *)ptr;
+    long users = FIX2LONG(RARRAY_AREF(arg->entry, 1)) - 1;
+    VALUE fd = INT2FIX(arg->fd);
+
+    rb_ary_store(arg->entry, 1, LONG2FIX(users));
+    if (users == 0 && rb_hash_lookup(update_locks, fd) == arg->entry) {
+	rb_hash_delete(update_locks, fd);
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   Termios.update(io, option = Termios::TCSANOW) {|termios| ... }
+ *
+ * Reads the termios parameter of the io, yields it as a Termios::Termios
+ * object, and sets it to the io with option if the block changed it.
+ * Returns the object.
+ *
+ * Updates of the same file descriptor are serialised by a lock per
+ * descriptor, so threads changing different flags of one port do not lose
+ * each other's changes as separate tcgetattr and tcsetattr calls can.
+ * Nothing is written when the block leaves the parameter as it was.
+ *
+ *   Termios.update(port) {|t| t.iflag |= Termios::IXON }
+ *
+ * The lock only covers callers of this method in this process.
+ *
+ * See also: tcgetattr(3), tcsetattr(3)
+ */
+static VALUE
+termios_s_update(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    struct update_arg arg;
+    VALUE io, opt, fd;
+
+    rb_scan_args(argc, argv, "11", &io, &opt);
+    rb_need_block();
+    if (NIL_P(opt)) {
+	opt = INT2FIX(TCSANOW);
+    }
+    Check_Type(opt, T_FIXNUM);
+    if (rb_ary_includes(tcsetattr_opt, opt) != Qtrue) {
+	rb_raise(rb_eArgError, "wrong option value %d", FIX2INT(opt));
+    }
+
+    arg.io = io;
+    arg.fd = termios_io_fileno(io);
+    arg.opt = FIX2INT(opt);
+    fd = INT2FIX(arg.fd);
+    arg.entry = rb_hash_lookup(update_locks, fd);
+    if (NIL_P(arg.entry)) {
+	arg.entry = rb_ary_new3(2, rb_mutex_new(), INT2FIX(0));
+	rb_hash_aset(update_locks, fd, arg.entry);
+    }
+    rb_ary_store(arg.entry, 1,
+		 LONG2FIX(FIX2LONG(RARRAY_AREF(arg.entry, 1)) + 1));
+
+    return rb_ensure(termios_update_synchronize, (VALUE)&arg,
+		     termios_update_release, (VALUE)&arg);
+}
+
+/*
+ * The original termios of remembered file descriptors.  The table lives in
+ * C memory so that it can be restored from a signal handler; it is only
+ * changed with the crash signals blocked.  Each entry belongs to the
+ * process which saved it, so that a forked child exiting does not restore
+ * the terminals of its parent.
+ */
+struct remembered_termios {
+    int fd;
+    pid_t pid;
+    struct termios t;
+};
+
+static struct remembered_termios *volatile remembered;
+static volatile int nremembered;
+static int remembered_capa;
+
+static const int crash_signals[] = {
+    SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT,
+};
+#define NCRASH_SIGNALS ((int)(sizeof(crash_signals) / sizeof(crash_signals[0])))
+static struct sigaction crash_old_actions[NCRASH_SIGNALS];
+
+static int
+termios_restore_remembered()
+{
+    struct remembered_termios *r = remembered;
+    pid_t pid = getpid();
+    int i, n = 0;
+
+    for (i = 0; i < nremembered; i++) {
+	if (r[i].pid == pid && tcsetattr(r[i].fd, TCSANOW, &r[i].t) == 0) {
+	    n++;
+	}
+    }
+    return n;
+}
+
+static void
+termios_crash_handler(sig, info, ctx)
+    int sig;
+    siginfo_t *info;
+    void *ctx;
+{
+    int i;
+
+    termios_restore_remembered();
+
+    /* hand the signal to the handler which was there before */
+    for (i = 0; i < NCRASH_SIGNALS; i++) {
+	struct sigaction *old = &crash_old_actions[i];
+
+	if (crash_signals[i] != sig) {
+	    continue;
+	}
+	if (old->sa_flags & SA_SIGINFO) {
+	    old->sa_sigaction(sig, info, ctx);
+	}
+	else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+	    old->sa_handler(sig);
+	}
+	else {
+	    signal(sig, SIG_DFL);
+	    raise(sig);
+	}
+	return;
+    }
+}
+
+static void
+termios_restore_end_proc(data)
+    VALUE data;
+{
+    termios_restore_remembered();
+}
+
+static void
+termios_remember_hooks()
+{
+    static int installed;
+    struct sigaction sa;
+    int i;
+
+    if (installed) {
+	return;
+    }
+    installed = 1;
+    rb_set_end_proc(termios_restore_end_proc, Qnil);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = termios_crash_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    for (i = 0; i < NCRASH_SIGNALS; i++) {
+	sigaction(crash_signals[i], &sa, &crash_old_actions[i]);
+    }
+}
+
+static void
+termios_block_crash_signals(set, old)
+    sigset_t *set, *old;
+{
+    int i;
+
+    sigemptyset(set);
+    for (i = 0; i < NCRASH_SIGNALS; i++) {
+	sigaddset(set, crash_signals[i]);
+    }
+    pthread_sigmask(SIG_BLOCK, set, old);
+}
+
+/*
+ * call-seq:
+ *   Termios.remember(io)
+ *
+ * Saves the current termios parameter of the io, unless it is already
+ * saved, so that Termios.restore_all can put it back.  The saved
+ * parameters are also restored at exit and when the process dies of
+ * SIGSEGV, SIGBUS, SIGILL, SIGFPE or SIGABRT, without running Ruby code.
+ * Only the process which saved a parameter restores it; a forked child
+ * has to remember the io itself.  Returns the io.
+ *
+ * The parameters are kept per file descriptor; call Termios.forget
+ * before closing the io.
+ *
+ * See also: tcgetattr(3)
+ */
+static VALUE
+termios_s_remember(obj, io)
+    VALUE obj, io;
+{
+    struct termios t;
+    sigset_t set, old;
+    pid_t pid = getpid();
+    int fd = termios_io_fileno(io);
+    int i;
+
+    for (i = 0; i < nremembered; i++) {
+	if (remembered[i].fd == fd && remembered[i].pid == pid) {
+	    return io;
+	}
+    }
+    if (tcgetattr(fd, &t) < 0) {
+	rb_sys_fail("tcgetattr");
+    }
+    termios_remember_hooks();
+
+    termios_block_crash_signals(&set, &old);
+    for (i = 0; i < nremembered; i++) {
+	if (remembered[i].fd == fd) {	/* inherited from the parent */
+	    remembered[i].t = t;
+	    remembered[i].pid = pid;
+	    pthread_sigmask(SIG_SETMASK, &old, NULL);
+	    return io;
+	}
+    }
+    if (nremembered == remembered_capa) {
+	int capa = remembered_capa ? remembered_capa * 2 : 16;
+	struct remembered_termios *p = malloc(sizeof(*p) * capa);
+	struct remembered_termios *prev = remembered;
+
+	if (!p) {
+	    pthread_sigmask(SIG_SETMASK, &old, NULL);
+	    rb_memerror();
+	}
+	if (nremembered) {
+	    memcpy(p, prev, sizeof(*p) * nremembered);
+	}
+	/*
+	 * a crash handler in another thread may still be walking the old
+	 * table, so it is never freed; as the table doubles, less than
+	 * the table in use is kept this way
+	 */
+	remembered = p;
+	remembered_capa = capa;
+    }
+    remembered[nremembered].fd = fd;
+    remembered[nremembered].pid = pid;
+    remembered[nremembered].t = t;
+    nremembered++;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return io;
+}
+
+/*
+ * call-seq:
+ *   Termios.forget(io)
+ *
+ * Discards the parameter saved by Termios.remember for the io.  Returns
+ * true if one was saved.
+ */
+static VALUE
+termios_s_forget(obj, io)
+    VALUE obj, io;
+{
+    sigset_t set, old;
+    int fd = termios_io_fileno(io);
+    int i;
+
+    for (i = 0; i < nremembered; i++) {
+	if (remembered[i].fd == fd) {
+	    termios_block_crash_signals(&set, &old);
+	    remembered[i] = remembered[nremembered - 1];
+	    nremembered--;
+	    pthread_sigmask(SIG_SETMASK, &old, NULL);
+	    return Qtrue;
+	}
+    }
+    return Qfalse;
+}
+
+/*
+ * call-seq:
+ *   Termios.restore_all
+ *
+ * Sets every parameter saved by Termios.remember in this process back to
+ * its file descriptor in one native loop, and returns the number restored.
+ * Descriptors which fail (closed ones, for example) are skipped.  The
+ * parameters stay saved.
+ */
+static VALUE
+termios_s_restore_all(obj)
+    VALUE obj;
+{
+    return INT2NUM(termios_restore_remembered());
+}
+
+/*
+ * Runs in the child of the fork fallback of Termios.spawn_on_tty; only
+ * async-signal-safe calls.  Reports a failure through errfd.
+ */
+static void
+termios_spawn_child(fd, new_session, pgid, fg, argv, errfd)
+    int fd, new_session, fg, errfd;
+    pid_t pgid;
+    char **argv;
+{
+    sigset_t empty;
+    int err, i;
+
+    for (i = 1; i < NSIG; i++) {
+	signal(i, SIG_DFL);
+    }
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    if (new_session) {
+	if (setsid() < 0) goto fail;
+#ifdef TIOCSCTTY
+	/* as with the open(2) of the posix_spawn path, a terminal held by
+	   another session is left alone */
+	if (ioctl(fd, TIOCSCTTY, 0) < 0 && errno != EPERM) goto fail;
+#endif
+    }
+    else {
+	if (setpgid(0, pgid) < 0) goto fail;
+	if (fg) {
+	    /* a background process may not change the foreground */
+	    signal(SIGTTOU, SIG_IGN);
+	    if (tcsetpgrp(fd, getpgrp()) < 0) goto fail;
+	    signal(SIGTTOU, SIG_DFL);
+	}
+    }
+    if (dup2(fd, 0) < 0 || dup2(fd, 1) < 0 || dup2(fd, 2) < 0) goto fail;
+    if (fd > 2) close(fd);
+    execvp(argv[0], argv);
+
+  fail:
+    err = errno;
+    if (write(errfd, &err, sizeof(err)) < 0) {
+	/* nothing to do */
+    }
+    _exit(127);
+}
+
+static pid_t
+termios_spawn_fork(fd, new_session, pgid, fg, argv)
+    int fd, new_session, fg;
+    pid_t pgid;
+    char **argv;
+{
+    int pipefd[2], err = 0;
+    pid_t pid;
+    ssize_t n;
+
+    if (rb_cloexec_pipe(pipefd) < 0) {
+	rb_sys_fail("pipe");
+    }
+    pid = fork();
+    if (pid == 0) {
+	close(pipefd[0]);
+	termios_spawn_child(fd, new_session, pgid, fg, argv, pipefd[1]);
+    }
+    err = errno;
+    close(pipefd[1]);
+    if (pid < 0) {
+	close(pipefd[0]);
+	rb_syserr_fail(err, "fork");
+    }
+    /* the pipe closes on exec; data means the child failed */
+    while ((n = read(pipefd[0], &err, sizeof(err))) < 0 && errno == EINTR)
+	;
+    close(pipefd[0]);
+    if (n == sizeof(err)) {
+	waitpid(pid, NULL, 0);
+	rb_syserr_fail(err, argv[0]);
+    }
+    return pid;
+}
+
+/*
+ * call-seq:
+ *   Termios.spawn_on_tty(slave, argv, pgroup: :new, foreground: true)
+ *
+ * Starts the command argv (an array of a program, searched in PATH, and
+ * its arguments) with the terminal slave as its standard input, output
+ * and error, and returns its pid.
+ *
+ * If pgroup is :new, the child starts a new session with slave as its
+ * controlling terminal, and so is in the foreground of it; this is what
+ * a terminal emulator does for a shell.  (If slave is still the
+ * controlling terminal of another session, the child has none.)  If
+ * pgroup is an Integer, the child joins that process group (0 for a new
+ * one) in the session of slave, which must be the controlling terminal
+ * of the caller, and if foreground is true, the group becomes the
+ * foreground process group, as a shell does for a job.
+ *
+ * The child is created with posix_spawn(3), which does not copy the
+ * address space of the interpreter as fork(2) does.  Where posix_spawn
+ * cannot set up the terminal, fork(2) is used.
+ *
+ *   master, slave = Termios.openpty
+ *   pid = Termios.spawn_on_tty(slave, ["bash", "-i"])
+ *
+ * See also: posix_spawn(3), setsid(2), tcsetpgrp(3)
+ */
+static VALUE
+termios_s_spawn_on_tty(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    static ID keywords[2];
+    VALUE slave, args, opts, kw[2], path, pgroup, vargv;
+    char **cargv;
+    long i, n;
+    int fd, new_session, fg;
+    pid_t pgid = 0, pid = -1;
+
+    rb_scan_args(argc, argv, "2:", &slave, &args, &opts);
+    kw[0] = kw[1] = Qundef;
+    if (!NIL_P(opts)) {
+	if (!keywords[0]) {
+	    keywords[0] = rb_intern("pgroup");
+	    keywords[1] = rb_intern("foreground");
+	}
+	rb_get_kwargs(opts, keywords, 0, 2, kw);
+    }
+    pgroup = kw[0] == Qundef ? ID2SYM(rb_intern("new")) : kw[0];
+    fg = kw[1] == Qundef || RTEST(kw[1]);
+    if (SYMBOL_P(pgroup) && SYM2ID(pgroup) == rb_intern("new")) {
+	new_session = 1;
+    }
+    else {
+	new_session = 0;
+	pgid = NUM2PIDT(pgroup);
+    }
+
+    fd = termios_io_fileno(slave);
+    args = rb_ary_dup(rb_convert_type(args, T_ARRAY, "Array", "to_ary"));
+    n = RARRAY_LEN(args);
+    if (n == 0) {
+	rb_raise(rb_eArgError, "empty argv");
+    }
+    cargv = ALLOCV_N(char *, vargv, n + 1);
+    for (i = 0; i < n; i++) {
+	VALUE arg = rb_str_new_frozen(rb_obj_as_string(RARRAY_AREF(args, i)));
+
+	rb_ary_store(args, i, arg);
+	cargv[i] = (char *)StringValueCStr(arg);
+    }
+    cargv[n] = NULL;
+    path = Qnil;
+    if (new_session) {
+	const char *name = ttyname(fd);
+
+	if (!name) {
+	    rb_sys_fail("ttyname");
+	}
+	path = rb_str_new_cstr(name);
+    }
+
+#if defined(HAVE_POSIX_SPAWNP) && defined(POSIX_SPAWN_SETSID)
+    if (new_session || !fg || HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDTCSETPGRP_NP) {
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t all, none;
+	short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+	int err;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawnattr_init(&attr);
+	sigfillset(&all);
+	sigemptyset(&none);
+	posix_spawnattr_setsigdefault(&attr, &all);
+	posix_spawnattr_setsigmask(&attr, &none);
+	if (new_session) {
+	    /* opening the tty after setsid makes it the controlling one */
+	    flags |= POSIX_SPAWN_SETSID;
+	    posix_spawn_file_actions_addopen(&fa, 0, RSTRING_PTR(path), O_RDWR, 0);
+	    posix_spawn_file_actions_adddup2(&fa, 0, 1);
+	    posix_spawn_file_actions_adddup2(&fa, 0, 2);
+	}
+	else {
+	    flags |= POSIX_SPAWN_SETPGROUP;
+	    posix_spawnattr_setpgroup(&attr, pgid);
+	    posix_spawn_file_actions_adddup2(&fa, fd, 0);
+	    posix_spawn_file_actions_adddup2(&fa, fd, 1);
+	    posix_spawn_file_actions_adddup2(&fa, fd, 2);
+#if HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDTCSETPGRP_NP
+	    if (fg) {
+		posix_spawn_file_actions_addtcsetpgrp_np(&fa, 0);
+	    }
+#endif
+	}
+	posix_spawnattr_setflags(&attr, flags);
+	err = posix_spawnp(&pid, cargv[0], &fa, &attr, cargv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+	if (err) {
+	    ALLOCV_END(vargv);
+	    rb_syserr_fail_str(err, RARRAY_AREF(args, 0));
+	}
+    }
+    else
+#endif
+    pid = termios_spawn_fork(fd, new_session, pgid, fg, cargv);
+
+    if (!new_session) {
+	/* as shells do, also from the parent, so it does not race */
+	setpgid(pid, pgid ? pgid : pid);
+    }
+    ALLOCV_END(vargv);
+    RB_GC_GUARD(args);
+    RB_GC_GUARD(path);
+
+    return PIDT2NUM(pid);
+}
+
+/*
+ * call-seq:
+ *   Termios.tcsendbreak(io, duration)
+ *   io.tcsendbreak(duration)
+ *
+ * Sends a continuous stream of 0-bits for a specific duration.
+ *
+ * See also: tcsendbreak(3)
+ */
+static VALUE
+termios_tcsendbreak(io, duration)
+    VALUE io, duration;
+{
+    OpenFile *fptr;
+
+    Check_Type(io,       T_FILE);
+    Check_Type(duration, T_FIXNUM);
+
+    GetOpenFile(io, fptr);
+    if (tcsendbreak(FILENO(fptr), FIX2INT(duration)) < 0) {
+        rb_sys_fail("tcsendbreak");
+    }
+
+    return Qtrue;
+}
+
+static VALUE
+termios_s_tcsendbreak(obj, io, duration)
+    VALUE obj, io, duration;
+{
+    return termios_tcsendbreak(io, duration);
+}
+
+/*
+ * call-seq:
+ *   Termios.tcdrain(io)
+ *   io.tcdrain
+ *
+ * Waits until all output to the object has been sent.
+ *
+ * See also: tcdrain(3)
+ */
+static VALUE
+termios_tcdrain(io)
+    VALUE io;
+{
+    OpenFile *fptr;
+
+    Check_Type(io, T_FILE);
+
+    GetOpenFile(io, fptr);
+    if (tcdrain(FILENO(fptr)) < 0) {
+        rb_sys_fail("tcdrain");
+    }
+
+    return Qtrue;
+}
+
+static VALUE
+termios_s_tcdrain(obj, io)
+    VALUE obj, io;
+{
+    return termios_tcdrain(io);
+}
+
+/*
+ * call-seq:
+ *   Termios.tcflush(io, qs)
+ *   io.tcflush(qs)
+ *
+ * Cancels data written to the object but not send or data received but not
+ * read.
+ *
+ * See also: tcflush(3)
+ */
+static VALUE
+termios_tcflush(io, qs)
+    VALUE io, qs;
+{
+    OpenFile *fptr;
+    int queue_selector;
+
+    Check_Type(io, T_FILE);
+    Check_Type(qs, T_FIXNUM);
+    queue_selector = FIX2INT(qs);
+    if (rb_ary_includes(tcflush_qs, qs) != Qtrue) {
+	rb_raise(rb_eArgError, 
+		 "wrong queue-selector value %d", queue_selector);
+    }
+
+    GetOpenFile(io, fptr);
+    if (tcflush(FILENO(fptr), queue_selector) < 0) {
+        rb_sys_fail("tcflush");
+    }
+
+    return Qtrue;
+}
+
+static VALUE
+termios_s_tcflush(obj, io, qs)
+    VALUE obj, io, qs;
+{
+    return termios_tcflush(io, qs);
+}
+
+/*
+ * call-seq:
+ *   Termios.tcflow(io, action)
+ *   io.tcflow(action)
+ *
+ * Suspends write or read of data on the object.
+ *
+ * See also: tcflow(3)
+ */
+static VALUE
+termios_tcflow(io, act)
+    VALUE io, act;
+{
+    OpenFile *fptr;
+    int action;
+
+    Check_Type(io,  T_FILE);
+    Check_Type(act, T_FIXNUM);
+    action = FIX2INT(act);
+    if (rb_ary_includes(tcflow_act, act) != Qtrue) {
+	rb_raise(rb_eArgError, 
+		 "wrong action value %d", action);
+    }
+
+    GetOpenFile(io, fptr);
+    if (tcflow(FILENO(fptr), action) < 0) {
+        rb_sys_fail("tcflow");
+    }
+
+    return Qtrue;
+}
+
+static VALUE
+termios_s_tcflow(obj, io, act)
+    VALUE obj, io, act;
+{
+    return termios_tcflow(io, act);
+}
+
+/*
+ * call-seq:
+ *   Termios.tcgetpgrp(io)
+ *   io.tcgetpgrp
+ *
+ * Returns the process group ID of the foreground process group  the
+ * terminal associated to the object.
+ *
+ * See also: tcgetpgrp(3)
+ */
+static VALUE
+termios_tcgetpgrp(io)
+    VALUE io;
+{
+    OpenFile *fptr;
+    pid_t pid;
+
+    Check_Type(io,  T_FILE);
+    GetOpenFile(io, fptr);
+    if ((pid = tcgetpgrp(FILENO(fptr))) < 0) {
+        rb_sys_fail("tcgetpgrp");
+    }
+
+    return LONG2NUM(pid);
+}
+
+static VALUE
+termios_s_tcgetpgrp(obj, io)
+    VALUE obj, io;
+{
+    return termios_tcgetpgrp(io);
+}
+
+/*
+ * call-seq:
+ *   Termios.tcsetpgrp(io, pgrpid)
+ *   io.tcsetpgrp(pgrpid)
+ *
+ * Makes the process group with pgrpid the foreground process group on the
+ * terminal associated to the object.
+ *
+ * See also: tcsetpgrp(3)
+ */
+static VALUE
+termios_tcsetpgrp(io, pgrpid)
+    VALUE io, pgrpid;
+{
+    OpenFile *fptr;
+    pid_t pgrp;
+
+    Check_Type(io,     T_FILE);
+    pgrp = NUM2LONG(pgrpid);
+
+    GetOpenFile(io, fptr);
+    if (tcsetpgrp(FILENO(fptr), pgrp) < 0) {
+        rb_sys_fail("tcsetpgrp");
+    }
+
+    return Qtrue;
+}
+
+static VALUE
+termios_s_tcsetpgrp(obj, io, pgrpid)
+    VALUE obj, io, pgrpid;
+{
+    return termios_tcsetpgrp(io, pgrpid);
+}
+
+#if defined(TIOCGETD)
+/*
+ * call-seq:
+ *   Termios.line_discipline(io)
+ *   io.line_discipline
+ *
+ * Returns the line discipline of the terminal associated to the object.
+ * The value is one of Termios::LINE_DISCIPLINES, for example Termios::N_TTY
+ * on Linux or Termios::TTYDISC on BSD.
+ *
+ * See also: tty_ioctl(4), TIOCGETD
+ */
+static VALUE
+termios_line_discipline(io)
+    VALUE io;
+{
+    OpenFile *fptr;
+    int ldisc;
+
+    Check_Type(io, T_FILE);
+    GetOpenFile(io, fptr);
+    if (ioctl(FILENO(fptr), TIOCGETD, &ldisc) < 0) {
+	rb_sys_fail("TIOCGETD");
+    }
+
+    return INT2FIX(ldisc);
+}
+
+static VALUE
+termios_s_line_discipline(obj, io)
+    VALUE obj, io;
+{
+    return termios_line_discipline(io);
+}
+#endif
+
+#if defined(TIOCSETD)
+/*
+ * call-seq:
+ *   Termios.set_line_discipline(io, ldisc)
+ *   io.set_line_discipline(ldisc)
+ *
+ * Changes the line discipline of the terminal associated to the object,
+ * for example to Termios::N_SLIP or Termios::N_HDLC to let the kernel do
+ * the framing of the protocol.
+ *
+ * See also: tty_ioctl(4), TIOCSETD
+ */
+static VALUE
+termios_set_line_discipline(io, ldisc)
+    VALUE io, ldisc;
+{
+    OpenFile *fptr;
+    int ld;
+
+    Check_Type(io,    T_FILE);
+    Check_Type(ldisc, T_FIXNUM);
+    ld = FIX2INT(ldisc);
+
+    GetOpenFile(io, fptr);
+    if (ioctl(FILENO(fptr), TIOCSETD, &ld) < 0) {
+	rb_sys_fail("TIOCSETD");
+    }
+
+    return Qtrue;
+}
+
+static VALUE
+termios_s_set_line_discipline(obj, io, ldisc)
+    VALUE obj, io, ldisc;
+{
+    return termios_set_line_discipline(io, ldisc);
+}
+#endif
+
+/*
+ * Opens a new pseudo terminal and stores the file descriptors of the
+ * master and the slave to fds.  Returns -1 on failure.
+ */
+static int
+termios_openpty0(fds, t, ws)
+    int *fds;
+    struct termios *t;
+    struct winsize *ws;
+{
+#if defined(HAVE_OPENPTY)
+    return openpty(&fds[0], &fds[1], NULL, t, ws);
+#elif defined(HAVE_POSIX_OPENPT)
+    const char *name;
+    int e;
+
+    if ((fds[0] = posix_openpt(O_RDWR|O_NOCTTY)) < 0) {
+	return -1;
+    }
+    if (grantpt(fds[0]) < 0 || unlockpt(fds[0]) < 0 ||
+	(name = ptsname(fds[0])) == NULL ||
+	(fds[1] = open(name, O_RDWR|O_NOCTTY)) < 0) {
+	e = errno;
+	close(fds[0]);
+	errno = e;
+	return -1;
+    }
+    if ((t && tcsetattr(fds[1], TCSANOW, t) < 0) ||
+	(ws && ioctl(fds[1], TIOCSWINSZ, ws) < 0)) {
+	e = errno;
+	close(fds[0]);
+	close(fds[1]);
+	errno = e;
+	return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void
+termios_winsize_from_ary(ary, ws)
+    VALUE ary;
+    struct winsize *ws;
+{
+    Check_Type(ary, T_ARRAY);
+    if (RARRAY_LEN(ary) != 2 && RARRAY_LEN(ary) != 4) {
+	rb_raise(rb_eArgError,
+		 "winsize must be [rows, cols] or [rows, cols, xpixel, ypixel]");
+    }
+    memset(ws, 0, sizeof(*ws));
+    ws->ws_row = NUM2USHORT(rb_ary_entry(ary, 0));
+    ws->ws_col = NUM2USHORT(rb_ary_entry(ary, 1));
+    if (RARRAY_LEN(ary) == 4) {
+	ws->ws_xpixel = NUM2USHORT(rb_ary_entry(ary, 2));
+	ws->ws_ypixel = NUM2USHORT(rb_ary_entry(ary, 3));
+    }
+}
+
+static void
+termios_check_Termios(param)
+    VALUE param;
+{
+    if (CLASS_OF(param) != cTermios) {
+	const char *type = rb_class2name(CLASS_OF(param));
+	rb_raise(rb_eTypeError, 
+		 "wrong argument type %s (expected Termios::Termios)", 
+		 type);
+    }
+}
+
+/*
+ * call-seq:
+ *   Termios.getwinsize(io)
+ *   io.getwinsize
+ *
+ * Returns the window size of the terminal associated to the object as an
+ * Array of [rows, cols, xpixel, ypixel].
+ *
+ * See also: tty_ioctl(4), TIOCGWINSZ
+ */
+static VALUE
+termios_getwinsize(io)
+    VALUE io;
+{
+    OpenFile *fptr;
+    struct winsize ws;
+
+    Check_Type(io, T_FILE);
+    GetOpenFile(io, fptr);
+    if (ioctl(FILENO(fptr), TIOCGWINSZ, &ws) < 0) {
+	rb_sys_fail("TIOCGWINSZ");
+    }
+
+    return rb_ary_new3(4, INT2FIX(ws.ws_row), INT2FIX(ws.ws_col),
+		       INT2FIX(ws.ws_xpixel), INT2FIX(ws.ws_ypixel));
+}
+
+static VALUE
+termios_s_getwinsize(obj, io)
+    VALUE obj, io;
+{
+    return termios_getwinsize(io);
+}
+
+/*
+ * call-seq:
+ *   Termios.setwinsize(io, winsize)
+ *   io.setwinsize(winsize)
+ *
+ * Sets the window size of the terminal associated to the object.  The
+ * winsize is an Array of [rows, cols] or [rows, cols, xpixel, ypixel].
+ *
+ * See also: tty_ioctl(4), TIOCSWINSZ
+ */
+static VALUE
+termios_setwinsize(io, winsize)
+    VALUE io, winsize;
+{
+    OpenFile *fptr;
+    struct winsize ws;
+
+    Check_Type(io, T_FILE);
+    termios_winsize_from_ary(winsize, &ws);
+
+    GetOpenFile(io, fptr);
+    if (ioctl(FILENO(fptr), TIOCSWINSZ, &ws) < 0) {
+	rb_sys_fail("TIOCSWINSZ");
+    }
+
+    return Qtrue;
+}
+
+static VALUE
+termios_s_setwinsize(obj, io, winsize)
+    VALUE obj, io, winsize;
+{
+    return termios_setwinsize(io, winsize);
+}
+
+/*
+ * call-seq:
+ *   Termios.openpty(termios: nil, winsize: nil)
+ *
+ * Opens a new pseudo terminal and returns its master and slave as an
+ * Array of IO objects.  If termios (a Termios::Termios object) or winsize
+ * (an Array of [rows, cols] or [rows, cols, xpixel, ypixel]) are given,
+ * they are set to the slave before the pair is returned.
+ *
+ *   require 'termios'
+ *
+ *   t = Termios.new_termios
+ *   ...
+ *   master, slave = Termios.openpty(termios: t, winsize: [24, 80])
+ *
+ * See also: openpty(3), posix_openpt(3)
+ */
+static VALUE
+termios_s_openpty(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    static ID keywords[2];
+    VALUE opts, kwargs[2], master, slave;
+    OpenFile *fptr;
+    struct termios t, *tp = NULL;
+    struct winsize ws, *wsp = NULL;
+    const char *name;
+    int fds[2];
+
+    rb_scan_args(argc, argv, "0:", &opts);
+    kwargs[0] = kwargs[1] = Qundef;
+    if (!NIL_P(opts)) {
+	if (!keywords[0]) {
+	    keywords[0] = rb_intern("termios");
+	    keywords[1] = rb_intern("winsize");
+	}
+	rb_get_kwargs(opts, keywords, 0, 2, kwargs);
+    }
+    if (kwargs[0] != Qundef && !NIL_P(kwargs[0])) {
+	termios_check_Termios(kwargs[0]);
+	memset(&t, 0, sizeof(t));
+	Termios_to_termios(kwargs[0], &t);
+	tp = &t;
+    }
+    if (kwargs[1] != Qundef && !NIL_P(kwargs[1])) {
+	termios_winsize_from_ary(kwargs[1], &ws);
+	wsp = &ws;
+    }
+
+    if (termios_openpty0(fds, tp, wsp) < 0) {
+	rb_sys_fail("openpty");
+    }
+    rb_update_max_fd(fds[0]);
+    rb_update_max_fd(fds[1]);
+    rb_fd_fix_cloexec(fds[0]);
+    rb_fd_fix_cloexec(fds[1]);
+
+    name = ptsname(fds[0]);
+    master = rb_io_fdopen(fds[0], O_RDWR, NULL);
+    slave = rb_io_fdopen(fds[1], O_RDWR, name);
+    GetOpenFile(master, fptr);
+    rb_io_synchronized(fptr);
+    GetOpenFile(slave, fptr);
+    rb_io_synchronized(fptr);
+
+    return rb_assoc_new(master, slave);
+}
+
+#define RELAY_BUFSIZE 65536
+
+struct relay_dir {
+    int src, dst;
+    char *buf;
+    long off, len;
+    long total;
+};
+
+struct relay_arg {
+    struct relay_dir dir[2];	/* 0: master to peer, 1: peer to master */
+    int packet;
+    int ctrl;
+    int eof;
+    int err;
+};
+
+/*
+ * Reads a chunk for dir.  Returns 0 on end of file, -1 on error and 1
+ * otherwise.
+ */
+static int
+termios_relay_read(arg, dir, from_master)
+    struct relay_arg *arg;
+    struct relay_dir *dir;
+    int from_master;
+{
+    ssize_t n = read(dir->src, dir->buf, RELAY_BUFSIZE);
+
+    if (n < 0) {
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	    return 1;
+	}
+	if (from_master && errno == EIO) {	/* the slave is closed */
+	    return 0;
+	}
+	arg->err = errno;
+	return -1;
+    }
+    if (n == 0) {
+	return 0;
+    }
+    dir->off = 0;
+    dir->len = n;
+    if (from_master && arg->packet) {
+	dir->off = 1;
+	if (dir->buf[0] != 0) {		/* TIOCPKT_DATA */
+	    arg->ctrl = (unsigned char)dir->buf[0];
+	    dir->len = 1;
+	}
+    }
+    return 1;
+}
+
+static int
+termios_relay_write(arg, dir)
+    struct relay_arg *arg;
+    struct relay_dir *dir;
+{
+    ssize_t n = write(dir->dst, dir->buf + dir->off, dir->len - dir->off);
+
+    if (n < 0) {
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	    return 1;
+	}
+	arg->err = errno;
+	return -1;
+    }
+    dir->off += n;
+    dir->total += n;
+    return 1;
+}
+
+/*
+ * Writes out the rest of the chunk of dir, when the other direction
+ * reached end of file.  A write error ends it.
+ */
+static void
+termios_relay_flush(arg, dir)
+    struct relay_arg *arg;
+    struct relay_dir *dir;
+{
+    while (dir->off < dir->len) {
+	struct pollfd pfd;
+	long off = dir->off;
+
+	if (termios_relay_write(arg, dir) < 0) {
+	    arg->err = 0;	/* the end of file is what is reported */
+	    break;
+	}
+	if (dir->off == off) {
+	    pfd.fd = dir->dst;
+	    pfd.events = POLLOUT;
+	    if (poll(&pfd, 1, -1) < 0) {
+		break;
+	    }
+	}
+    }
+}
+
+static void *
+termios_relay_body(ptr)
+    void *ptr;
+{
+    struct relay_arg *arg = ptr;
+    struct relay_dir *out = &arg->dir[0], *in = &arg->dir[1];
+
+    for (;;) {
+	struct pollfd pfd[2];
+	int out_pending = out->off < out->len;
+	int in_pending = in->off < in->len;
+	int r;
+
+	/* a direction reads only when its previous chunk is written out */
+	pfd[0].fd = out->src;
+	pfd[0].events = (out_pending ? 0 : POLLIN) | (in_pending ? POLLOUT : 0);
+	pfd[1].fd = in->src;
+	pfd[1].events = (in_pending ? 0 : POLLIN) | (out_pending ? POLLOUT : 0);
+	/* POLLHUP is reported even without events; leave out an idle side */
+	if (pfd[0].events == 0) {
+	    pfd[0].fd = -1;
+	}
+	if (pfd[1].events == 0) {
+	    pfd[1].fd = -1;
+	}
+	if (poll(pfd, 2, -1) < 0) {
+	    arg->err = errno;
+	    break;
+	}
+
+	if (out_pending) {
+	    if (pfd[1].revents & (POLLOUT|POLLERR|POLLHUP) &&
+		termios_relay_write(arg, out) < 0) {
+		break;
+	    }
+	}
+	else if (pfd[0].revents & (POLLIN|POLLERR|POLLHUP)) {
+	    if ((r = termios_relay_read(arg, out, 1)) <= 0) {
+		arg->eof = (r == 0);
+		if (arg->eof) {
+		    termios_relay_flush(arg, in);
+		}
+		break;
+	    }
+	    if (arg->ctrl >= 0) {
+		break;
+	    }
+	}
+
+	if (in_pending) {
+	    if (pfd[0].revents & (POLLOUT|POLLERR|POLLHUP) &&
+		termios_relay_write(arg, in) < 0) {
+		break;
+	    }
+	}
+	else if (pfd[1].revents & (POLLIN|POLLERR|POLLHUP)) {
+	    if ((r = termios_relay_read(arg, in, 0)) <= 0) {
+		arg->eof = (r == 0);
+		if (arg->eof) {
+		    termios_relay_flush(arg, out);
+		}
+		break;
+	    }
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ * call-seq:
+ *   Termios.relay(master, peer, packet: false)
+ *   Termios.relay(master, peer, packet: true) {|ctrl| ... }
+ *
+ * Copies data between a pseudo terminal master and peer (a socket, for
+ * example) in both directions until either side is closed, and returns the
+ * numbers of bytes copied as [master to peer, peer to master].  The copy
+ * runs in native code without the GVL, with one buffer per direction; a
+ * direction does not read more until its previous chunk is written, so a
+ * slow receiver throttles its sender.
+ *
+ * If packet is true, the master must be in packet mode (TIOCPKT).  The
+ * leading byte of each packet is stripped, and the control byte of
+ * packets without data (a combination of Termios::TIOCPKT_FLUSHREAD,
+ * Termios::TIOCPKT_STOP and so on) is yielded to the block.
+ *
+ * See also: tty_ioctl(4), TIOCPKT
+ */
+static VALUE
+termios_s_relay(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    static ID keywords[1];
+    struct relay_arg arg;
+    VALUE master, peer, opts, packet = Qundef, bufs;
+
+    rb_scan_args(argc, argv, "2:", &master, &peer, &opts);
+    if (!NIL_P(opts)) {
+	if (!keywords[0]) {
+	    keywords[0] = rb_intern("packet");
+	}
+	rb_get_kwargs(opts, keywords, 0, 1, &packet);
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.packet = packet != Qundef && RTEST(packet);
+    bufs = rb_str_tmp_new(RELAY_BUFSIZE * 2);
+    arg.dir[0].buf = RSTRING_PTR(bufs);
+    arg.dir[1].buf = RSTRING_PTR(bufs) + RELAY_BUFSIZE;
+
+    for (;;) {
+	arg.dir[0].src = arg.dir[1].dst = termios_io_fileno(master);
+	arg.dir[1].src = arg.dir[0].dst = termios_io_fileno(peer);
+	arg.ctrl = -1;
+	arg.err = 0;
+	termios_without_gvl(termios_relay_body, &arg, RUBY_UBF_IO, 0);
+	if (arg.eof) {
+	    break;
+	}
+	if (arg.ctrl >= 0) {
+	    if (rb_block_given_p()) {
+		rb_yield(INT2FIX(arg.ctrl));
+	    }
+	    continue;
+	}
+	if (arg.err != EINTR) {
+	    errno = arg.err;
+	    rb_sys_fail("relay");
+	}
+	rb_thread_check_ints();
+    }
+    rb_str_resize(bufs, 0);
+
+    return rb_assoc_new(LONG2NUM(arg.dir[0].total), LONG2NUM(arg.dir[1].total));
+}
+
+/*
+ * call-seq:
+ *   Termios.new_termios
+ *
+ * Returns new Termios::Termios object.
+ */
+static VALUE
+termios_s_newtermios(argc, argv, klass)
+    int argc;
+    VALUE *argv;
+    VALUE klass;
+{
+    return rb_funcall2(cTermios, id_new, argc, argv);
+}
+
+/*
+ * call-seq:
+ *   termios.dup
+ *
+ * Produces a shallow copy of the object.
+ */
+static VALUE
+termios_dup(self)
+    VALUE self;
+{
+    VALUE result;
+    VALUE cc_ary;
+
+    result = rb_call_super(0, 0);
+    cc_ary = rb_ivar_get(self, id_cc);
+    rb_ivar_set(result, id_cc, rb_ary_dup(cc_ary));
+
+    return result;
+}
+
+#define OUTPUT_NL	1
+#define OUTPUT_CR	2
+#define OUTPUT_TAB	3
+#define OUTPUT_BS	4
+#define OUTPUT_LOWER	5
+#define OUTPUT_CNTRL	6
+#define OUTPUT_CONT	7
+
+static unsigned char output_class[256];
+
+static void
+init_output_class()
+{
+    int c;
+
+    for (c = 0; c < 0x20; c++) output_class[c] = OUTPUT_CNTRL;
+    output_class[0x7f] = OUTPUT_CNTRL;
+    for (c = 'a'; c <= 'z'; c++) output_class[c] = OUTPUT_LOWER;
+    for (c = 0x80; c < 0xc0; c++) output_class[c] = OUTPUT_CONT;
+    output_class['\n'] = OUTPUT_NL;
+    output_class['\r'] = OUTPUT_CR;
+    output_class['\t'] = OUTPUT_TAB;
+    output_class['\b'] = OUTPUT_BS;
+}
+
+/*
+ * Applies the output processing of oflag to src as the tty driver does.
+ * Writes the result to dst unless it is NULL, and returns its length.
+ * The column is updated.
+ */
+static long
+termios_output_process(oflag, iflag, src, len, dst, column)
+    tcflag_t oflag, iflag;
+    const unsigned char *src;
+    long len;
+    unsigned char *dst;
+    long *column;
+{
+    long i, n = 0, col = *column;
+    int expand_tabs = 0, utf8 = 0;
+
+#if defined(TABDLY) && defined(XTABS)
+    expand_tabs = (oflag & TABDLY) == XTABS;
+#elif defined(TABDLY) && defined(TAB3)
+    expand_tabs = (oflag & TABDLY) == TAB3;
+#endif
+#if defined(OXTABS)
+    expand_tabs = expand_tabs || (oflag & OXTABS);
+#endif
+#if defined(IUTF8)
+    utf8 = (iflag & IUTF8) != 0;
+#endif
+
+    for (i = 0; i < len; i++) {
+	unsigned char c = src[i];
+
+	switch (output_class[c]) {
+	  case OUTPUT_NL:
+#ifdef ONLRET
+	    if (oflag & ONLRET) col = 0;
+#endif
+#ifdef ONLCR
+	    if (oflag & ONLCR) {
+		if (dst) dst[n] = '\r';
+		n++;
+		col = 0;
+	    }
+#endif
+	    break;
+	  case OUTPUT_CR:
+#ifdef ONOCR
+	    if ((oflag & ONOCR) && col == 0) {
+		continue;
+	    }
+#endif
+#ifdef OCRNL
+	    if (oflag & OCRNL) {
+		c = '\n';
+#ifdef ONLRET
+		if (oflag & ONLRET) col = 0;
+#endif
+		break;
+	    }
+#endif
+	    col = 0;
+	    break;
+	  case OUTPUT_TAB:
+	    {
+		long spaces = 8 - (col & 7);
+
+		col += spaces;
+		if (expand_tabs) {
+		    if (dst) memset(dst + n, ' ', spaces);
+		    n += spaces;
+		    continue;
+		}
+	    }
+	    break;
+	  case OUTPUT_BS:
+	    if (col > 0) col--;
+	    break;
+	  case OUTPUT_LOWER:
+#ifdef OLCUC
+	    if (oflag & OLCUC) c -= 'a' - 'A';
+#endif
+	    col++;
+	    break;
+	  case OUTPUT_CNTRL:
+	    break;
+	  case OUTPUT_CONT:
+	    if (!utf8) col++;
+	    break;
+	  default:
+	    col++;
+	    break;
+	}
+	if (dst) dst[n] = c;
+	n++;
+    }
+    *column = col;
+
+    return n;
+}
+
+/*
+ * call-seq:
+ *   termios.process_output(str, column = 0)
+ *
+ * Returns a new String which is str translated by the output modes of the
+ * object, as the tty driver does when OPOST is set: ONLCR, OCRNL, ONOCR,
+ * ONLRET, OLCUC and tab expansion of TABDLY (XTABS).  The column is the
+ * cursor column at the beginning of str, which ONOCR and tab expansion
+ * depend on.  Delays and fill characters are not generated.
+ *
+ * It lets a program turn OPOST of the terminal off and still write
+ * correctly translated output.
+ *
+ *   t = Termios.tcgetattr($stdout)
+ *   raw = t.dup
+ *   raw.oflag &= ~Termios::OPOST
+ *   Termios.tcsetattr($stdout, Termios::TCSANOW, raw)
+ *   $stdout.write(t.process_output("line 1\nline 2\n"))
+ */
+static VALUE
+termios_process_output(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    VALUE str, column, result;
+    tcflag_t oflag, iflag;
+    const unsigned char *src;
+    long len, outlen, col, col0;
+
+    rb_scan_args(argc, argv, "11", &str, &column);
+    StringValue(str);
+    col0 = NIL_P(column) ? 0 : NUM2LONG(column);
+    oflag = NUM2ULONG(rb_ivar_get(self, id_oflag));
+    iflag = NUM2ULONG(rb_ivar_get(self, id_iflag));
+
+    if (!(oflag & OPOST)) {
+	return rb_str_dup(str);
+    }
+
+    str = rb_str_new_frozen(str);
+    src = (const unsigned char *)RSTRING_PTR(str);
+    len = RSTRING_LEN(str);
+
+    col = col0;
+    outlen = termios_output_process(oflag, iflag, src, len, NULL, &col);
+    result = rb_str_new(NULL, outlen);
+    col = col0;
+    termios_output_process(oflag, iflag, src, len,
+			   (unsigned char *)RSTRING_PTR(result), &col);
+    rb_enc_copy(result, str);
+    RB_GC_GUARD(str);
+
+    return result;
+}
+
+/*
+ * Returns the bit rate of the speed value, or 0 if it is unknown.
+ */
+static unsigned long
+termios_speed_to_bps(speed)
+    speed_t speed;
+{
+    switch (speed) {
+#ifdef B50
+      case B50: return 50;
+#endif
+#ifdef B75
+      case B75: return 75;
+#endif
+#ifdef B110
+      case B110: return 110;
+#endif
+#ifdef B134
+      case B134: return 134;
+#endif
+#ifdef B150
+      case B150: return 150;
+#endif
+#ifdef B200
+      case B200: return 200;
+#endif
+#ifdef B300
+      case B300: return 300;
+#endif
+#ifdef B600
+      case B600: return 600;
+#endif
+#ifdef B1200
+      case B1200: return 1200;
+#endif
+#ifdef B1800
+      case B1800: return 1800;
+#endif
+#ifdef B2400
+      case B2400: return 2400;
+#endif
+#ifdef B4800
+      case B4800: return 4800;
+#endif
+#ifdef B9600
+      case B9600: return 9600;
+#endif
+#ifdef B19200
+      case B19200: return 19200;
+#endif
+#ifdef B38400
+      case B38400: return 38400;
+#endif
+#ifdef B57600
+      case B57600: return 57600;
+#endif
+#ifdef B115200
+      case B115200: return 115200;
+#endif
+#ifdef B230400
+      case B230400: return 230400;
+#endif
+#ifdef B460800
+      case B460800: return 460800;
+#endif
+#ifdef B500000
+      case B500000: return 500000;
+#endif
+#ifdef B576000
+      case B576000: return 576000;
+#endif
+#ifdef B921600
+      case B921600: return 921600;
+#endif
+#ifdef B1000000
+      case B1000000: return 1000000;
+#endif
+#ifdef B1152000
+      case B1152000: return 1152000;
+#endif
+#ifdef B1500000
+      case B1500000: return 1500000;
+#endif
+#ifdef B2000000
+      case B2000000: return 2000000;
+#endif
+#ifdef B2500000
+      case B2500000: return 2500000;
+#endif
+#ifdef B3000000
+      case B3000000: return 3000000;
+#endif
+#ifdef B3500000
+      case B3500000: return 3500000;
+#endif
+#ifdef B4000000
+      case B4000000: return 4000000;
+#endif
+      default:
+	break;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the time in seconds to transfer one character at the speed
+ * with the character format of cflag (start bit, data bits, parity bit
+ * and stop bits), or 0.0 if the speed is unknown.
+ */
+static double
+termios_char_time(speed, cflag)
+    speed_t speed;
+    tcflag_t cflag;
+{
+    unsigned long bps;
+    int bits;
+
+    if ((bps = termios_speed_to_bps(speed)) == 0) {
+	return 0.0;
+    }
+
+    switch (cflag & CSIZE) {
+      case CS5: bits = 5; break;
+      case CS6: bits = 6; break;
+      case CS7: bits = 7; break;
+      default:  bits = 8; break;
+    }
+    bits += 1;			/* start bit */
+    if (cflag & PARENB) bits += 1;
+    bits += (cflag & CSTOPB) ? 2 : 1;
+
+    return (double)bits / bps;
+}
+
+/*
+ * call-seq:
+ *   termios.char_time
+ *
+ * Returns the time in seconds one character takes on the line at ispeed
+ * with the character format of cflag, or 0.0 if the speed is unknown.
+ *
+ *   t = Termios.tcgetattr(port)
+ *   t.char_time * 3.5		# the Modbus RTU inter-frame gap
+ */
+static VALUE
+termios_get_char_time(self)
+    VALUE self;
+{
+    speed_t speed = NUM2ULONG(rb_ivar_get(self, id_ispeed));
+    tcflag_t cflag = NUM2ULONG(rb_ivar_get(self, id_cflag));
+
+    return DBL2NUM(termios_char_time(speed, cflag));
+}
+
+/*
+ * The fields of a Termios::Termios in a zeroed struct, so that two of
+ * them compare and hash with memcmp and rb_memhash.  A struct termios is
+ * not used, as cfsetospeed(3) folds the speed into c_cflag on some
+ * systems.
+ */
+struct termios_key {
+    tcflag_t iflag, oflag, cflag, lflag;
+    speed_t ispeed, ospeed;
+    cc_t cc[NCCS];
+};
+
+static void
+termios_make_key(obj, key)
+    VALUE obj;
+    struct termios_key *key;
+{
+    VALUE cc_ary;
+    int i;
+
+    memset(key, 0, sizeof(*key));
+    key->iflag = NUM2ULONG(rb_ivar_get(obj, id_iflag));
+    key->oflag = NUM2ULONG(rb_ivar_get(obj, id_oflag));
+    key->cflag = NUM2ULONG(rb_ivar_get(obj, id_cflag));
+    key->lflag = NUM2ULONG(rb_ivar_get(obj, id_lflag));
+    key->ispeed = NUM2ULONG(rb_ivar_get(obj, id_ispeed));
+    key->ospeed = NUM2ULONG(rb_ivar_get(obj, id_ospeed));
+    cc_ary = rb_ivar_get(obj, id_cc);
+    if (NIL_P(cc_ary)) {
+	return;
+    }
+    Check_Type(cc_ary, T_ARRAY);
+    /* entries missing from a short cc count as 0 */
+    for (i = 0; i < NCCS && i < RARRAY_LEN(cc_ary); i++) {
+	VALUE c = RARRAY_AREF(cc_ary, i);
+
+	key->cc[i] = NIL_P(c) ? 0 : NUM2CHR(c);
+    }
+}
+
+static VALUE
+termios_make_key_body(arg)
+    VALUE arg;
+{
+    VALUE *args = (VALUE *)arg;
+
+    termios_make_key(args[0], (struct termios_key *)args[1]);
+    return Qnil;
+}
+
+/*
+ * termios_make_key for == and hash, which must not raise: returns 0 if
+ * a field of obj does not convert, with the fields before it in key.
+ */
+static int
+termios_try_make_key(obj, key)
+    VALUE obj;
+    struct termios_key *key;
+{
+    VALUE args[2];
+    int state = 0;
+
+    args[0] = obj;
+    args[1] = (VALUE)key;
+    rb_protect(termios_make_key_body, (VALUE)args, &state);
+    if (state) {
+	rb_set_errinfo(Qnil);
+	return 0;
+    }
+    return 1;
+}
+
+/*
+ * call-seq:
+ *   termios == other
+ *   termios.eql?(other)
+ *
+ * Returns true if other is a Termios::Termios with the same flags,
+ * control characters and speeds.  Entries missing from a short cc count
+ * as 0; a field which does not convert makes the two unequal.
+ */
+static VALUE
+termios_equal(self, other)
+    VALUE self, other;
+{
+    struct termios_key a, b;
+
+    if (self == other) {
+	return Qtrue;
+    }
+    if (!rb_obj_is_kind_of(other, cTermios)) {
+	return Qfalse;
+    }
+    if (!termios_try_make_key(self, &a) || !termios_try_make_key(other, &b)) {
+	return Qfalse;
+    }
+
+    return memcmp(&a, &b, sizeof(a)) == 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   termios.hash
+ *
+ * Returns a hash value consistent with Termios::Termios#eql?, so that
+ * Termios::Termios objects can be Hash keys.
+ */
+static VALUE
+termios_hash(self)
+    VALUE self;
+{
+    struct termios_key key;
+
+    termios_try_make_key(self, &key);
+    return ST2FIX(rb_memhash(&key, sizeof(key)));
+}
+
+static VALUE flag_diff_tables;	/* [[name, mask, choices], ...] per flag */
+static VALUE ccindex_table, bauds_table;
+static const char *const no_diff_skip[] = {NULL};
+/* values and a bit of CBAUD, which is shown whole */
+static const char *const cflag_diff_skip[] = {"EXTA", "EXTB", "CBAUDEX", NULL};
+
+/*
+ * Builds the table diff uses for one of c_iflag, c_oflag, c_cflag and
+ * c_lflag from the *FLAG_NAMES and *FLAG_CHOICES constants: each name
+ * with its mask and, for a multi-bit field, the [name, value] pairs of
+ * its values.
+ */
+static VALUE
+termios_flag_diff_table(names, choices, skip)
+    VALUE names, choices;
+    const char *const *skip;
+{
+    VALUE table = rb_ary_new(), values = rb_ary_new();
+    long i, j;
+
+    if (!NIL_P(choices)) {
+	VALUE lists = rb_funcall(choices, rb_intern("values"), 0);
+
+	for (i = 0; i < RARRAY_LEN(lists); i++) {
+	    rb_ary_concat(values, RARRAY_AREF(lists, i));
+	}
+    }
+    for (i = 0; i < RARRAY_LEN(names); i++) {
+	VALUE name = RARRAY_AREF(names, i), entry, list, pairs = Qnil;
+	const char *const *s;
+
+	if (RTEST(rb_ary_includes(values, name))) {
+	    continue;		/* a value of a multi-bit field */
+	}
+	for (s = skip; *s; s++) {
+	    if (strcmp(rb_id2name(SYM2ID(name)), *s) == 0) {
+		break;
+	    }
+	}
+	if (*s) {
+	    continue;
+	}
+	list = NIL_P(choices) ? Qnil : rb_hash_lookup(choices, name);
+	if (!NIL_P(list)) {
+	    pairs = rb_ary_new();
+	    for (j = 0; j < RARRAY_LEN(list); j++) {
+		VALUE v = RARRAY_AREF(list, j);
+
+		rb_ary_push(pairs, rb_assoc_new(v, rb_const_get(mTermios, SYM2ID(v))));
+	    }
+	}
+	entry = rb_ary_new3(3, name, rb_const_get(mTermios, SYM2ID(name)), pairs);
+	rb_ary_push(table, rb_obj_freeze(entry));
+    }
+    return rb_obj_freeze(table);
+}
+
+static VALUE
+termios_flag_value(pairs, mask, v)
+    VALUE pairs;
+    tcflag_t mask, v;
+{
+    long i;
+
+    if (!NIL_P(pairs)) {
+	for (i = 0; i < RARRAY_LEN(pairs); i++) {
+	    VALUE pair = RARRAY_AREF(pairs, i);
+
+	    if (NUM2ULONG(RARRAY_AREF(pair, 1)) == v) {
+		return RARRAY_AREF(pair, 0);
+	    }
+	}
+    }
+    else if ((mask & (mask - 1)) == 0) {
+	return v ? Qtrue : Qfalse;
+    }
+    return ULONG2NUM(v);
+}
+
+static VALUE
+termios_flag_diff(table, a, b)
+    VALUE table;
+    tcflag_t a, b;
+{
+    VALUE h = rb_hash_new();
+    tcflag_t changed = a ^ b, known = 0;
+    long i;
+
+    for (i = 0; i < RARRAY_LEN(table); i++) {
+	VALUE entry = RARRAY_AREF(table, i), pairs = RARRAY_AREF(entry, 2);
+	tcflag_t mask = NUM2ULONG(RARRAY_AREF(entry, 1));
+
+	known |= mask;
+	if (changed & mask) {
+	    rb_hash_aset(h, RARRAY_AREF(entry, 0),
+			 rb_assoc_new(termios_flag_value(pairs, mask, a & mask),
+				      termios_flag_value(pairs, mask, b & mask)));
+	}
+    }
+    /* bits without a name are keyed by their value */
+    for (changed &= ~known; changed; changed &= changed - 1) {
+	tcflag_t bit = changed & -changed;
+
+	rb_hash_aset(h, ULONG2NUM(bit),
+		     rb_assoc_new((a & bit) ? Qtrue : Qfalse,
+				  (b & bit) ? Qtrue : Qfalse));
+    }
+    return h;
+}
+
+static VALUE
+termios_speed_name(speed)
+    speed_t speed;
+{
+    VALUE name = rb_hash_lookup(bauds_table, ULONG2NUM(speed));
+
+    return NIL_P(name) ? ULONG2NUM(speed) : name;
+}
+
+/*
+ * call-seq:
+ *   termios.diff(other)
+ *
+ * Returns what differs in other as a Hash; it is empty if the two are
+ * equal.  Flags are keyed by the field and then by name, with [old,
+ * new] as booleans, or the names of the values of a multi-bit field
+ * such as CSIZE.  Control characters are keyed by :cc and their index
+ * name, and speeds by :ispeed and :ospeed with the names of BAUDS.
+ *
+ *   old.diff(new)
+ *   # => {:iflag=>{:ICRNL=>[true, false]}, :cflag=>{:CSIZE=>[:CS7, :CS8]},
+ *   #     :cc=>{:VMIN=>[1, 0]}, :ispeed=>[:B9600, :B38400]}
+ */
+static VALUE
+termios_diff(self, other)
+    VALUE self, other;
+{
+    static const char *const fields[] = {"iflag", "oflag", "cflag", "lflag"};
+    struct termios_key a, b;
+    tcflag_t fa[4], fb[4];
+    VALUE result = rb_hash_new(), cc = Qnil;
+    int i;
+
+    termios_check_Termios(other);
+    termios_make_key(self, &a);
+    termios_make_key(other, &b);
+    if (memcmp(&a, &b, sizeof(a)) == 0) {
+	return result;
+    }
+
+    fa[0] = a.iflag; fa[1] = a.oflag; fa[2] = a.cflag; fa[3] = a.lflag;
+    fb[0] = b.iflag; fb[1] = b.oflag; fb[2] = b.cflag; fb[3] = b.lflag;
+    for (i = 0; i < 4; i++) {
+	if (fa[i] != fb[i]) {
+	    rb_hash_aset(result, ID2SYM(rb_intern(fields[i])),
+			 termios_flag_diff(RARRAY_AREF(flag_diff_tables, i),
+					   fa[i], fb[i]));
+	}
+    }
+    for (i = 0; i < NCCS; i++) {
+	VALUE name;
+
+	if (a.cc[i] == b.cc[i]) {
+	    continue;
+	}
+	if (NIL_P(cc)) {
+	    cc = rb_hash_new();
+	    rb_hash_aset(result, ID2SYM(rb_intern("cc")), cc);
+	}
+	name = rb_hash_lookup(ccindex_table, INT2FIX(i));
+	rb_hash_aset(cc, NIL_P(name) ? INT2FIX(i) : name,
+		     rb_assoc_new(INT2FIX(a.cc[i]), INT2FIX(b.cc[i])));
+    }
+    if (a.ispeed != b.ispeed) {
+	rb_hash_aset(result, ID2SYM(rb_intern("ispeed")),
+		     rb_assoc_new(termios_speed_name(a.ispeed),
+				  termios_speed_name(b.ispeed)));
+    }
+    if (a.ospeed != b.ospeed) {
+	rb_hash_aset(result, ID2SYM(rb_intern("ospeed")),
+		     rb_assoc_new(termios_speed_name(a.ospeed),
+				  termios_speed_name(b.ospeed)));
+    }
+
+    return result;
+}
+
+static double
+termios_monotonic()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Sleeps for sec seconds without the GVL.  Returns -1 when the sleep is
+ * interrupted.
+ */
+static int
+termios_nap(sec)
+    double sec;
+{
+    struct timespec ts;
+
+    if (sec <= 0.0) {
+	return 0;
+    }
+    ts.tv_sec = (time_t)sec;
+    ts.tv_nsec = (long)((sec - ts.tv_sec) * 1e9);
+    return nanosleep(&ts, NULL);
+}
+
+struct timestamped_arg {
+    int fd;
+    char *buf;
+    long maxlen;
+    int max_chunks;
+    int nchunks;
+    long *len;
+    struct timespec *mono;
+    struct timespec *real;	/* NULL unless requested */
+    double deadline;		/* < 0: only what is available after the first */
+    int eof;
+    int err;
+};
+
+static void *
+termios_timestamped_read_body(ptr)
+    void *ptr;
+{
+    struct timestamped_arg *arg = ptr;
+
+    while (arg->nchunks < arg->max_chunks) {
+	struct pollfd pfd;
+	int timeout, i = arg->nchunks;
+	ssize_t n;
+
+	if (arg->nchunks == 0 && arg->deadline < 0) {
+	    timeout = -1;
+	}
+	else if (arg->deadline < 0) {
+	    timeout = 0;
+	}
+	else {
+	    double left = arg->deadline - termios_monotonic();
+
+	    if (left <= 0.0) {
+		break;
+	    }
+	    timeout = (int)(left * 1000.0) + 1;
+	}
+	pfd.fd = arg->fd;
+	pfd.events = POLLIN;
+	n = poll(&pfd, 1, timeout);
+	if (n < 0) {
+	    arg->err = errno;
+	    break;
+	}
+	if (n == 0) {
+	    if (arg->deadline < 0) {
+		break;
+	    }
+	    continue;
+	}
+
+	n = read(arg->fd, arg->buf + (long)i * arg->maxlen, arg->maxlen);
+	clock_gettime(CLOCK_MONOTONIC, &arg->mono[i]);
+	if (n < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		continue;
+	    }
+	    if (errno == EIO) {		/* the slave of a pty is closed */
+		arg->eof = 1;
+		break;
+	    }
+	    arg->err = errno;
+	    break;
+	}
+	if (n == 0) {
+	    arg->eof = 1;
+	    break;
+	}
+	if (arg->real) {
+#ifdef TIOCTIMESTAMP
+	    struct timeval tv;
+
+	    /* the arrival of the last character, as stamped by the driver */
+	    if (ioctl(arg->fd, TIOCTIMESTAMP, &tv) == 0) {
+		arg->real[i].tv_sec = tv.tv_sec;
+		arg->real[i].tv_nsec = tv.tv_usec * 1000L;
+	    }
+	    else
+#endif
+	    clock_gettime(CLOCK_REALTIME, &arg->real[i]);
+	}
+	arg->len[i] = n;
+	arg->nchunks++;
+    }
+
+    return NULL;
+}
+
+/*
+ * call-seq:
+ *   Termios.timestamped_read(io, maxlen = 4096, chunks: 16, timeout: nil, realtime: false)
+ *
+ * Reads up to chunks chunks of at most maxlen bytes each from io and
+ * returns them as an array of [data, monotonic] pairs, where monotonic is
+ * CLOCK_MONOTONIC in seconds taken right after the read(2) of the chunk
+ * returned.  If realtime is true, each element has CLOCK_REALTIME as the
+ * third value; where the driver supports TIOCTIMESTAMP, it is the arrival
+ * time of the last character of the chunk recorded by the driver.
+ *
+ * Without timeout, it waits for the first chunk and then returns with
+ * the chunks which are readable without waiting.  With timeout, it
+ * collects chunks until chunks are read or timeout seconds pass, and may
+ * return an empty array.  The reads and clock readings are done in one
+ * native call without the GVL, so the time does not include waiting for
+ * the interpreter.  It also returns early at end of file, and when a read
+ * fails after some chunks were read; the error is raised by the next call.
+ *
+ * Bytes buffered in io by Ruby are not seen; do not mix this with IO#read
+ * on the same io.
+ *
+ * See also: clock_gettime(2), TIOCTIMESTAMP
+ */
+static VALUE
+termios_s_timestamped_read(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    static ID keywords[3];
+    struct timestamped_arg arg;
+    VALUE io, maxlen, opts, kw[3], buf, meta, result;
+    long i, metalen;
+
+    rb_scan_args(argc, argv, "11:", &io, &maxlen, &opts);
+    kw[0] = kw[1] = kw[2] = Qundef;
+    if (!NIL_P(opts)) {
+	if (!keywords[0]) {
+	    keywords[0] = rb_intern("chunks");
+	    keywords[1] = rb_intern("timeout");
+	    keywords[2] = rb_intern("realtime");
+	}
+	rb_get_kwargs(opts, keywords, 0, 3, kw);
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.fd = termios_io_fileno(io);
+    arg.maxlen = NIL_P(maxlen) ? 4096 : NUM2LONG(maxlen);
+    arg.max_chunks = (kw[0] == Qundef || NIL_P(kw[0])) ? 16 : NUM2INT(kw[0]);
+    if (arg.maxlen <= 0 || arg.max_chunks <= 0) {
+	rb_raise(rb_eArgError, "maxlen and chunks must be positive");
+    }
+    if (arg.max_chunks > LONG_MAX / arg.maxlen) {
+	rb_raise(rb_eArgError, "maxlen * chunks too large");
+    }
+    arg.deadline = -1.0;
+    if (kw[1] != Qundef && !NIL_P(kw[1])) {
+	arg.deadline = termios_monotonic() + NUM2DBL(kw[1]);
+    }
+
+    buf = rb_str_tmp_new(arg.maxlen * arg.max_chunks);
+    metalen = arg.max_chunks * (sizeof(long) + 2 * sizeof(struct timespec));
+    meta = rb_str_tmp_new(metalen);
+    arg.buf = RSTRING_PTR(buf);
+    arg.mono = (struct timespec *)RSTRING_PTR(meta);
+    arg.real = arg.mono + arg.max_chunks;
+    arg.len = (long *)(arg.real + arg.max_chunks);
+    if (kw[2] == Qundef || !RTEST(kw[2])) {
+	arg.real = NULL;
+    }
+
+    for (;;) {
+	arg.err = 0;
+	termios_without_gvl(termios_timestamped_read_body, &arg, RUBY_UBF_IO, 0);
+	if (arg.err == 0 || (arg.err != EINTR && arg.nchunks > 0)) {
+	    break;		/* the chunks read are not thrown away */
+	}
+	if (arg.err != EINTR) {
+	    errno = arg.err;
+	    rb_sys_fail("read");
+	}
+	rb_thread_check_ints();
+    }
+
+    result = rb_ary_new2(arg.nchunks);
+    for (i = 0; i < arg.nchunks; i++) {
+	VALUE chunk = rb_ary_new2(arg.real ? 3 : 2);
+
+	rb_ary_push(chunk, rb_str_new(arg.buf + i * arg.maxlen, arg.len[i]));
+	rb_ary_push(chunk, DBL2NUM(arg.mono[i].tv_sec + arg.mono[i].tv_nsec / 1e9));
+	if (arg.real) {
+	    rb_ary_push(chunk, DBL2NUM(arg.real[i].tv_sec + arg.real[i].tv_nsec / 1e9));
+	}
+	rb_ary_push(result, chunk);
+    }
+    rb_str_resize(buf, 0);
+    rb_str_resize(meta, 0);
+
+    return result;
+}
+
+#ifdef TIOCMGET
+#define MODEM_WATCH_SLICE 0.1	/* seconds between checks of the queue */
+
+struct modem_watch_arg {
+    int n;
+    int *fds;			/* dups owned by the watcher; -1: not polled here */
+    int *state;
+    double *stamp;
+    double interval;
+    int doubles;
+    int changed;
+    int err;
+    int err_index;
+};
+
+static void *
+termios_modem_watch_body(ptr)
+    void *ptr;
+{
+    struct modem_watch_arg *arg = ptr;
+    double deadline = termios_monotonic() + MODEM_WATCH_SLICE;
+    int i;
+
+    for (;;) {
+	for (i = 0; i < arg->n; i++) {
+	    int st;
+
+	    if (arg->fds[i] < 0) {
+		continue;
+	    }
+	    if (ioctl(arg->fds[i], TIOCMGET, &st) < 0) {
+		arg->err = errno;
+		arg->err_index = i;
+		return NULL;
+	    }
+	    if (st != arg->state[i]) {
+		arg->state[i] = st;
+		arg->stamp[i] = termios_monotonic();
+		arg->changed = 1;
+	    }
+	}
+	if (arg->changed || arg->doubles) {
+	    break;
+	}
+	if (termios_nap(arg->interval) < 0) {
+	    arg->err = errno;
+	    arg->err_index = -1;
+	    break;
+	}
+	if (termios_monotonic() >= deadline) {
+	    break;
+	}
+    }
+
+    return NULL;
+}
+
+static ID id_push, id_closed_p, id_tiocmget;
+
+struct modem_watch {
+    struct modem_watch_arg arg;
+    VALUE queue, ios, states, signals;
+    int mask;
+    int *prev;
+};
+
+static VALUE
+termios_modem_watch_push_body(pair)
+    VALUE pair;
+{
+    return rb_funcall(RARRAY_AREF(pair, 0), id_push, 1, RARRAY_AREF(pair, 1));
+}
+
+/*
+ * Pushes ev to queue.  Returns -1 if the queue is closed, even when it is
+ * closed by another thread during the push.
+ */
+static int
+termios_modem_watch_send(queue, ev)
+    VALUE queue, ev;
+{
+    int state = 0;
+
+    if (RTEST(rb_funcall(queue, id_closed_p, 0))) {
+	return -1;
+    }
+    rb_protect(termios_modem_watch_push_body, rb_assoc_new(queue, ev), &state);
+    if (state) {
+	if (RTEST(rb_funcall(queue, id_closed_p, 0))) {
+	    rb_set_errinfo(Qnil);
+	    return -1;
+	}
+	rb_jump_tag(state);
+    }
+    return 0;
+}
+
+static int
+termios_modem_watch_push(queue, io, signals, mask, old, new, stamp)
+    VALUE queue, io, signals;
+    int mask, old, new;
+    double stamp;
+{
+    int bit;
+
+    for (bit = 0; bit < 32; bit++) {
+	unsigned int m = 1U << bit;
+	VALUE name;
+
+	if (!(mask & m) || (old & m) == (new & m)) {
+	    continue;
+	}
+	name = rb_hash_lookup2(signals, UINT2NUM(m), UINT2NUM(m));
+	if (termios_modem_watch_send(queue,
+				     rb_ary_new3(4, io, name,
+						 (new & m) ? Qtrue : Qfalse,
+						 DBL2NUM(stamp))) < 0) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Reports port i as failed with exc and stops watching it.
+ */
+static int
+termios_modem_watch_drop(w, i, exc)
+    struct modem_watch *w;
+    int i;
+    VALUE exc;
+{
+    VALUE io = RARRAY_AREF(w->ios, i);
+
+    if (w->arg.fds[i] >= 0) {
+	close(w->arg.fds[i]);
+	w->arg.fds[i] = -1;
+    }
+    rb_ary_store(w->ios, i, Qnil);
+    return termios_modem_watch_send(w->queue,
+				    rb_ary_new3(4, io, ID2SYM(rb_intern("error")), exc,
+						DBL2NUM(termios_monotonic())));
+}
+
+static VALUE
+termios_modem_watch_tiocmget(io)
+    VALUE io;
+{
+    return INT2NUM(NUM2INT(rb_funcall(io, id_tiocmget, 0)));
+}
+
+static VALUE
+termios_modem_watch_loop(ptr)
+    VALUE ptr;
+{
+    struct modem_watch *w = (struct modem_watch *)ptr;
+    struct modem_watch_arg *arg = &w->arg;
+    int i;
+
+    while (!RTEST(rb_funcall(w->queue, id_closed_p, 0))) {
+	/* the descriptors are private dups; the ports themselves may close */
+	for (i = 0; i < arg->n; i++) {
+	    VALUE io = RARRAY_AREF(w->ios, i);
+
+	    if (arg->fds[i] >= 0 && RTEST(rb_funcall(io, id_closed_p, 0)) &&
+		termios_modem_watch_drop(w, i, rb_exc_new_cstr(rb_eIOError,
+							       "closed stream")) < 0) {
+		return Qnil;
+	    }
+	}
+
+	memcpy(w->prev, arg->state, sizeof(int) * arg->n);
+	arg->changed = 0;
+	arg->err = 0;
+	termios_without_gvl(termios_modem_watch_body, arg, RUBY_UBF_IO, 0);
+	if (arg->err == EINTR) {
+	    rb_thread_check_ints();
+	}
+	else if (arg->err) {
+	    if (termios_modem_watch_drop(w, arg->err_index,
+					 rb_syserr_new(arg->err, "TIOCMGET")) < 0) {
+		break;
+	    }
+	    continue;
+	}
+	if (arg->doubles) {
+	    for (i = 0; i < arg->n; i++) {
+		VALUE io = RARRAY_AREF(w->ios, i), val;
+		int st, state = 0;
+
+		if (arg->fds[i] >= 0 || NIL_P(io)) {
+		    continue;
+		}
+		val = rb_protect(termios_modem_watch_tiocmget, io, &state);
+		if (state) {
+		    VALUE exc = rb_errinfo();
+
+		    rb_set_errinfo(Qnil);
+		    if (!rb_obj_is_kind_of(exc, rb_eStandardError)) {
+			rb_jump_tag(state);
+		    }
+		    if (termios_modem_watch_drop(w, i, exc) < 0) {
+			return Qnil;
+		    }
+		    continue;
+		}
+		st = NUM2INT(val);
+		if (st != arg->state[i]) {
+		    arg->state[i] = st;
+		    arg->stamp[i] = termios_monotonic();
+		}
+	    }
+	    rb_thread_wait_for(rb_time_interval(DBL2NUM(arg->interval)));
+	}
+	for (i = 0; i < arg->n; i++) {
+	    if (w->prev[i] != arg->state[i] &&
+		termios_modem_watch_push(w->queue, RARRAY_AREF(w->ios, i),
+					 w->signals, w->mask, w->prev[i],
+					 arg->state[i], arg->stamp[i]) < 0) {
+		return Qnil;
+	    }
+	}
+    }
+
+    return Qnil;
+}
+
+static VALUE
+termios_modem_watch_close(ptr)
+    VALUE ptr;
+{
+    struct modem_watch *w = (struct modem_watch *)ptr;
+    int i;
+
+    for (i = 0; i < w->arg.n; i++) {
+	if (w->arg.fds[i] >= 0) {
+	    close(w->arg.fds[i]);
+	    w->arg.fds[i] = -1;
+	}
+    }
+
+    return Qnil;
+}
+
+static VALUE
+termios_modem_watch_thread(ptr)
+    void *ptr;
+{
+    VALUE args = (VALUE)ptr;
+    VALUE buf;
+    struct modem_watch w;
+    int i;
+
+    memset(&w, 0, sizeof(w));
+    w.queue = RARRAY_AREF(args, 0);
+    w.ios = RARRAY_AREF(args, 1);
+    w.mask = NUM2INT(RARRAY_AREF(args, 2));
+    w.states = RARRAY_AREF(args, 4);
+    w.signals = rb_const_get(mTermios, rb_intern("MODEM_SIGNALS"));
+    w.arg.n = (int)RARRAY_LEN(w.ios);
+    w.arg.interval = NUM2DBL(RARRAY_AREF(args, 3));
+    buf = rb_str_tmp_new((sizeof(double) + 3 * sizeof(int)) * w.arg.n);
+    w.arg.stamp = (double *)RSTRING_PTR(buf);
+    w.arg.fds = (int *)(w.arg.stamp + w.arg.n);
+    w.arg.state = w.arg.fds + w.arg.n;
+    w.prev = w.arg.state + w.arg.n;
+    for (i = 0; i < w.arg.n; i++) {
+	w.arg.state[i] = NUM2INT(RARRAY_AREF(w.states, i));
+	w.arg.fds[i] = -1;
+    }
+    for (i = 0; i < w.arg.n; i++) {
+	VALUE io = RARRAY_AREF(w.ios, i);
+	int fd;
+
+	if (rb_respond_to(io, id_tiocmget)) {
+	    w.arg.doubles = 1;
+	}
+	else if (RTEST(rb_funcall(io, id_closed_p, 0)) ||
+		 (fd = rb_cloexec_dup(termios_io_fileno(io))) < 0) {
+	    rb_ary_store(w.ios, i, Qnil);	/* closed before we started */
+	}
+	else {
+	    rb_update_max_fd(fd);
+	    w.arg.fds[i] = fd;
+	}
+    }
+
+    rb_ensure(termios_modem_watch_loop, (VALUE)&w,
+	      termios_modem_watch_close, (VALUE)&w);
+    rb_str_resize(buf, 0);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   Termios.watch_modem_lines(ios, mask = TIOCM_CD|TIOCM_RI|TIOCM_DSR|TIOCM_CTS, interval: 0.01)
+ *
+ * Watches the modem lines of the ports ios and returns a Thread::Queue
+ * which receives an event for each transition of a line in mask:
+ *
+ *   [io, signal, state, time]
+ *
+ * where signal is the name of the line in Termios::MODEM_SIGNALS (for
+ * example :TIOCM_CD), state is true when the line is raised, and time is
+ * CLOCK_MONOTONIC in seconds when the transition was seen.  A port which
+ * fails is reported once as [io, :error, exception, time] and dropped.
+ *
+ * One thread watches all the ports.  It polls TIOCMGET every interval
+ * seconds without the GVL on its own duplicates of their descriptors, and
+ * stops when the queue is closed.  A port closed meanwhile is reported as
+ * failed with an IOError.
+ *
+ * An element of ios which responds to +tiocmget+ is polled by calling it
+ * instead; Termios::ModemLineDouble is such an object for tests without
+ * hardware.
+ *
+ * See also: tty_ioctl(4), TIOCMGET
+ */
+static VALUE
+termios_s_watch_modem_lines(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    static ID keywords[1];
+    VALUE ios, mask, opts, interval = Qundef, states, queue, args, thread;
+    long i;
+
+    rb_scan_args(argc, argv, "11:", &ios, &mask, &opts);
+    if (!NIL_P(opts)) {
+	if (!keywords[0]) {
+	    keywords[0] = rb_intern("interval");
+	}
+	rb_get_kwargs(opts, keywords, 0, 1, &interval);
+    }
+    if (NIL_P(mask)) {
+	mask = INT2NUM(TIOCM_CD|TIOCM_RI|TIOCM_DSR|TIOCM_CTS);
+    }
+    if (interval == Qundef || NIL_P(interval)) {
+	interval = DBL2NUM(0.01);
+    }
+    NUM2INT(mask);
+    if (NUM2DBL(interval) <= 0.0) {
+	rb_raise(rb_eArgError, "interval must be positive");
+    }
+
+    /* read the initial states here so that unusable ports raise */
+    ios = rb_ary_dup(rb_convert_type(ios, T_ARRAY, "Array", "to_ary"));
+    states = rb_ary_new2(RARRAY_LEN(ios));
+    for (i = 0; i < RARRAY_LEN(ios); i++) {
+	VALUE io = RARRAY_AREF(ios, i);
+	int st;
+
+	if (rb_respond_to(io, id_tiocmget)) {
+	    rb_ary_push(states, rb_to_int(rb_funcall(io, id_tiocmget, 0)));
+	    continue;
+	}
+	if (ioctl(termios_io_fileno(io), TIOCMGET, &st) < 0) {
+	    rb_sys_fail("TIOCMGET");
+	}
+	rb_ary_push(states, INT2NUM(st));
+    }
+
+    queue = rb_class_new_instance(0, 0, rb_path2class("Thread::Queue"));
+    args = rb_ary_new3(5, queue, ios, mask, interval, states);
+    thread = rb_thread_create(termios_modem_watch_thread, (void *)args);
+    rb_ivar_set(thread, rb_intern("__termios_modem_watch__"), args);
+
+    return queue;
+}
+#endif
+
+/*
+ * Document-class: Termios::PacedWriter
+ *
+ * Writes data to a terminal at the rate the port can transmit it, so that
+ * the output queue of the terminal never holds more than +depth+ bytes.
+ * Because the queue stays short, an urgent frame written with
+ * Termios::PacedWriter#urgent waits at most for +depth+ characters instead
+ * of for everything written before it.
+ *
+ * The transfer rate is computed from ospeed and the character size, parity
+ * and stop bits in cflag of the port.  The queue depth is read with
+ * TIOCOUTQ, or estimated from the elapsed time where TIOCOUTQ is not
+ * available.  Writing is done without the GVL.
+ *
+ *   require 'termios'
+ *
+ *   writer = Termios::PacedWriter.new(port)
+ *   Thread.new { writer.write(firmware_image) }
+ *   writer.urgent("\x03")	# goes out after at most writer.depth bytes
+ */
+
+#define PACED_WRITER_MIN_DEPTH	64
+#define PACED_WRITER_MAX_NAP	0.1
+#define PACED_WRITER_UNKNOWN_CHAR (10.0 / 9600) /* when the speed is not known */
+
+struct paced_writer {
+    VALUE io;
+    double char_time;		/* seconds per character */
+    long depth;			/* target output queue depth in bytes */
+    pthread_mutex_t lock;	/* guards the members below */
+    int urgent;			/* number of urgent writes in progress */
+    double est_time;		/* used when TIOCOUTQ is not available */
+    long est_queue;
+};
+
+struct paced_write_arg {
+    struct paced_writer *pw;
+    int fd;
+    int urgent;
+    const char *ptr;
+    long len;
+    long done;
+    int err;
+};
+
+static void
+paced_writer_mark(ptr)
+    void *ptr;
+{
+    rb_gc_mark(((struct paced_writer *)ptr)->io);
+}
+
+static void
+paced_writer_free(ptr)
+    void *ptr;
+{
+    struct paced_writer *pw = ptr;
+
+    pthread_mutex_destroy(&pw->lock);
+    xfree(pw);
+}
+
+static const rb_data_type_t paced_writer_type = {
+    "Termios::PacedWriter",
+    {paced_writer_mark, paced_writer_free, 0,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+paced_writer_alloc(klass)
+    VALUE klass;
+{
+    struct paced_writer *pw;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct(klass, struct paced_writer,
+				&paced_writer_type, pw);
+    pw->io = Qnil;
+    pthread_mutex_init(&pw->lock, NULL);
+
+    return obj;
+}
+
+static struct paced_writer *
+get_paced_writer(self)
+    VALUE self;
+{
+    struct paced_writer *pw;
+
+    TypedData_Get_Struct(self, struct paced_writer, &paced_writer_type, pw);
+    if (NIL_P(pw->io)) {
+	rb_raise(rb_eArgError, "uninitialized Termios::PacedWriter");
+    }
+    return pw;
+}
+
+/*
+ * Returns the number of bytes in the output queue of fd.
+ */
+static long
+paced_writer_queued(pw, fd)
+    struct paced_writer *pw;
+    int fd;
+{
+    double now, sent;
+    long queued;
+#ifdef TIOCOUTQ
+    int outq;
+
+    if (ioctl(fd, TIOCOUTQ, &outq) == 0) {
+	return outq;
+    }
+#endif
+    now = termios_monotonic();
+    pthread_mutex_lock(&pw->lock);
+    sent = pw->char_time > 0.0 ? (now - pw->est_time) / pw->char_time
+			       : (double)pw->est_queue;
+    pw->est_queue = sent >= pw->est_queue ? 0 : pw->est_queue - (long)sent;
+    pw->est_time = now;
+    queued = pw->est_queue;
+    pthread_mutex_unlock(&pw->lock);
+
+    return queued;
+}
+
+/*
+ * Returns the number of urgent writes in progress.
+ */
+static int
+paced_writer_urgent_pending(pw)
+    struct paced_writer *pw;
+{
+    int n;
+
+    pthread_mutex_lock(&pw->lock);
+    n = pw->urgent;
+    pthread_mutex_unlock(&pw->lock);
+
+    return n;
+}
+
+static int
+paced_writer_nap(pw, chars)
+    struct paced_writer *pw;
+    long chars;
+{
+    /* a pty or an unknown speed: nap as at 9600 bps rather than spin */
+    double sec = (pw->char_time > 0.0 ? pw->char_time :
+		  PACED_WRITER_UNKNOWN_CHAR) * chars;
+
+    if (sec < 0.0001) sec = 0.0001;
+    if (sec > PACED_WRITER_MAX_NAP) sec = PACED_WRITER_MAX_NAP;
+    return termios_nap(sec);
+}
+
+static void *
+paced_writer_write_body(ptr)
+    void *ptr;
+{
+    struct paced_write_arg *arg = ptr;
+    struct paced_writer *pw = arg->pw;
+
+    while (arg->done < arg->len) {
+	long queued, room;
+	ssize_t n;
+
+	if (!arg->urgent && paced_writer_urgent_pending(pw) > 0) {
+	    if (paced_writer_nap(pw, 1) < 0) {
+		arg->err = errno;
+		break;
+	    }
+	    continue;
+	}
+
+	queued = paced_writer_queued(pw, arg->fd);
+	room = arg->len - arg->done;
+	if (!arg->urgent) {
+	    if (queued >= pw->depth) {
+		if (paced_writer_nap(pw, queued - pw->depth + 1) < 0) {
+		    arg->err = errno;
+		    break;
+		}
+		continue;
+	    }
+	    if (room > pw->depth - queued) {
+		room = pw->depth - queued;
+	    }
+	}
+
+	n = write(arg->fd, arg->ptr + arg->done, room);
+	if (n < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		struct pollfd pfd;
+
+		pfd.fd = arg->fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, -1) < 0) {
+		    arg->err = errno;
+		    break;
+		}
+		continue;
+	    }
+	    arg->err = errno;
+	    break;
+	}
+	arg->done += n;
+	pthread_mutex_lock(&pw->lock);
+	pw->est_queue += n;
+	pthread_mutex_unlock(&pw->lock);
+    }
+
+    return NULL;
+}
+
+static VALUE
+paced_writer_write_run(ptr)
+    VALUE ptr;
+{
+    struct paced_write_arg *arg = (struct paced_write_arg *)ptr;
+
+    for (;;) {
+	arg->fd = termios_io_fileno(arg->pw->io);
+	arg->err = 0;
+	termios_without_gvl(paced_writer_write_body, arg, RUBY_UBF_IO, 0);
+	if (arg->err == 0) {
+	    break;
+	}
+	if (arg->err != EINTR) {
+	    errno = arg->err;
+	    rb_sys_fail("write");
+	}
+	rb_thread_check_ints();
+    }
+
+    return LONG2NUM(arg->done);
+}
+
+static VALUE
+paced_writer_urgent_done(ptr)
+    VALUE ptr;
+{
+    struct paced_writer *pw = (struct paced_writer *)ptr;
+
+    pthread_mutex_lock(&pw->lock);
+    pw->urgent--;
+    pthread_mutex_unlock(&pw->lock);
+
+    return Qnil;
+}
+
+static VALUE
+paced_writer_write0(self, str, urgent)
+    VALUE self, str;
+    int urgent;
+{
+    struct paced_writer *pw = get_paced_writer(self);
+    struct paced_write_arg arg;
+    VALUE result;
+
+    StringValue(str);
+    str = rb_str_new_frozen(str);
+
+    arg.pw = pw;
+    arg.urgent = urgent;
+    arg.ptr = RSTRING_PTR(str);
+    arg.len = RSTRING_LEN(str);
+    arg.done = 0;
+
+    if (urgent) {
+	pthread_mutex_lock(&pw->lock);
+	pw->urgent++;
+	pthread_mutex_unlock(&pw->lock);
+	result = rb_ensure(paced_writer_write_run, (VALUE)&arg,
+			   paced_writer_urgent_done, (VALUE)pw);
+    }
+    else {
+	result = paced_writer_write_run((VALUE)&arg);
+    }
+    RB_GC_GUARD(str);
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   writer.refresh
+ *
+ * Reads the speed and character format of the port again.  Call it after
+ * changing ospeed or cflag of the port.
+ */
+static VALUE
+paced_writer_refresh(self)
+    VALUE self;
+{
+    struct paced_writer *pw = get_paced_writer(self);
+    struct termios t;
+
+    if (tcgetattr(termios_io_fileno(pw->io), &t) < 0) {
+	rb_sys_fail("tcgetattr");
+    }
+    pw->char_time = termios_char_time(cfgetospeed(&t), t.c_cflag);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   Termios::PacedWriter.new(io, depth = nil)
+ *
+ * Returns a new writer for io.  The output queue of io is kept under depth
+ * bytes.  By default it is about 20 milliseconds worth of output, but not
+ * less than 64 bytes.
+ */
+static VALUE
+paced_writer_initialize(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct paced_writer *pw;
+    VALUE io, depth;
+
+    rb_scan_args(argc, argv, "11", &io, &depth);
+    Check_Type(io, T_FILE);
+
+    TypedData_Get_Struct(self, struct paced_writer, &paced_writer_type, pw);
+    pw->io = io;
+    pthread_mutex_lock(&pw->lock);
+    pw->urgent = 0;
+    pw->est_time = termios_monotonic();
+    pw->est_queue = 0;
+    pthread_mutex_unlock(&pw->lock);
+    paced_writer_refresh(self);
+
+    if (NIL_P(depth)) {
+	pw->depth = pw->char_time > 0.0 ? (long)(0.02 / pw->char_time) : 0;
+	if (pw->depth < PACED_WRITER_MIN_DEPTH) {
+	    pw->depth = PACED_WRITER_MIN_DEPTH;
+	}
+    }
+    else {
+	pw->depth = NUM2LONG(depth);
+	if (pw->depth <= 0) {
+	    rb_raise(rb_eArgError, "depth must be positive");
+	}
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   writer.write(str)
+ *
+ * Writes str to the port without letting the output queue grow beyond
+ * depth.  It blocks until all of str is queued and returns the number of
+ * bytes written.
+ */
+static VALUE
+paced_writer_write(self, str)
+    VALUE self, str;
+{
+    return paced_writer_write0(self, str, 0);
+}
+
+/*
+ * call-seq:
+ *   writer.urgent(str)
+ *
+ * Writes str to the port ahead of data which is not queued yet by
+ * Termios::PacedWriter#write in other threads.
+ */
+static VALUE
+paced_writer_urgent(self, str)
+    VALUE self, str;
+{
+    return paced_writer_write0(self, str, 1);
+}
+
+/*
+ * call-seq:
+ *   writer.queued
+ *
+ * Returns the number of bytes in the output queue of the port.
+ */
+static VALUE
+paced_writer_get_queued(self)
+    VALUE self;
+{
+    struct paced_writer *pw = get_paced_writer(self);
+
+    return LONG2NUM(paced_writer_queued(pw, termios_io_fileno(pw->io)));
+}
+
+/*
+ * call-seq:
+ *   writer.io
+ *
+ * Returns the IO object of the port.
+ */
+static VALUE
+paced_writer_io(self)
+    VALUE self;
+{
+    return get_paced_writer(self)->io;
+}
+
+/*
+ * call-seq:
+ *   writer.depth
+ *
+ * Returns the target depth of the output queue in bytes.
+ */
+static VALUE
+paced_writer_depth(self)
+    VALUE self;
+{
+    return LONG2NUM(get_paced_writer(self)->depth);
+}
+
+/*
+ * call-seq:
+ *   writer.depth = bytes
+ *
+ * Updates the target depth of the output queue.
+ */
+static VALUE
+paced_writer_set_depth(self, depth)
+    VALUE self, depth;
+{
+    struct paced_writer *pw = get_paced_writer(self);
+    long d = NUM2LONG(depth);
+
+    if (d <= 0) {
+	rb_raise(rb_eArgError, "depth must be positive");
+    }
+    pw->depth = d;
+
+    return depth;
+}
+
+/*
+ * call-seq:
+ *   writer.char_time
+ *
+ * Returns the time in seconds to transmit one character, or 0.0 if the
+ * speed of the port is unknown.
+ */
+static VALUE
+paced_writer_char_time(self)
+    VALUE self;
+{
+    return rb_float_new(get_paced_writer(self)->char_time);
+}
+
+/*
+ * Writes len bytes of buf to fd, waiting for the fd to be writable when
+ * it is non-blocking.  Returns the number of bytes written; if it is less
+ * than len, errno tells the reason.
+ */
+static long
+termios_write_full(fd, buf, len)
+    int fd;
+    const char *buf;
+    long len;
+{
+    long done = 0;
+
+    while (done < len) {
+	ssize_t n = write(fd, buf + done, len - done);
+
+	if (n < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		struct pollfd pfd;
+
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, -1) < 0) {
+		    break;
+		}
+		continue;
+	    }
+	    break;
+	}
+	done += n;
+    }
+
+    return done;
+}
+
+static int64_t
+termios_monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t
+termios_realtime_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define QUERY_BUFSIZE 4096
+
+static VALUE query_cache;	/* st_rdev => {[request, terminator] => response} */
+static VALUE query_typeahead;	/* st_rdev => bytes which were not a response */
+
+struct query_arg {
+    int fd;
+    const char *req;
+    long reqlen;
+    int n;			/* responses awaited */
+    const char **term;
+    long *termlen;
+    long *start;		/* start of each response in buf */
+    long *end;			/* end of each response in buf, or -1 */
+    int found;			/* requests answered or skipped */
+    long scanned;		/* bytes of buf looked at */
+    char *buf;
+    long len;
+    char *ahead;		/* bytes of buf which were not a response */
+    long aheadlen;
+    double deadline;
+    int written;
+    int err;
+    const char *func;
+};
+
+/*
+ * Returns the length of the control sequence a terminal answers with at
+ * p, a CSI sequence or a DCS, OSC, APC or PM string ended by ST or BEL, 0
+ * if it is not complete yet, or -1 if p does not start one.
+ */
+static long
+termios_query_sequence(p, len)
+    const char *p;
+    long len;
+{
+    long i;
+
+    if (len < 2) {
+	return 0;
+    }
+    switch (p[1]) {
+      case '[':
+	for (i = 2; i < len; i++) {
+	    unsigned char c = (unsigned char)p[i];
+
+	    if (c >= 0x40 && c <= 0x7e) {
+		return i + 1;
+	    }
+	    if (c < 0x20 || c > 0x3f) {
+		return -1;
+	    }
+	}
+	return 0;
+      case 'P': case ']': case '_': case '^':
+	for (i = 2; i < len; i++) {
+	    if (p[i] == '\a') {
+		return i + 1;
+	    }
+	    if (p[i] == '\033') {
+		if (i + 1 == len) {
+		    return 0;
+		}
+		return p[i + 1] == '\\' ? i + 2 : -1;
+	    }
+	}
+	return 0;
+      default:
+	return -1;
+    }
+}
+
+static void
+termios_query_ahead(arg, p, len)
+    struct query_arg *arg;
+    const char *p;
+    long len;
+{
+    memcpy(arg->ahead + arg->aheadlen, p, len);
+    arg->aheadlen += len;
+}
+
+/*
+ * Terminals answer in order but ignore queries they do not know, so each
+ * complete control sequence in buf is the response to the first request
+ * still awaited whose terminator ends it, and the requests before that
+ * one are unanswered.  Anything else, like keys typed before the
+ * response, goes to arg->ahead.  An incomplete sequence at the end of buf
+ * waits for the next read.
+ */
+static void
+termios_query_match(arg)
+    struct query_arg *arg;
+{
+    while (arg->found < arg->n && arg->scanned < arg->len) {
+	const char *p = arg->buf + arg->scanned;
+	long left = arg->len - arg->scanned, len;
+	int i;
+
+	if (*p != '\033') {
+	    const char *esc = memchr(p, '\033', left);
+
+	    len = esc ? esc - p : left;
+	    termios_query_ahead(arg, p, len);
+	    arg->scanned += len;
+	    continue;
+	}
+	len = termios_query_sequence(p, left);
+	if (len == 0) {
+	    break;
+	}
+	if (len < 0) {
+	    termios_query_ahead(arg, p, 1);
+	    arg->scanned++;
+	    continue;
+	}
+	for (i = arg->found; i < arg->n; i++) {
+	    if (len >= arg->termlen[i] &&
+		memcmp(p + len - arg->termlen[i], arg->term[i], arg->termlen[i]) == 0) {
+		break;
+	    }
+	}
+	if (i < arg->n) {
+	    arg->start[i] = arg->scanned;
+	    arg->end[i] = arg->scanned + len;
+	    arg->found = i + 1;
+	}
+	else {
+	    termios_query_ahead(arg, p, len);
+	}
+	arg->scanned += len;
+    }
+}
+
+static void *
+termios_query_body(ptr)
+    void *ptr;
+{
+    struct query_arg *arg = ptr;
+    struct termios saved, raw;
+
+    if (tcgetattr(arg->fd, &saved) < 0) {
+	arg->err = errno;
+	arg->func = "tcgetattr";
+	return NULL;
+    }
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(arg->fd, TCSANOW, &raw) < 0) {
+	arg->err = errno;
+	arg->func = "tcsetattr";
+	return NULL;
+    }
+
+    if (!arg->written) {
+	if (termios_write_full(arg->fd, arg->req, arg->reqlen) < arg->reqlen) {
+	    arg->err = errno;
+	    arg->func = "write";
+	    goto restore;
+	}
+	arg->written = 1;
+    }
+
+    while (arg->found < arg->n && arg->len < QUERY_BUFSIZE) {
+	struct pollfd pfd;
+	double left = arg->deadline - termios_monotonic();
+	ssize_t n;
+
+	if (left <= 0.0) {
+	    break;
+	}
+	pfd.fd = arg->fd;
+	pfd.events = POLLIN;
+	n = poll(&pfd, 1, (int)(left * 1000.0) + 1);
+	if (n < 0) {
+	    arg->err = errno;
+	    arg->func = "poll";
+	    break;
+	}
+	if (n == 0) {
+	    continue;
+	}
+	n = read(arg->fd, arg->buf + arg->len, QUERY_BUFSIZE - arg->len);
+	if (n < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		continue;
+	    }
+	    arg->err = errno;
+	    arg->func = "read";
+	    break;
+	}
+	if (n == 0) {
+	    break;
+	}
+	arg->len += n;
+
+	termios_query_match(arg);
+    }
+
+  restore:
+    if (tcsetattr(arg->fd, TCSANOW, &saved) < 0 && arg->err == 0) {
+	arg->err = errno;
+	arg->func = "tcsetattr";
+    }
+
+    return NULL;
+}
+
+/*
+ * Keeps the bytes Termios.query read which were not a response for
+ * Termios.query_typeahead, up to QUERY_BUFSIZE per device as a tty keeps
+ * its input queue.
+ */
+static void
+termios_query_keep_ahead(fd, p, len)
+    int fd;
+    const char *p;
+    long len;
+{
+    struct stat st;
+    VALUE rdev, kept;
+
+    if (fstat(fd, &st) < 0) {
+	rb_sys_fail("fstat");
+    }
+    rdev = ULL2NUM((unsigned long long)st.st_rdev);
+    kept = rb_hash_lookup(query_typeahead, rdev);
+    if (NIL_P(kept)) {
+	kept = rb_str_buf_new(len);
+	rb_hash_aset(query_typeahead, rdev, kept);
+    }
+    if (len > QUERY_BUFSIZE - RSTRING_LEN(kept)) {
+	len = QUERY_BUFSIZE - RSTRING_LEN(kept);
+    }
+    if (len > 0) {
+	rb_str_cat(kept, p, len);
+    }
+}
+
+static VALUE
+termios_query_terminator(terms, i)
+    VALUE terms;
+    long i;
+{
+    VALUE term = RB_TYPE_P(terms, T_ARRAY) ? rb_ary_entry(terms, i) : terms;
+
+    StringValue(term);
+    if (RSTRING_LEN(term) == 0) {
+	rb_raise(rb_eArgError, "empty terminator");
+    }
+    return term;
+}
+
+/*
+ * call-seq:
+ *   Termios.query(io, request, terminator:, timeout_ms: 100, cache: false)
+ *
+ * Sends a query such as DA1 ("\e[c"), a cursor position report
+ * ("\e[6n") or XTVERSION ("\e[>q") to the terminal io and returns the
+ * response up to and including terminator, or nil if it does not arrive
+ * within timeout_ms milliseconds.  Turning off ICANON and ECHO, writing
+ * the query, reading the response and restoring the termios are done in
+ * one native call without the GVL.
+ *
+ * If request is an array of queries, they are written at once and an
+ * array of the responses (nil for those which did not arrive) is
+ * returned; terminator is then one string for all or an array of them.
+ * Terminals answer in order, so a query every terminal answers, like DA1,
+ * may be put last to end the wait early.
+ *
+ *   Termios.query($stdin, ["\e[?u", "\e[c"], terminator: ["u", "c"])
+ *
+ * If cache is true, responses are remembered per terminal device (the
+ * st_rdev of io) and a cached query is not sent again; do not cache
+ * queries whose answer changes, like the cursor position.
+ *
+ * Each response is a control sequence (CSI, or a DCS, OSC, APC or PM
+ * string) ending with its terminator.  Other bytes read, like keys typed
+ * before the response arrives, are not lost but kept for
+ * Termios.query_typeahead.
+ *
+ * See also: Termios.clear_query_cache, Termios.query_typeahead
+ */
+static VALUE
+termios_s_query(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    static ID keywords[3];
+    struct query_arg arg;
+    struct stat st;
+    VALUE io, request, opts, kw[3], reqs, terms, tmp, result, cache = Qnil;
+    VALUE keys, vindex;
+    long i, nreq, *index;
+    double timeout;
+
+    rb_scan_args(argc, argv, "2:", &io, &request, &opts);
+    if (!keywords[0]) {
+	keywords[0] = rb_intern("terminator");
+	keywords[1] = rb_intern("timeout_ms");
+	keywords[2] = rb_intern("cache");
+    }
+    rb_get_kwargs(NIL_P(opts) ? rb_hash_new() : opts, keywords, 1, 2, kw);
+    terms = kw[0];
+    timeout = (kw[1] == Qundef || NIL_P(kw[1])) ? 100.0 : NUM2DBL(kw[1]);
+
+    reqs = RB_TYPE_P(request, T_ARRAY) ? request : rb_ary_new3(1, request);
+    nreq = RARRAY_LEN(reqs);
+    if (RB_TYPE_P(terms, T_ARRAY) && RARRAY_LEN(terms) != nreq) {
+	rb_raise(rb_eArgError, "%ld terminators for %ld requests",
+		 RARRAY_LEN(terms), nreq);
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.fd = termios_io_fileno(io);
+    result = rb_ary_new2(nreq);
+    /* sized by the caller, so not on the stack */
+    keys = rb_ary_new2(nreq);
+    index = ALLOCV_N(long, vindex, nreq);
+
+    if (kw[2] != Qundef && RTEST(kw[2])) {
+	VALUE rdev;
+
+	if (fstat(arg.fd, &st) < 0) {
+	    rb_sys_fail("fstat");
+	}
+	rdev = ULL2NUM((unsigned long long)st.st_rdev);
+	cache = rb_hash_lookup(query_cache, rdev);
+	if (NIL_P(cache)) {
+	    cache = rb_hash_new();
+	    rb_hash_aset(query_cache, rdev, cache);
+	}
+    }
+
+    /* only the queries without a cached response are sent */
+    tmp = rb_str_new(0, 0);
+    for (i = 0; i < nreq; i++) {
+	VALUE req = rb_ary_entry(reqs, i);
+	VALUE term = termios_query_terminator(terms, i);
+	VALUE hit = Qnil;
+
+	StringValue(req);
+	if (!NIL_P(cache)) {
+	    VALUE key = rb_ary_new3(2, rb_str_new_frozen(req),
+				    rb_str_new_frozen(term));
+
+	    rb_ary_store(keys, i, key);
+	    hit = rb_hash_lookup(cache, key);
+	}
+	rb_ary_push(result, hit);
+	if (NIL_P(hit)) {
+	    index[arg.n++] = i;
+	    rb_str_buf_append(tmp, req);
+	}
+    }
+
+    if (arg.n > 0) {
+	VALUE buf, ahead, meta, held, req = rb_str_new_frozen(tmp);
+
+	meta = rb_str_tmp_new(arg.n * (sizeof(char *) + 3 * sizeof(long)));
+	arg.term = (const char **)RSTRING_PTR(meta);
+	arg.termlen = (long *)(arg.term + arg.n);
+	arg.start = arg.termlen + arg.n;
+	arg.end = arg.start + arg.n;
+	held = rb_ary_new2(arg.n);
+	for (i = 0; i < arg.n; i++) {
+	    VALUE term = rb_str_new_frozen(termios_query_terminator(terms, index[i]));
+
+	    rb_ary_push(held, term);
+	    arg.term[i] = RSTRING_PTR(term);
+	    arg.termlen[i] = RSTRING_LEN(term);
+	    arg.end[i] = -1;
+	}
+	buf = rb_str_tmp_new(QUERY_BUFSIZE);
+	arg.buf = RSTRING_PTR(buf);
+	ahead = rb_str_tmp_new(QUERY_BUFSIZE);
+	arg.ahead = RSTRING_PTR(ahead);
+	arg.req = RSTRING_PTR(req);
+	arg.reqlen = RSTRING_LEN(req);
+	arg.deadline = termios_monotonic() + timeout / 1000.0;
+
+	for (;;) {
+	    arg.err = 0;
+	    termios_without_gvl(termios_query_body, &arg, RUBY_UBF_IO, 0);
+	    if (arg.err == 0) {
+		break;
+	    }
+	    if (arg.err != EINTR) {
+		rb_syserr_fail(arg.err, arg.func);
+	    }
+	    rb_thread_check_ints();
+	}
+	termios_query_ahead(&arg, arg.buf + arg.scanned, arg.len - arg.scanned);
+	if (arg.aheadlen > 0) {
+	    termios_query_keep_ahead(arg.fd, arg.ahead, arg.aheadlen);
+	}
+
+	for (i = 0; i < arg.n; i++) {
+	    VALUE resp;
+
+	    if (arg.end[i] < 0) {
+		continue;
+	    }
+	    resp = rb_str_new(arg.buf + arg.start[i], arg.end[i] - arg.start[i]);
+	    rb_ary_store(result, index[i], resp);
+	    if (!NIL_P(cache)) {
+		rb_hash_aset(cache, RARRAY_AREF(keys, index[i]),
+			     rb_str_new_frozen(resp));
+	    }
+	}
+	rb_str_resize(buf, 0);
+	rb_str_resize(ahead, 0);
+	rb_str_resize(meta, 0);
+	RB_GC_GUARD(req);
+	RB_GC_GUARD(held);
+    }
+    ALLOCV_END(vindex);
+
+    return RB_TYPE_P(request, T_ARRAY) ? result : rb_ary_entry(result, 0);
+}
+
+/*
+ * call-seq:
+ *   Termios.clear_query_cache(io = nil)
+ *
+ * Forgets the responses cached by Termios.query for the terminal device
+ * of io, or for all devices.
+ */
+static VALUE
+termios_s_clear_query_cache(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    VALUE io;
+    struct stat st;
+
+    rb_scan_args(argc, argv, "01", &io);
+    if (NIL_P(io)) {
+	rb_hash_clear(query_cache);
+    }
+    else {
+	if (fstat(termios_io_fileno(io), &st) < 0) {
+	    rb_sys_fail("fstat");
+	}
+	rb_hash_delete(query_cache, ULL2NUM((unsigned long long)st.st_rdev));
+    }
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   Termios.query_typeahead(io)
+ *
+ * Returns and forgets the bytes Termios.query read from the terminal
+ * device of io which were not part of a response, such as keys typed
+ * while it waited.  Returns an empty string if there are none.
+ */
+static VALUE
+termios_s_query_typeahead(obj, io)
+    VALUE obj, io;
+{
+    struct stat st;
+    VALUE kept;
+
+    if (fstat(termios_io_fileno(io), &st) < 0) {
+	rb_sys_fail("fstat");
+    }
+    kept = rb_hash_delete(query_typeahead, ULL2NUM((unsigned long long)st.st_rdev));
+    return NIL_P(kept) ? rb_str_new(0, 0) : kept;
+}
+
+/*
+ * Document-class: Termios::Recorder
+ *
+ * Records a terminal session into a memory-mapped ring file.  Data copied
+ * with Termios::Recorder#relay never becomes a Ruby String; each chunk is
+ * stored as a binary record with a monotonic timestamp, its direction and
+ * its length.  When a pseudo terminal master is attached, changes of its
+ * termios and window size are recorded too.  The oldest records are
+ * overwritten when the ring is full.
+ *
+ *   require 'termios'
+ *
+ *   rec = Termios::Recorder.new('session.rec', 16 << 20)
+ *   rec.attach(master)
+ *   Thread.new { rec.relay($stdin, master, Termios::Recorder::INPUT) }
+ *   rec.relay(master, $stdout)
+ *   rec.close
+ *
+ *   File.open('session.cast', 'w') {|f|
+ *     Termios::Recorder.to_asciicast('session.rec', f)
+ *   }
+ *
+ * The file consists of a 64 bytes header and the ring.  Each record is a
+ * 16 bytes header (64-bit timestamp in nanoseconds since the ring was
+ * created, 32-bit length, 8-bit type) followed by the data padded to 8
+ * bytes.  Integers are in the byte order of the host.
+ *
+ * Timestamps follow the monotonic clock while the ring is open.  A ring
+ * reopened later, possibly after a reboot, carries on from the wall clock
+ * time elapsed since its creation, or from its newest record when the
+ * wall clock says otherwise, so that timestamps never go backwards.
+ */
+
+#define RECORDER_MAGIC		"RTRMREC2"
+#define RECORDER_CHUNK		16384
+#define RECORDER_MIN_CAPACITY	(RECORDER_CHUNK * 4)
+#define RECORDER_ALIGN(n)	(((n) + 7) & ~(uint64_t)7)
+
+#define RECORDER_OUTPUT		0
+#define RECORDER_INPUT		1
+#define RECORDER_TERMIOS	2
+#define RECORDER_WINSIZE	3
+#define RECORDER_PAD		255
+
+struct recorder_header {
+    char magic[8];
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t records;
+    uint64_t dropped;
+    int64_t start_realtime;
+    int64_t last_time;
+};
+
+struct recorder_record {
+    int64_t time;
+    uint32_t length;
+    uint8_t type;
+    uint8_t reserved[3];
+};
+
+struct recorder_termios {
+    uint32_t iflag, oflag, cflag, lflag, ispeed, ospeed;
+    uint8_t cc[32];
+};
+
+struct recorder_winsize {
+    uint16_t row, col, xpixel, ypixel;
+};
+
+struct recorder {
+    int fd;
+    size_t mapsize;
+    struct recorder_header *hdr;
+    unsigned char *ring;
+    pthread_mutex_t lock;
+    VALUE attached;
+    int attached_fd;
+    struct termios last_termios;
+    struct winsize last_winsize;
+    int64_t clock_base;		/* timestamp when opened */
+    int64_t clock_open;		/* monotonic clock when opened */
+};
+
+struct recorder_relay_arg {
+    struct recorder *rec;
+    int src, dst, type;
+    char *buf;
+    long done;
+    int eof;
+    int err;
+};
+
+static VALUE cRecorder;
+
+static void
+recorder_unmap(rec)
+    struct recorder *rec;
+{
+    if (rec->hdr) {
+	msync(rec->hdr, rec->mapsize, MS_ASYNC);
+	munmap(rec->hdr, rec->mapsize);
+	rec->hdr = NULL;
+	rec->ring = NULL;
+    }
+    if (rec->fd >= 0) {
+	close(rec->fd);
+	rec->fd = -1;
+    }
+}
+
+static void
+recorder_mark(ptr)
+    void *ptr;
+{
+    rb_gc_mark(((struct recorder *)ptr)->attached);
+}
+
+static void
+recorder_free(ptr)
+    void *ptr;
+{
+    struct recorder *rec = ptr;
+
+    recorder_unmap(rec);
+    pthread_mutex_destroy(&rec->lock);
+    xfree(rec);
+}
+
+static const rb_data_type_t recorder_type = {
+    "Termios::Recorder",
+    {recorder_mark, recorder_free, 0,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+recorder_alloc(klass)
+    VALUE klass;
+{
+    struct recorder *rec;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct(klass, struct recorder, &recorder_type, rec);
+    rec->fd = -1;
+    rec->attached = Qnil;
+    rec->attached_fd = -1;
+    pthread_mutex_init(&rec->lock, NULL);
+
+    return obj;
+}
+
+/*
+ * Returns the timestamp for a record written now.
+ */
+static int64_t
+recorder_now(rec)
+    struct recorder *rec;
+{
+    return rec->clock_base + (termios_monotonic_ns() - rec->clock_open);
+}
+
+static struct recorder *
+get_recorder(self)
+    VALUE self;
+{
+    struct recorder *rec;
+
+    TypedData_Get_Struct(self, struct recorder, &recorder_type, rec);
+    if (!rec->hdr) {
+	rb_raise(rb_eIOError, "closed recorder");
+    }
+    return rec;
+}
+
+/*
+ * Drops the oldest records which lie in [from, to) of the ring.
+ */
+static void
+recorder_evict(rec, from, to)
+    struct recorder *rec;
+    uint64_t from, to;
+{
+    struct recorder_header *hdr = rec->hdr;
+
+    while (hdr->records > 0 && hdr->tail >= from && hdr->tail < to) {
+	struct recorder_record *r =
+	    (struct recorder_record *)(rec->ring + hdr->tail);
+
+	hdr->tail += sizeof(*r) + RECORDER_ALIGN(r->length);
+	if (hdr->capacity - hdr->tail < sizeof(*r)) {
+	    hdr->tail = 0;
+	}
+	hdr->records--;
+	if (r->type != RECORDER_PAD) {
+	    hdr->dropped++;
+	}
+    }
+    if (hdr->records == 0) {
+	hdr->tail = hdr->head;
+    }
+}
+
+/*
+ * Appends a record to the ring.  The caller must hold rec->lock.
+ */
+static void
+recorder_append(rec, type, time, data, len)
+    struct recorder *rec;
+    int type;
+    int64_t time;
+    const void *data;
+    uint32_t len;
+{
+    struct recorder_header *hdr = rec->hdr;
+    struct recorder_record *r;
+    uint64_t size = sizeof(*r) + RECORDER_ALIGN(len);
+
+    if (hdr->head + size > hdr->capacity) {
+	uint64_t rest = hdr->capacity - hdr->head;
+
+	if (rest >= sizeof(*r)) {
+	    recorder_evict(rec, hdr->head, hdr->capacity);
+	    r = (struct recorder_record *)(rec->ring + hdr->head);
+	    r->time = time;
+	    r->length = (uint32_t)(rest - sizeof(*r));
+	    r->type = RECORDER_PAD;
+	    hdr->records++;
+	}
+	hdr->head = 0;
+	if (hdr->records == 0) {
+	    hdr->tail = 0;
+	}
+    }
+
+    recorder_evict(rec, hdr->head, hdr->head + size);
+    r = (struct recorder_record *)(rec->ring + hdr->head);
+    r->time = time;
+    r->length = len;
+    r->type = (uint8_t)type;
+    memset(r->reserved, 0, sizeof(r->reserved));
+    memcpy(r + 1, data, len);
+    hdr->records++;
+    hdr->head += size;
+    if (time > hdr->last_time) {
+	hdr->last_time = time;
+    }
+    if (hdr->capacity - hdr->head < sizeof(*r)) {
+	hdr->head = 0;
+    }
+}
+
+/*
+ * Records changes of the termios and the window size of the attached
+ * pseudo terminal.  The caller must hold rec->lock.
+ */
+static void
+recorder_check_attached(rec, time)
+    struct recorder *rec;
+    int64_t time;
+{
+    struct termios t;
+    struct winsize ws;
+
+    if (rec->attached_fd < 0) {
+	return;
+    }
+    if (tcgetattr(rec->attached_fd, &t) == 0 &&
+	(t.c_iflag != rec->last_termios.c_iflag ||
+	 t.c_oflag != rec->last_termios.c_oflag ||
+	 t.c_cflag != rec->last_termios.c_cflag ||
+	 t.c_lflag != rec->last_termios.c_lflag ||
+	 cfgetispeed(&t) != cfgetispeed(&rec->last_termios) ||
+	 cfgetospeed(&t) != cfgetospeed(&rec->last_termios) ||
+	 memcmp(t.c_cc, rec->last_termios.c_cc, sizeof(t.c_cc)) != 0)) {
+	struct recorder_termios rt;
+	int i;
+
+	memset(&rt, 0, sizeof(rt));
+	rt.iflag = (uint32_t)t.c_iflag;
+	rt.oflag = (uint32_t)t.c_oflag;
+	rt.cflag = (uint32_t)t.c_cflag;
+	rt.lflag = (uint32_t)t.c_lflag;
+	rt.ispeed = (uint32_t)cfgetispeed(&t);
+	rt.ospeed = (uint32_t)cfgetospeed(&t);
+	for (i = 0; i < NCCS && i < (int)sizeof(rt.cc); i++) {
+	    rt.cc[i] = t.c_cc[i];
+	}
+	recorder_append(rec, RECORDER_TERMIOS, time, &rt, sizeof(rt));
+	rec->last_termios = t;
+    }
+    if (ioctl(rec->attached_fd, TIOCGWINSZ, &ws) == 0 &&
+	(ws.ws_row != rec->last_winsize.ws_row ||
+	 ws.ws_col != rec->last_winsize.ws_col ||
+	 ws.ws_xpixel != rec->last_winsize.ws_xpixel ||
+	 ws.ws_ypixel != rec->last_winsize.ws_ypixel)) {
+	struct recorder_winsize rw;
+
+	rw.row = ws.ws_row;
+	rw.col = ws.ws_col;
+	rw.xpixel = ws.ws_xpixel;
+	rw.ypixel = ws.ws_ypixel;
+	recorder_append(rec, RECORDER_WINSIZE, time, &rw, sizeof(rw));
+	rec->last_winsize = ws;
+    }
+}
+
+static void
+recorder_record(rec, type, data, len)
+    struct recorder *rec;
+    int type;
+    const char *data;
+    long len;
+{
+    int64_t now = recorder_now(rec);
+
+    pthread_mutex_lock(&rec->lock);
+    if (!rec->hdr) {		/* closed by another thread */
+	pthread_mutex_unlock(&rec->lock);
+	return;
+    }
+    recorder_check_attached(rec, now);
+    while (len > 0) {
+	long n = len > RECORDER_CHUNK ? RECORDER_CHUNK : len;
+
+	recorder_append(rec, type, now, data, (uint32_t)n);
+	data += n;
+	len -= n;
+    }
+    pthread_mutex_unlock(&rec->lock);
+}
+
+/*
+ * call-seq:
+ *   Termios::Recorder.new(path, capacity = nil)
+ *
+ * Opens the ring file at path, creating it when it does not exist.  An
+ * existing ring is appended to when capacity is nil or is the capacity of
+ * the ring; otherwise the file is initialized with a ring of capacity
+ * bytes (16 megabytes by default).
+ */
+static VALUE
+recorder_initialize(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct recorder *rec;
+    struct recorder_header *hdr, old;
+    VALUE path, capa;
+    uint64_t capacity;
+    struct stat st;
+    void *map;
+    int fd;
+
+    rb_scan_args(argc, argv, "11", &path, &capa);
+    FilePathValue(path);
+    capacity = NIL_P(capa) ? 0 : RECORDER_ALIGN(NUM2ULL(capa));
+    if (!NIL_P(capa) && capacity < RECORDER_MIN_CAPACITY) {
+	rb_raise(rb_eArgError, "capacity must be at least %d bytes",
+		 RECORDER_MIN_CAPACITY);
+    }
+
+    TypedData_Get_Struct(self, struct recorder, &recorder_type, rec);
+    recorder_unmap(rec);
+
+    if ((fd = open(StringValueCStr(path), O_RDWR|O_CREAT, 0644)) < 0) {
+	rb_sys_fail_str(path);
+    }
+    rb_update_max_fd(fd);
+    rb_fd_fix_cloexec(fd);
+    if (capacity == 0) {
+	if (pread(fd, &old, sizeof(old), 0) == sizeof(old) &&
+	    memcmp(old.magic, RECORDER_MAGIC, sizeof(old.magic)) == 0 &&
+	    old.capacity >= RECORDER_MIN_CAPACITY) {
+	    capacity = old.capacity;
+	}
+	else {
+	    capacity = 16 << 20;
+	}
+    }
+    if (fstat(fd, &st) < 0 ||
+	((uint64_t)st.st_size != sizeof(*hdr) + capacity &&
+	 ftruncate(fd, sizeof(*hdr) + capacity) < 0)) {
+	int e = errno;
+
+	close(fd);
+	errno = e;
+	rb_sys_fail_str(path);
+    }
+    map = mmap(NULL, sizeof(*hdr) + capacity, PROT_READ|PROT_WRITE,
+	       MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+	int e = errno;
+
+	close(fd);
+	errno = e;
+	rb_sys_fail_str(path);
+    }
+
+    rec->fd = fd;
+    rec->mapsize = sizeof(*hdr) + capacity;
+    rec->hdr = hdr = map;
+    rec->ring = (unsigned char *)map + sizeof(*hdr);
+
+    if (memcmp(hdr->magic, RECORDER_MAGIC, sizeof(hdr->magic)) != 0 ||
+	hdr->capacity != capacity ||
+	hdr->head >= capacity || hdr->tail >= capacity) {
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->capacity = capacity;
+	hdr->start_realtime = termios_realtime_ns();
+	memcpy(hdr->magic, RECORDER_MAGIC, sizeof(hdr->magic));
+    }
+    /*
+     * the monotonic clock of an earlier opening may have been reset by a
+     * reboot; carry on from the wall clock instead
+     */
+    rec->clock_open = termios_monotonic_ns();
+    rec->clock_base = termios_realtime_ns() - hdr->start_realtime;
+    if (rec->clock_base < hdr->last_time) {
+	rec->clock_base = hdr->last_time;
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   recorder.attach(master)
+ *
+ * Watches the termios and the window size of the pseudo terminal master.
+ * Their current values are recorded now, and changes are recorded with
+ * the following chunks.
+ */
+static VALUE
+recorder_attach(self, io)
+    VALUE self, io;
+{
+    struct recorder *rec = get_recorder(self);
+    int fd = termios_io_fileno(io);
+
+    pthread_mutex_lock(&rec->lock);
+    rec->attached = io;
+    rec->attached_fd = fd;
+    memset(&rec->last_termios, 0, sizeof(rec->last_termios));
+    memset(&rec->last_winsize, 0, sizeof(rec->last_winsize));
+    recorder_check_attached(rec, recorder_now(rec));
+    pthread_mutex_unlock(&rec->lock);
+
+    return self;
+}
+
+static void *
+recorder_relay_body(ptr)
+    void *ptr;
+{
+    struct recorder_relay_arg *arg = ptr;
+
+    for (;;) {
+	ssize_t n = read(arg->src, arg->buf, RECORDER_CHUNK);
+	long w;
+
+	if (n < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		struct pollfd pfd;
+
+		pfd.fd = arg->src;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) < 0) {
+		    arg->err = errno;
+		    break;
+		}
+		continue;
+	    }
+	    if (errno == EIO) {	/* the slave of a pty is closed */
+		arg->eof = 1;
+		break;
+	    }
+	    arg->err = errno;
+	    break;
+	}
+	if (n == 0) {
+	    arg->eof = 1;
+	    break;
+	}
+	recorder_record(arg->rec, arg->type, arg->buf, n);
+	w = termios_write_full(arg->dst, arg->buf, n);
+	arg->done += w;
+	if (w < n) {
+	    /* the rest of the chunk is lost if it is interrupted */
+	    arg->err = errno;
+	    break;
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ * call-seq:
+ *   recorder.relay(src, dst, direction = Termios::Recorder::OUTPUT)
+ *
+ * Copies data from src to dst until src reaches end of file, recording
+ * every chunk as direction (Termios::Recorder::OUTPUT or
+ * Termios::Recorder::INPUT).  It runs without the GVL and returns the
+ * number of bytes copied.
+ */
+static VALUE
+recorder_relay(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct recorder_relay_arg arg;
+    VALUE src, dst, dir, buf;
+
+    rb_scan_args(argc, argv, "21", &src, &dst, &dir);
+    arg.rec = get_recorder(self);
+    arg.type = NIL_P(dir) ? RECORDER_OUTPUT : NUM2INT(dir);
+    if (arg.type != RECORDER_OUTPUT && arg.type != RECORDER_INPUT) {
+	rb_raise(rb_eArgError, "wrong direction %d", arg.type);
+    }
+    buf = rb_str_tmp_new(RECORDER_CHUNK);
+    arg.buf = RSTRING_PTR(buf);
+    arg.done = 0;
+    arg.eof = 0;
+
+    for (;;) {
+	arg.src = termios_io_fileno(src);
+	arg.dst = termios_io_fileno(dst);
+	get_recorder(self);
+	arg.err = 0;
+	termios_without_gvl(recorder_relay_body, &arg, RUBY_UBF_IO, 0);
+	if (arg.eof) {
+	    break;
+	}
+	if (arg.err != EINTR) {
+	    errno = arg.err;
+	    rb_sys_fail("relay");
+	}
+	rb_thread_check_ints();
+    }
+    rb_str_resize(buf, 0);
+
+    return LONG2NUM(arg.done);
+}
+
+/*
+ * call-seq:
+ *   recorder.record(direction, str)
+ *
+ * Records str as data of direction.
+ */
+static VALUE
+recorder_record_m(self, dir, str)
+    VALUE self, dir, str;
+{
+    struct recorder *rec = get_recorder(self);
+    int type = NUM2INT(dir);
+
+    if (type != RECORDER_OUTPUT && type != RECORDER_INPUT) {
+	rb_raise(rb_eArgError, "wrong direction %d", type);
+    }
+    StringValue(str);
+    recorder_record(rec, type, RSTRING_PTR(str), RSTRING_LEN(str));
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   recorder.each_record {|type, time, data| ... }
+ *
+ * Yields the records from the oldest one.  The time is in nanoseconds
+ * since the ring was created.  The data is a String for
+ * Termios::Recorder::OUTPUT and Termios::Recorder::INPUT, a
+ * Termios::Termios object for Termios::Recorder::TERMIOS and an Array of
+ * [rows, cols, xpixel, ypixel] for Termios::Recorder::WINSIZE.
+ */
+static VALUE
+recorder_each_record(self)
+    VALUE self;
+{
+    struct recorder *rec = get_recorder(self);
+    uint64_t pos, records, capacity, walked = 0;
+    VALUE snapshot;
+    const unsigned char *ring;
+
+    RETURN_ENUMERATOR(self, 0, 0);
+
+    /*
+     * take a snapshot so that concurrent relays, or the block closing the
+     * recorder, do not disturb us
+     */
+    pthread_mutex_lock(&rec->lock);
+    pos = rec->hdr->tail;
+    records = rec->hdr->records;
+    capacity = rec->hdr->capacity;
+    snapshot = rb_str_new((const char *)rec->ring, capacity);
+    pthread_mutex_unlock(&rec->lock);
+    ring = (const unsigned char *)RSTRING_PTR(snapshot);
+
+    while (records-- > 0) {
+	const struct recorder_record *r;
+	const char *data;
+	int64_t time;
+	uint64_t size;
+	VALUE val;
+
+	/* the ring file may be truncated or corrupt; stop at a bad record */
+	if (pos % RECORDER_ALIGN(1) != 0 || capacity - pos < sizeof(*r)) {
+	    break;
+	}
+	r = (const struct recorder_record *)(ring + pos);
+	if (r->length > capacity - pos - sizeof(*r)) {
+	    break;
+	}
+	size = sizeof(*r) + RECORDER_ALIGN(r->length);
+	walked += size;
+	if (walked > capacity ||
+	    (r->type == RECORDER_TERMIOS &&
+	     r->length < sizeof(struct recorder_termios)) ||
+	    (r->type == RECORDER_WINSIZE &&
+	     r->length < sizeof(struct recorder_winsize))) {
+	    break;
+	}
+	data = (const char *)(r + 1);
+	time = r->time;
+
+	switch (r->type) {
+	  case RECORDER_OUTPUT:
+	  case RECORDER_INPUT:
+	    val = rb_str_new(data, r->length);
+	    break;
+	  case RECORDER_TERMIOS:
+	    {
+		struct recorder_termios rt;
+		struct termios t;
+		int i;
+
+		memcpy(&rt, data, sizeof(rt));
+		memset(&t, 0, sizeof(t));
+		t.c_iflag = rt.iflag;
+		t.c_oflag = rt.oflag;
+		t.c_cflag = rt.cflag;
+		t.c_lflag = rt.lflag;
+		for (i = 0; i < NCCS && i < (int)sizeof(rt.cc); i++) {
+		    t.c_cc[i] = rt.cc[i];
+		}
+		cfsetispeed(&t, rt.ispeed);
+		cfsetospeed(&t, rt.ospeed);
+		val = termios_to_Termios(&t);
+	    }
+	    break;
+	  case RECORDER_WINSIZE:
+	    {
+		struct recorder_winsize rw;
+
+		memcpy(&rw, data, sizeof(rw));
+		val = rb_ary_new3(4, INT2FIX(rw.row), INT2FIX(rw.col),
+				  INT2FIX(rw.xpixel), INT2FIX(rw.ypixel));
+	    }
+	    break;
+	  default:
+	    val = Qnil;
+	    break;
+	}
+	if (r->type != RECORDER_PAD) {
+	    rb_yield_values(3, INT2FIX(r->type), LL2NUM(time), val);
+	}
+
+	pos += size;
+	if (capacity - pos < sizeof(*r)) {
+	    pos = 0;
+	}
+    }
+    RB_GC_GUARD(snapshot);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   recorder.start_time
+ *
+ * Returns the time when the ring was created.
+ */
+static VALUE
+recorder_start_time(self)
+    VALUE self;
+{
+    int64_t t = get_recorder(self)->hdr->start_realtime;
+
+    return rb_time_nano_new(t / 1000000000, t % 1000000000);
+}
+
+/*
+ * call-seq:
+ *   recorder.dropped
+ *
+ * Returns the number of records overwritten because the ring was full.
+ */
+static VALUE
+recorder_dropped(self)
+    VALUE self;
+{
+    return ULL2NUM(get_recorder(self)->hdr->dropped);
+}
+
+/*
+ * call-seq:
+ *   recorder.sync
+ *
+ * Flushes the ring to the file.
+ */
+static VALUE
+recorder_sync(self)
+    VALUE self;
+{
+    struct recorder *rec = get_recorder(self);
+
+    if (msync(rec->hdr, rec->mapsize, MS_SYNC) < 0) {
+	rb_sys_fail("msync");
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   recorder.close
+ *
+ * Unmaps and closes the ring file.
+ */
+static VALUE
+recorder_close(self)
+    VALUE self;
+{
+    struct recorder *rec;
+
+    TypedData_Get_Struct(self, struct recorder, &recorder_type, rec);
+    pthread_mutex_lock(&rec->lock);
+    recorder_unmap(rec);
+    rec->attached = Qnil;
+    rec->attached_fd = -1;
+    pthread_mutex_unlock(&rec->lock);
+
+    return Qnil;
+}
+
+/*
+ * Document-class: Termios::KeyDecoder
+ *
+ * Decodes input from a terminal in raw mode (without ICANON and ECHO) into
+ * key events.  It understands CSI and SS3 sequences of cursor and function
+ * keys, bracketed paste, X10 and SGR mouse reports, focus reports and
+ * UTF-8.  Incomplete sequences are kept across calls of
+ * Termios::KeyDecoder#feed.  Like VTIME of termios, a lone ESC is reported
+ * as the escape key when no more input arrives within the timeout.
+ *
+ *   require 'termios'
+ *
+ *   decoder = Termios::KeyDecoder.new(0.05)
+ *   loop {
+ *     if IO.select([$stdin], nil, nil, decoder.timeout_remaining)
+ *       events = decoder.feed($stdin.readpartial(4096))
+ *     else
+ *       events = decoder.expire
+ *     end
+ *     events.each {|ev| p ev }
+ *   }
+ *
+ * Events are Arrays:
+ *
+ *   [:text, str]                  # printable characters
+ *   [:key, name, mods]            # name is a Symbol like :up, :f1 or
+ *                                 # :enter, or a String of a character
+ *   [:paste, str]                 # bracketed paste
+ *   [:mouse, action, button, col, row, mods]
+ *                                 # action is :press, :release or :drag
+ *   [:focus, in]
+ *   [:cursor_position, row, col]
+ *   [:unknown, bytes]
+ *
+ * mods is a combination of SHIFT, ALT, CTRL and SUPER.
+ */
+
+#define KEY_DECODER_PENDING	64
+#define KEY_DECODER_PARAMS	16
+#define KEY_DECODER_PARAM_MAX	0x110000 /* one past the last codepoint */
+
+#define KEY_SHIFT	1
+#define KEY_ALT		2
+#define KEY_CTRL	4
+#define KEY_SUPER	8
+
+struct key_decoder {
+    double timeout;
+    double since;		/* when the pending bytes arrived */
+    int npending;
+    unsigned char pending[KEY_DECODER_PENDING];
+    int in_paste;
+    VALUE paste;
+};
+
+static VALUE cKeyDecoder;
+static VALUE sym_text, sym_key, sym_paste, sym_mouse, sym_focus;
+static VALUE sym_cursor_position, sym_unknown;
+static VALUE sym_press, sym_release, sym_drag;
+
+static void
+key_decoder_mark(ptr)
+    void *ptr;
+{
+    rb_gc_mark(((struct key_decoder *)ptr)->paste);
+}
+
+static const rb_data_type_t key_decoder_type = {
+    "Termios::KeyDecoder",
+    {key_decoder_mark, RUBY_TYPED_DEFAULT_FREE, 0,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+key_decoder_alloc(klass)
+    VALUE klass;
+{
+    struct key_decoder *kd;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct(klass, struct key_decoder,
+				&key_decoder_type, kd);
+    kd->paste = Qnil;
+    kd->timeout = 0.05;
+
+    return obj;
+}
+
+static struct key_decoder *
+get_key_decoder(self)
+    VALUE self;
+{
+    struct key_decoder *kd;
+
+    TypedData_Get_Struct(self, struct key_decoder, &key_decoder_type, kd);
+    return kd;
+}
+
+static VALUE
+key_name(name)
+    const char *name;
+{
+    return ID2SYM(rb_intern(name));
+}
+
+static void
+push_key(events, name, mods)
+    VALUE events, name;
+    int mods;
+{
+    rb_ary_push(events, rb_ary_new3(3, sym_key, name, INT2FIX(mods)));
+}
+
+static void
+push_bytes(events, type, p, len)
+    VALUE events, type;
+    const unsigned char *p;
+    long len;
+{
+    VALUE str = rb_enc_str_new((const char *)p, len, rb_utf8_encoding());
+
+    rb_ary_push(events, rb_assoc_new(type, str));
+}
+
+/*
+ * Returns the length of the UTF-8 sequence which begins with c.
+ */
+static int
+utf8_seq_len(c)
+    unsigned int c;
+{
+    if (c >= 0xf0) return 4;
+    if (c >= 0xe0) return 3;
+    if (c >= 0xc0) return 2;
+    return 1;
+}
+
+/*
+ * Returns the number of bytes at the end of p which are the beginning of
+ * an incomplete UTF-8 sequence.
+ */
+static long
+utf8_incomplete_tail(p, len)
+    const unsigned char *p;
+    long len;
+{
+    long i = len - 1;
+
+    while (i >= 0 && i >= len - 3 && (p[i] & 0xc0) == 0x80) {
+	i--;
+    }
+    if (i >= 0 && p[i] >= 0xc0 && len - i < utf8_seq_len(p[i])) {
+	return len - i;
+    }
+    return 0;
+}
+
+static void
+push_control(events, c, mods)
+    VALUE events;
+    unsigned int c;
+    int mods;
+{
+    char ch;
+
+    switch (c) {
+      case '\r':
+	push_key(events, key_name("enter"), mods);
+	return;
+      case '\t':
+	push_key(events, key_name("tab"), mods);
+	return;
+      case 0x7f:
+	push_key(events, key_name("backspace"), mods);
+	return;
+      case 0x1b:
+	push_key(events, key_name("escape"), mods);
+	return;
+      case 0:
+	ch = ' ';
+	break;
+      default:
+	ch = c < 0x1b ? (char)(c - 1 + 'a') : (char)(c - 0x1c + '\\');
+	break;
+    }
+    push_key(events, rb_str_new(&ch, 1), mods | KEY_CTRL);
+}
+
+static VALUE
+csi_tilde_key(code)
+    long code;
+{
+    switch (code) {
+      case 1: case 7:	return key_name("home");
+      case 2:		return key_name("insert");
+      case 3:		return key_name("delete");
+      case 4: case 8:	return key_name("end");
+      case 5:		return key_name("page_up");
+      case 6:		return key_name("page_down");
+      case 11:		return key_name("f1");
+      case 12:		return key_name("f2");
+      case 13:		return key_name("f3");
+      case 14:		return key_name("f4");
+      case 15:		return key_name("f5");
+      case 17:		return key_name("f6");
+      case 18:		return key_name("f7");
+      case 19:		return key_name("f8");
+      case 20:		return key_name("f9");
+      case 21:		return key_name("f10");
+      case 23:		return key_name("f11");
+      case 24:		return key_name("f12");
+    }
+    return Qnil;
+}
+
+static VALUE
+letter_key(final)
+    int final;
+{
+    switch (final) {
+      case 'A': return key_name("up");
+      case 'B': return key_name("down");
+      case 'C': return key_name("right");
+      case 'D': return key_name("left");
+      case 'E': return key_name("begin");
+      case 'F': return key_name("end");
+      case 'H': return key_name("home");
+      case 'P': return key_name("f1");
+      case 'Q': return key_name("f2");
+      case 'R': return key_name("f3");
+      case 'S': return key_name("f4");
+    }
+    return Qnil;
+}
+
+static void
+push_codepoint_key(events, code, mods)
+    VALUE events;
+    long code;
+    int mods;
+{
+    if (code < 0x20 || code == 0x7f) {
+	push_control(events, (unsigned int)code, mods);
+    }
+    else {
+	VALUE str = rb_enc_uint_chr((unsigned int)code, rb_utf8_encoding());
+
+	push_key(events, str, mods);
+    }
+}
+
+/*
+ * Returns true if code can be given to push_codepoint_key.
+ */
+static int
+valid_codepoint(code)
+    long code;
+{
+    return code >= 0 && code < 0x110000 && (code < 0xd800 || code > 0xdfff);
+}
+
+static void
+push_mouse(events, cb, col, row, release)
+    VALUE events;
+    long cb, col, row;
+    int release;
+{
+    VALUE action, ev;
+    int button, mods = 0;
+
+    if (cb & 4)  mods |= KEY_SHIFT;
+    if (cb & 8)  mods |= KEY_ALT;
+    if (cb & 16) mods |= KEY_CTRL;
+    button = (int)(cb & 3) + 1;
+    if (cb & 64) {
+	button += 3;		/* wheel */
+    }
+    else if ((cb & 3) == 3) {
+	button = 0;		/* X10 release of unknown button */
+	release = 1;
+    }
+    if (release) {
+	action = sym_release;
+    }
+    else if (cb & 32) {
+	action = sym_drag;
+    }
+    else {
+	action = sym_press;
+    }
+
+    ev = rb_ary_new2(6);
+    rb_ary_push(ev, sym_mouse);
+    rb_ary_push(ev, action);
+    rb_ary_push(ev, INT2FIX(button));
+    rb_ary_push(ev, LONG2NUM(col));
+    rb_ary_push(ev, LONG2NUM(row));
+    rb_ary_push(ev, INT2FIX(mods));
+    rb_ary_push(events, ev);
+}
+
+/*
+ * Decodes a CSI sequence which starts at p (ESC and '[').  Returns the
+ * length of the sequence, or 0 if it is incomplete.
+ */
+static long
+key_decoder_csi(kd, events, p, len)
+    struct key_decoder *kd;
+    VALUE events;
+    const unsigned char *p;
+    long len;
+{
+    long params[KEY_DECODER_PARAMS];
+    int nparams = 0, private = 0, final;
+    long i = 2;
+
+    if (len > 2 && p[2] == 'M') {		/* X10 mouse */
+	if (len < 6) {
+	    return 0;
+	}
+	push_mouse(events, (long)p[3] - 32, (long)p[4] - 32, (long)p[5] - 32, 0);
+	return 6;
+    }
+    if (len > 2 && p[2] >= 0x3c && p[2] <= 0x3f) {
+	private = p[2];
+	i++;
+    }
+
+    memset(params, 0, sizeof(params));
+    for (; i < len; i++) {
+	unsigned int c = p[i];
+
+	if (c >= '0' && c <= '9') {
+	    if (nparams == 0) nparams = 1;
+	    if (nparams <= KEY_DECODER_PARAMS &&
+		params[nparams - 1] < KEY_DECODER_PARAM_MAX) {
+		params[nparams - 1] = params[nparams - 1] * 10 + (c - '0');
+		if (params[nparams - 1] > KEY_DECODER_PARAM_MAX) {
+		    params[nparams - 1] = KEY_DECODER_PARAM_MAX;
+		}
+	    }
+	}
+	else if (c == ';' || c == ':') {
+	    if (nparams == 0) nparams = 1;
+	    nparams++;
+	}
+	else if (c >= 0x20 && c <= 0x2f) {
+	    /* intermediate bytes */
+	}
+	else {
+	    break;
+	}
+    }
+    if (i >= len) {
+	return 0;
+    }
+    if (nparams > KEY_DECODER_PARAMS) {
+	nparams = KEY_DECODER_PARAMS;
+    }
+    final = p[i++];
+
+    if (private == '<' && (final == 'M' || final == 'm') && nparams >= 3) {
+	push_mouse(events, params[0], params[1], params[2], final == 'm');
+    }
+    else if (private) {
+	push_bytes(events, sym_unknown, p, i);
+    }
+    else if (final == '~') {
+	int mods = nparams >= 2 && params[1] > 0 ? (int)params[1] - 1 : 0;
+	VALUE name;
+
+	if (params[0] == 200) {
+	    kd->in_paste = 1;
+	    kd->paste = rb_str_buf_new(0);
+	    rb_enc_associate(kd->paste, rb_utf8_encoding());
+	}
+	else if (params[0] == 27 && nparams >= 3 && valid_codepoint(params[2])) {
+	    push_codepoint_key(events, params[2], mods);
+	}
+	else if (!NIL_P(name = csi_tilde_key(params[0]))) {
+	    push_key(events, name, mods);
+	}
+	else if (params[0] != 201) {
+	    push_bytes(events, sym_unknown, p, i);
+	}
+    }
+    else if (final == 'u' && nparams >= 1 && valid_codepoint(params[0])) {
+	push_codepoint_key(events, params[0],
+			   nparams >= 2 && params[1] > 0 ? (int)params[1] - 1 : 0);
+    }
+    else if ((final == 'I' || final == 'O') && nparams == 0) {
+	rb_ary_push(events, rb_assoc_new(sym_focus, final == 'I' ? Qtrue : Qfalse));
+    }
+    else if (final == 'Z') {
+	push_key(events, key_name("tab"), KEY_SHIFT);
+    }
+    else if (final == 'R' && nparams == 2 && params[0] != 1) {
+	rb_ary_push(events, rb_ary_new3(3, sym_cursor_position,
+					LONG2NUM(params[0]), LONG2NUM(params[1])));
+    }
+    else {
+	VALUE name = letter_key(final);
+
+	if (NIL_P(name)) {
+	    push_bytes(events, sym_unknown, p, i);
+	}
+	else {
+	    push_key(events, name,
+		     nparams >= 2 && params[1] > 0 ? (int)params[1] - 1 : 0);
+	}
+    }
+
+    return i;
+}
+
+/*
+ * Decodes an escape sequence at p.  Returns its length, or 0 if it is
+ * incomplete.
+ */
+static long
+key_decoder_escape(kd, events, p, len)
+    struct key_decoder *kd;
+    VALUE events;
+    const unsigned char *p;
+    long len;
+{
+    unsigned int c;
+
+    if (len < 2) {
+	return 0;
+    }
+    c = p[1];
+    if (c == '[') {
+	return key_decoder_csi(kd, events, p, len);
+    }
+    if (c == 'O') {
+	VALUE name;
+
+	if (len < 3) {
+	    return 0;
+	}
+	if (NIL_P(name = letter_key(p[2]))) {
+	    push_bytes(events, sym_unknown, p, 3);
+	}
+	else {
+	    push_key(events, name, 0);
+	}
+	return 3;
+    }
+    if (c == 0x1b) {
+	/* ESC ESC: the first one is the escape key */
+	push_key(events, key_name("escape"), 0);
+	return 1;
+    }
+    if (c < 0x20 || c == 0x7f) {
+	push_control(events, c, KEY_ALT);
+	return 2;
+    }
+    if (c >= 0x80) {
+	int n = utf8_seq_len(c);
+
+	if (len < 1 + n) {
+	    return 0;
+	}
+	push_key(events, rb_enc_str_new((const char *)p + 1, n,
+					rb_utf8_encoding()), KEY_ALT);
+	return 1 + n;
+    }
+    push_key(events, rb_str_new((const char *)p + 1, 1), KEY_ALT);
+    return 2;
+}
+
+/*
+ * Appends bracketed paste data at p to the paste buffer.  Returns the
+ * number of bytes consumed; bytes which may be the beginning of the end
+ * marker are left.
+ */
+static long
+key_decoder_paste(kd, events, p, len)
+    struct key_decoder *kd;
+    VALUE events;
+    const unsigned char *p;
+    long len;
+{
+    static const char end_marker[] = "\033[201~";
+    const long mlen = sizeof(end_marker) - 1;
+    long i = 0;
+
+    while (i < len) {
+	const unsigned char *esc = memchr(p + i, 0x1b, len - i);
+	long j, rest;
+
+	if (!esc) {
+	    rb_str_buf_cat(kd->paste, (const char *)p + i, len - i);
+	    return len;
+	}
+	j = esc - p;
+	rest = len - j;
+	if (rest < mlen && memcmp(esc, end_marker, rest) == 0) {
+	    rb_str_buf_cat(kd->paste, (const char *)p + i, j - i);
+	    return j;		/* wait for the rest of the marker */
+	}
+	if (rest >= mlen && memcmp(esc, end_marker, mlen) == 0) {
+	    rb_str_buf_cat(kd->paste, (const char *)p + i, j - i);
+	    rb_ary_push(events, rb_assoc_new(sym_paste, kd->paste));
+	    kd->paste = Qnil;
+	    kd->in_paste = 0;
+	    return j + mlen;
+	}
+	rb_str_buf_cat(kd->paste, (const char *)p + i, j + 1 - i);
+	i = j + 1;
+    }
+
+    return len;
+}
+
+/*
+ * Decodes p into events.  Returns the number of bytes consumed; the rest
+ * is an incomplete sequence.  If force is true, incomplete sequences are
+ * decoded as they are.
+ */
+static long
+key_decoder_decode(kd, events, p, len, force)
+    struct key_decoder *kd;
+    VALUE events;
+    const unsigned char *p;
+    long len;
+    int force;
+{
+    long i = 0;
+
+    while (i < len) {
+	unsigned int c = p[i];
+	long n;
+
+	if (kd->in_paste) {
+	    n = key_decoder_paste(kd, events, p + i, len - i);
+	    if (n == 0) {
+		if (!force) break;
+		rb_str_buf_cat(kd->paste, (const char *)p + i, len - i);
+		return len;
+	    }
+	    i += n;
+	}
+	else if (c == 0x1b) {
+	    n = key_decoder_escape(kd, events, p + i, len - i);
+	    if (n == 0) {
+		if (!force) break;
+		push_key(events, key_name("escape"), 0);
+		n = 1;
+	    }
+	    i += n;
+	}
+	else if (c < 0x20 || c == 0x7f) {
+	    push_control(events, c, 0);
+	    i++;
+	}
+	else {
+	    long j = i + 1;
+
+	    while (j < len && p[j] >= 0x20 && p[j] != 0x7f) {
+		j++;
+	    }
+	    if (j == len && !force) {
+		j -= utf8_incomplete_tail(p + i, j - i);
+		if (j == i) break;
+	    }
+	    push_bytes(events, sym_text, p + i, j - i);
+	    i = j;
+	}
+    }
+
+    return i;
+}
+
+static void
+key_decoder_keep(kd, events, p, len)
+    struct key_decoder *kd;
+    VALUE events;
+    const unsigned char *p;
+    long len;
+{
+    if (len > KEY_DECODER_PENDING) {
+	push_bytes(events, sym_unknown, p, len);
+	len = 0;
+    }
+    memcpy(kd->pending, p, len);
+    kd->npending = (int)len;
+}
+
+/*
+ * call-seq:
+ *   Termios::KeyDecoder.new(timeout = 0.05)
+ *
+ * Returns a new decoder.  A lone ESC is reported as the escape key when
+ * no more input arrives within timeout seconds.
+ */
+static VALUE
+key_decoder_initialize(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct key_decoder *kd = get_key_decoder(self);
+    VALUE timeout;
+
+    rb_scan_args(argc, argv, "01", &timeout);
+    if (!NIL_P(timeout)) {
+	kd->timeout = NUM2DBL(timeout);
+    }
+    kd->npending = 0;
+    kd->in_paste = 0;
+    kd->paste = Qnil;
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   decoder.feed(str)
+ *
+ * Decodes str with the bytes kept from the previous calls, and returns an
+ * Array of events.
+ */
+static VALUE
+key_decoder_feed(self, str)
+    VALUE self, str;
+{
+    struct key_decoder *kd = get_key_decoder(self);
+    VALUE events = rb_ary_new(), buf = Qnil;
+    const unsigned char *p;
+    long len, n;
+
+    StringValue(str);
+    if (kd->npending > 0) {
+	buf = rb_str_buf_new(kd->npending + RSTRING_LEN(str));
+	rb_str_buf_cat(buf, (const char *)kd->pending, kd->npending);
+	rb_str_buf_cat(buf, RSTRING_PTR(str), RSTRING_LEN(str));
+	p = (const unsigned char *)RSTRING_PTR(buf);
+	len = RSTRING_LEN(buf);
+    }
+    else {
+	str = rb_str_new_frozen(str);
+	p = (const unsigned char *)RSTRING_PTR(str);
+	len = RSTRING_LEN(str);
+    }
+
+    n = key_decoder_decode(kd, events, p, len, 0);
+    if (n < len) {
+	kd->since = termios_monotonic();	/* restarted like VTIME */
+    }
+    key_decoder_keep(kd, events, p + n, len - n);
+    RB_GC_GUARD(buf);
+    RB_GC_GUARD(str);
+
+    return events;
+}
+
+/*
+ * call-seq:
+ *   decoder.flush
+ *
+ * Decodes the kept bytes as they are, and returns an Array of events.  A
+ * kept ESC becomes the escape key.
+ */
+static VALUE
+key_decoder_flush(self)
+    VALUE self;
+{
+    struct key_decoder *kd = get_key_decoder(self);
+    VALUE events = rb_ary_new();
+    unsigned char buf[KEY_DECODER_PENDING];
+    long len = kd->npending;
+
+    memcpy(buf, kd->pending, len);
+    kd->npending = 0;
+    key_decoder_decode(kd, events, buf, len, 1);
+
+    return events;
+}
+
+/*
+ * call-seq:
+ *   decoder.timeout_remaining
+ *
+ * Returns seconds until the kept bytes time out, or nil if no bytes are
+ * kept.  It is suitable as the timeout of IO.select.
+ */
+static VALUE
+key_decoder_timeout_remaining(self)
+    VALUE self;
+{
+    struct key_decoder *kd = get_key_decoder(self);
+    double rest;
+
+    if (kd->npending == 0 || kd->in_paste) {
+	return Qnil;
+    }
+    rest = kd->since + kd->timeout - termios_monotonic();
+
+    return rb_float_new(rest > 0.0 ? rest : 0.0);
+}
+
+/*
+ * call-seq:
+ *   decoder.expire
+ *
+ * Decodes the kept bytes as Termios::KeyDecoder#flush does if they timed
+ * out, and returns an Array of events.
+ */
+static VALUE
+key_decoder_expire(self)
+    VALUE self;
+{
+    struct key_decoder *kd = get_key_decoder(self);
+
+    if (kd->npending == 0 || kd->in_paste ||
+	termios_monotonic() - kd->since < kd->timeout) {
+	return rb_ary_new();
+    }
+
+    return key_decoder_flush(self);
+}
+
+/*
+ * call-seq:
+ *   decoder.pending?
+ *
+ * Returns true if an incomplete sequence or a bracketed paste is kept.
+ */
+static VALUE
+key_decoder_pending_p(self)
+    VALUE self;
+{
+    struct key_decoder *kd = get_key_decoder(self);
+
+    return kd->npending > 0 || kd->in_paste ? Qtrue : Qfalse;
+}
+
+/*
+ * Document-class: Termios::LineDiscipline
+ *
+ * A line discipline in userspace which applies the input processing of a
+ * Termios::Termios object (iflag, lflag and cc) to a byte stream which is
+ * not a terminal, a socket for example.  In canonical mode it edits lines
+ * with VERASE, VKILL, VWERASE and so on; it also produces the echo, which
+ * is processed by the output modes (see Termios::Termios#process_output),
+ * and reports the signal characters of ISIG.
+ *
+ *   require 'termios'
+ *
+ *   ld = Termios::LineDiscipline.new(Termios.tcgetattr($stdin))
+ *   lines, echo, events = ld.feed(sock.readpartial(4096))
+ *   sock.write(echo)
+ *   Process.kill(:INT, job) if events.include?(:INT)
+ *
+ * Events are :INT, :QUIT and :TSTP for VINTR, VQUIT and VSUSP, and :XOFF
+ * and :XON for VSTOP and VSTART when IXON is set.  In canonical mode an
+ * empty String in lines means end of file (VEOF at the beginning of a
+ * line).  In non-canonical mode the processed input is returned as one
+ * chunk; VMIN and VTIME are not emulated.
+ */
+
+#define LINE_DISCIPLINE_MAX	4095
+
+struct line_discipline {
+    struct termios t;
+    long len;
+    long column;		/* cursor column of the echo */
+    long canon_column;		/* column where the line began */
+    int lnext;
+    unsigned char line[LINE_DISCIPLINE_MAX + 1];
+};
+
+static VALUE cLineDiscipline;
+static VALUE sym_INT, sym_QUIT, sym_TSTP, sym_XOFF, sym_XON;
+
+static const rb_data_type_t line_discipline_type = {
+    "Termios::LineDiscipline",
+    {0, RUBY_TYPED_DEFAULT_FREE, 0,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+line_discipline_alloc(klass)
+    VALUE klass;
+{
+    struct line_discipline *ld;
+
+    return TypedData_Make_Struct(klass, struct line_discipline,
+				 &line_discipline_type, ld);
+}
+
+static struct line_discipline *
+get_line_discipline(self)
+    VALUE self;
+{
+    struct line_discipline *ld;
+
+    TypedData_Get_Struct(self, struct line_discipline,
+			 &line_discipline_type, ld);
+    return ld;
+}
+
+#define LD_I(ld, f)	((ld)->t.c_iflag & (f))
+#define LD_L(ld, f)	((ld)->t.c_lflag & (f))
+#define LD_CC(ld, i, c)	((ld)->t.c_cc[i] != _POSIX_VDISABLE && \
+			 (ld)->t.c_cc[i] == (c))
+
+static void
+ld_echo_raw(ld, echo, p, len)
+    struct line_discipline *ld;
+    VALUE echo;
+    const unsigned char *p;
+    long len;
+{
+    long n;
+
+    if (!(ld->t.c_oflag & OPOST)) {
+	termios_output_process(0, ld->t.c_iflag, p, len, NULL, &ld->column);
+	rb_str_buf_cat(echo, (const char *)p, len);
+	return;
+    }
+    n = RSTRING_LEN(echo);
+    rb_str_resize(echo, n + len * 8);
+    n += termios_output_process(ld->t.c_oflag, ld->t.c_iflag, p, len,
+				(unsigned char *)RSTRING_PTR(echo) + n,
+				&ld->column);
+    rb_str_set_len(echo, n);
+}
+
+/*
+ * Echoes c, as ^X for control characters when ECHOCTL is set.
+ */
+static void
+ld_echo_char(ld, echo, c)
+    struct line_discipline *ld;
+    VALUE echo;
+    unsigned char c;
+{
+#ifdef ECHOCTL
+    if (LD_L(ld, ECHOCTL) && (c < 0x20 || c == 0x7f) &&
+	c != '\t' && c != '\n') {
+	unsigned char buf[2];
+
+	buf[0] = '^';
+	buf[1] = c == 0x7f ? '?' : c + '@';
+	ld_echo_raw(ld, echo, buf, 2);
+	return;
+    }
+#endif
+    ld_echo_raw(ld, echo, &c, 1);
+}
+
+/*
+ * Removes the last character of the line and echoes its erasure.
+ */
+static void
+ld_erase_char(ld, echo, visual)
+    struct line_discipline *ld;
+    VALUE echo;
+    int visual;
+{
+    unsigned char c;
+    int width = 1;
+
+    if (ld->len == 0) {
+	return;
+    }
+    c = ld->line[--ld->len];
+#ifdef IUTF8
+    if (LD_I(ld, IUTF8)) {
+	while (ld->len > 0 && (c & 0xc0) == 0x80) {
+	    c = ld->line[--ld->len];
+	}
+    }
+#endif
+    if (!LD_L(ld, ECHO) || !visual) {
+	return;
+    }
+    if (c == '\t') {
+	/* back to the column where the tab started */
+	long col = ld->canon_column, i;
+
+	for (i = 0; i < ld->len; i++) {
+	    unsigned char d = ld->line[i];
+
+	    if (d == '\t') {
+		col = (col | 7) + 1;
+	    }
+#ifdef ECHOCTL
+	    else if (d < 0x20 || d == 0x7f) {
+		if (LD_L(ld, ECHOCTL)) col += 2;
+	    }
+#endif
+#ifdef IUTF8
+	    else if (LD_I(ld, IUTF8) && (d & 0xc0) == 0x80) {
+	    }
+#endif
+	    else {
+		col++;
+	    }
+	}
+	while (ld->column > col) {
+	    ld_echo_raw(ld, echo, (const unsigned char *)"\b", 1);
+	}
+	return;
+    }
+#ifdef ECHOCTL
+    if (LD_L(ld, ECHOCTL) && (c < 0x20 || c == 0x7f)) {
+	width = 2;
+    }
+#endif
+    while (width-- > 0) {
+	ld_echo_raw(ld, echo, (const unsigned char *)"\b \b", 3);
+    }
+}
+
+static int
+ld_is_space(c)
+    unsigned char c;
+{
+    return c == ' ' || c == '\t';
+}
+
+/*
+ * Processes one input character in canonical mode.  Returns true if the
+ * line is complete.
+ */
+static int
+ld_canon(ld, echo, c, eof)
+    struct line_discipline *ld;
+    VALUE echo;
+    unsigned char c;
+    int *eof;
+{
+    int echoe = LD_L(ld, ECHOE) != 0;
+
+    if (LD_CC(ld, VERASE, c)) {
+	if (!echoe && LD_L(ld, ECHO) && ld->len > 0) ld_echo_char(ld, echo, c);
+	ld_erase_char(ld, echo, echoe);
+	return 0;
+    }
+    if (LD_CC(ld, VKILL, c)) {
+#ifdef ECHOKE
+	if (LD_L(ld, ECHOKE) && echoe) {
+	    while (ld->len > 0) ld_erase_char(ld, echo, 1);
+	    return 0;
+	}
+#endif
+	ld->len = 0;
+	if (LD_L(ld, ECHO)) {
+	    ld_echo_char(ld, echo, c);
+	    if (LD_L(ld, ECHOK)) {
+		ld_echo_raw(ld, echo, (const unsigned char *)"\n", 1);
+	    }
+	}
+	return 0;
+    }
+#ifdef VWERASE
+    if (LD_L(ld, IEXTEN) && LD_CC(ld, VWERASE, c)) {
+	while (ld->len > 0 && ld_is_space(ld->line[ld->len - 1])) {
+	    ld_erase_char(ld, echo, echoe);
+	}
+	while (ld->len > 0 && !ld_is_space(ld->line[ld->len - 1])) {
+	    ld_erase_char(ld, echo, echoe);
+	}
+	return 0;
+    }
+#endif
+#ifdef VREPRINT
+    if (LD_L(ld, IEXTEN) && LD_CC(ld, VREPRINT, c)) {
+	if (LD_L(ld, ECHO)) {
+	    ld_echo_char(ld, echo, c);
+	    ld_echo_raw(ld, echo, (const unsigned char *)"\n", 1);
+	    ld_echo_raw(ld, echo, ld->line, ld->len);
+	}
+	return 0;
+    }
+#endif
+    if (LD_CC(ld, VEOF, c)) {
+	*eof = ld->len == 0;
+	return 1;
+    }
+    if (c == '\n' || LD_CC(ld, VEOL, c)
+#ifdef VEOL2
+	|| (LD_L(ld, IEXTEN) && LD_CC(ld, VEOL2, c))
+#endif
+	) {
+	ld->line[ld->len++] = c;
+	if (LD_L(ld, ECHO) || (c == '\n' && LD_L(ld, ECHONL))) {
+	    ld_echo_char(ld, echo, c);
+	}
+	return 1;
+    }
+
+    if (ld->len == 0) {
+	ld->canon_column = ld->column;
+    }
+    if (ld->len >= LINE_DISCIPLINE_MAX) {
+#ifdef IMAXBEL
+	if (LD_I(ld, IMAXBEL) && LD_L(ld, ECHO)) {
+	    ld_echo_raw(ld, echo, (const unsigned char *)"\a", 1);
+	}
+#endif
+	return 0;
+    }
+    ld->line[ld->len++] = c;
+    if (LD_L(ld, ECHO)) {
+	ld_echo_char(ld, echo, c);
+    }
+    return 0;
+}
+
+static VALUE
+ld_line_str(ld, len)
+    struct line_discipline *ld;
+    long len;
+{
+    VALUE str = rb_str_new((const char *)ld->line, len);
+
+#ifdef IUTF8
+    if (LD_I(ld, IUTF8)) {
+	rb_enc_associate(str, rb_utf8_encoding());
+    }
+#endif
+    return str;
+}
+
+/*
+ * call-seq:
+ *   Termios::LineDiscipline.new(termios)
+ *
+ * Returns a new line discipline which behaves as termios, a
+ * Termios::Termios object.
+ */
+static VALUE
+line_discipline_initialize(self, termios)
+    VALUE self, termios;
+{
+    struct line_discipline *ld = get_line_discipline(self);
+
+    termios_check_Termios(termios);
+    Termios_to_termios(termios, &ld->t);
+    ld->len = 0;
+    ld->column = 0;
+    ld->canon_column = 0;
+    ld->lnext = 0;
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   ld.termios = termios
+ *
+ * Changes the modes to termios.  The line being edited is kept.
+ */
+static VALUE
+line_discipline_set_termios(self, termios)
+    VALUE self, termios;
+{
+    struct line_discipline *ld = get_line_discipline(self);
+
+    termios_check_Termios(termios);
+    Termios_to_termios(termios, &ld->t);
+
+    return termios;
+}
+
+/*
+ * call-seq:
+ *   ld.termios
+ *
+ * Returns a new Termios::Termios object of the current modes.
+ */
+static VALUE
+line_discipline_termios(self)
+    VALUE self;
+{
+    return termios_to_Termios(&get_line_discipline(self)->t);
+}
+
+/*
+ * call-seq:
+ *   ld.feed(str)
+ *
+ * Processes input str and returns [lines, echo, events]: an Array of
+ * completed lines, the String to be echoed back and an Array of Symbols
+ * of the signal and flow control characters.
+ */
+static VALUE
+line_discipline_feed(self, str)
+    VALUE self, str;
+{
+    struct line_discipline *ld = get_line_discipline(self);
+    VALUE lines = rb_ary_new(), echo = rb_str_buf_new(0), events = rb_ary_new();
+    const unsigned char *p;
+    long i, len;
+
+    StringValue(str);
+    str = rb_str_new_frozen(str);
+    p = (const unsigned char *)RSTRING_PTR(str);
+    len = RSTRING_LEN(str);
+
+    for (i = 0; i < len; i++) {
+	unsigned char c = p[i];
+	int eof = 0;
+
+	if (LD_I(ld, ISTRIP)) {
+	    c &= 0x7f;
+	}
+	if (ld->lnext) {
+	    ld->lnext = 0;
+	    goto literal;
+	}
+	if (LD_L(ld, ISIG)) {
+	    VALUE sig = Qnil;
+
+	    if (LD_CC(ld, VINTR, c)) sig = sym_INT;
+	    else if (LD_CC(ld, VQUIT, c)) sig = sym_QUIT;
+#ifdef VSUSP
+	    else if (LD_CC(ld, VSUSP, c)) sig = sym_TSTP;
+#endif
+	    if (!NIL_P(sig)) {
+		rb_ary_push(events, sig);
+		if (!LD_L(ld, NOFLSH)) {
+		    ld->len = 0;
+		}
+		if (LD_L(ld, ECHO)) {
+		    ld_echo_char(ld, echo, c);
+		}
+		continue;
+	    }
+	}
+	if (LD_I(ld, IXON)) {
+	    if (LD_CC(ld, VSTOP, c)) {
+		rb_ary_push(events, sym_XOFF);
+		continue;
+	    }
+	    if (LD_CC(ld, VSTART, c)) {
+		rb_ary_push(events, sym_XON);
+		continue;
+	    }
+	}
+#ifdef VLNEXT
+	if (LD_L(ld, IEXTEN) && LD_L(ld, ICANON) && LD_CC(ld, VLNEXT, c)) {
+	    ld->lnext = 1;
+#ifdef ECHOCTL
+	    if (LD_L(ld, ECHO) && LD_L(ld, ECHOCTL)) {
+		ld_echo_raw(ld, echo, (const unsigned char *)"^\b", 2);
+	    }
+#endif
+	    continue;
+	}
+#endif
+	if (c == '\r') {
+	    if (LD_I(ld, IGNCR)) continue;
+	    if (LD_I(ld, ICRNL)) c = '\n';
+	}
+	else if (c == '\n' && LD_I(ld, INLCR)) {
+	    c = '\r';
+	}
+#ifdef IUCLC
+	if (LD_I(ld, IUCLC) && LD_L(ld, IEXTEN) && c >= 'A' && c <= 'Z') {
+	    c += 'a' - 'A';
+	}
+#endif
+	if (LD_L(ld, ICANON)) {
+	    if (ld_canon(ld, echo, c, &eof)) {
+		rb_ary_push(lines, ld_line_str(ld, eof ? 0 : ld->len));
+		ld->len = 0;
+	    }
+	    continue;
+	}
+
+      literal:
+	if (ld->len >= LINE_DISCIPLINE_MAX) {
+	    if (LD_L(ld, ICANON)) continue;
+	    rb_ary_push(lines, ld_line_str(ld, ld->len));
+	    ld->len = 0;
+	}
+	ld->line[ld->len++] = c;
+	if (LD_L(ld, ECHO)) {
+	    ld_echo_char(ld, echo, c);
+	}
+    }
+    if (!LD_L(ld, ICANON) && ld->len > 0) {
+	rb_ary_push(lines, ld_line_str(ld, ld->len));
+	ld->len = 0;
+    }
+    RB_GC_GUARD(str);
+
+    return rb_ary_new3(3, lines, echo, events);
+}
+
+/*
+ * call-seq:
+ *   ld.pending
+ *
+ * Returns the line being edited.
+ */
+static VALUE
+line_discipline_pending(self)
+    VALUE self;
+{
+    struct line_discipline *ld = get_line_discipline(self);
+
+    return ld_line_str(ld, ld->len);
+}
+
+/*
+ * call-seq:
+ *   ld.flush
+ *
+ * Discards the line being edited.
+ */
+static VALUE
+line_discipline_flush(self)
+    VALUE self;
+{
+    struct line_discipline *ld = get_line_discipline(self);
+
+    ld->len = 0;
+    ld->lnext = 0;
+
+    return self;
+}
+
+/*
+ * Document-class: Termios::Screen
+ *
+ * A grid of character cells of the size of a terminal window.  Programs
+ * draw into the grid, and Termios::Screen#flush writes only the cells
+ * which changed since the previous frame, with a minimal number of cursor
+ * movements and SGR sequences.
+ *
+ * When the screen is paced, #flush does nothing while the previous frame
+ * is still being transmitted, as estimated from ospeed and the character
+ * format of the terminal and the length of its output queue; the changes
+ * are coalesced into the next frame instead of queued.
+ *
+ *   require 'termios'
+ *
+ *   screen = Termios::Screen.new($stdout)
+ *   loop {
+ *     screen.put(0, 0, Time.now.to_s, 3, -1, Termios::Screen::BOLD)
+ *     screen.flush
+ *     sleep 0.1
+ *   }
+ *
+ * Characters are assumed to be one column wide.
+ */
+
+#define SCREEN_BOLD		1
+#define SCREEN_UNDERLINE	2
+#define SCREEN_REVERSE		4
+#define SCREEN_BLINK		8
+#define SCREEN_DIM		16
+#define SCREEN_ITALIC		32
+
+#define SCREEN_MAX_GAP		4	/* unchanged cells rewritten instead of
+					   moving the cursor over them */
+
+struct screen_cell {
+    uint32_t ch;
+    int16_t fg, bg;
+    uint16_t attr;
+};
+
+struct screen {
+    VALUE io;
+    int rows, cols;
+    struct screen_cell *back;	/* the frame being drawn */
+    struct screen_cell *front;	/* the frame on the terminal */
+    int valid;			/* front is what the terminal shows */
+    int pace;
+    double char_time;
+    double busy_until;
+};
+
+static VALUE cScreen;
+
+static void
+screen_mark(ptr)
+    void *ptr;
+{
+    rb_gc_mark(((struct screen *)ptr)->io);
+}
+
+static void
+screen_free(ptr)
+    void *ptr;
+{
+    struct screen *scr = ptr;
+
+    xfree(scr->back);
+    xfree(scr->front);
+    xfree(scr);
+}
+
+static const rb_data_type_t screen_type = {
+    "Termios::Screen",
+    {screen_mark, screen_free, 0,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+screen_alloc(klass)
+    VALUE klass;
+{
+    struct screen *scr;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct(klass, struct screen, &screen_type, scr);
+    scr->io = Qnil;
+
+    return obj;
+}
+
+static struct screen *
+get_screen(self)
+    VALUE self;
+{
+    struct screen *scr;
+
+    TypedData_Get_Struct(self, struct screen, &screen_type, scr);
+    if (NIL_P(scr->io)) {
+	rb_raise(rb_eArgError, "uninitialized Termios::Screen");
+    }
+    return scr;
+}
+
+static void
+screen_blank(cells, n)
+    struct screen_cell *cells;
+    long n;
+{
+    long i;
+
+    for (i = 0; i < n; i++) {
+	cells[i].ch = ' ';
+	cells[i].fg = cells[i].bg = -1;
+	cells[i].attr = 0;
+    }
+}
+
+/*
+ * call-seq:
+ *   screen.resize
+ *
+ * Reads the window size of the terminal again and reallocates the grid.
+ * The contents are kept where they fit, and the next flush redraws the
+ * whole screen.
+ */
+static VALUE
+screen_resize(self)
+    VALUE self;
+{
+    struct screen *scr = get_screen(self);
+    struct screen_cell *back, *front;
+    struct winsize ws;
+    int r, rows, cols;
+
+    if (ioctl(termios_io_fileno(scr->io), TIOCGWINSZ, &ws) < 0) {
+	rb_sys_fail("TIOCGWINSZ");
+    }
+    rows = ws.ws_row > 0 ? ws.ws_row : 24;
+    cols = ws.ws_col > 0 ? ws.ws_col : 80;
+
+    back = ALLOC_N(struct screen_cell, (long)rows * cols);
+    front = ALLOC_N(struct screen_cell, (long)rows * cols);
+    screen_blank(back, (long)rows * cols);
+    screen_blank(front, (long)rows * cols);
+    if (scr->back) {
+	int n = scr->cols < cols ? scr->cols : cols;
+
+	for (r = 0; r < rows && r < scr->rows; r++) {
+	    memcpy(back + (long)r * cols, scr->back + (long)r * scr->cols,
+		   sizeof(*back) * n);
+	}
+	xfree(scr->back);
+	xfree(scr->front);
+    }
+    scr->back = back;
+    scr->front = front;
+    scr->rows = rows;
+    scr->cols = cols;
+    scr->valid = 0;
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   Termios::Screen.new(io, pace = true)
+ *
+ * Returns a new screen of the window size of io.  If pace is true,
+ * Termios::Screen#flush skips frames while the terminal is busy
+ * transmitting the previous one.
+ */
+static VALUE
+screen_initialize(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct screen *scr;
+    struct termios t;
+    VALUE io, pace;
+
+    rb_scan_args(argc, argv, "11", &io, &pace);
+    TypedData_Get_Struct(self, struct screen, &screen_type, scr);
+    scr->io = io;
+    scr->pace = NIL_P(pace) || RTEST(pace);
+    scr->busy_until = 0.0;
+    if (tcgetattr(termios_io_fileno(io), &t) < 0) {
+	rb_sys_fail("tcgetattr");
+    }
+    scr->char_time = termios_char_time(cfgetospeed(&t), t.c_cflag);
+    screen_resize(self);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   screen.put(row, col, str, fg = -1, bg = -1, attr = 0)
+ *
+ * Draws str at row and col, clipped at the right edge.  The fg and bg are
+ * colors of the 256 color palette, or -1 for the default color.  The attr
+ * is a combination of Termios::Screen::BOLD, UNDERLINE, REVERSE, BLINK,
+ * DIM and ITALIC.  Returns the column after str.
+ *
+ * The terminal is written in UTF-8, so str is converted to it first;
+ * characters which do not convert, bytes of a binary string beyond
+ * ASCII and control characters are drawn as '?'.
+ */
+static VALUE
+screen_put(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct screen *scr = get_screen(self);
+    VALUE row, col, str, fg, bg, attr;
+    struct screen_cell cell;
+    rb_encoding *enc, *utf8;
+    const char *p, *e;
+    int r, c;
+
+    rb_scan_args(argc, argv, "33", &row, &col, &str, &fg, &bg, &attr);
+    r = NUM2INT(row);
+    c = NUM2INT(col);
+    StringValue(str);
+    cell.fg = NIL_P(fg) ? -1 : (int16_t)NUM2INT(fg);
+    cell.bg = NIL_P(bg) ? -1 : (int16_t)NUM2INT(bg);
+    cell.attr = NIL_P(attr) ? 0 : (uint16_t)NUM2UINT(attr);
+    if (r < 0 || r >= scr->rows) {
+	return INT2FIX(c);
+    }
+
+    utf8 = rb_utf8_encoding();
+    enc = rb_enc_get(str);
+    if (enc != utf8 && enc != rb_ascii8bit_encoding()) {
+	str = rb_str_conv_enc_opts(str, enc, utf8,
+				   ECONV_INVALID_REPLACE | ECONV_UNDEF_REPLACE,
+				   Qnil);
+	enc = rb_enc_get(str);
+    }
+    p = RSTRING_PTR(str);
+    e = p + RSTRING_LEN(str);
+    while (p < e) {
+	int len;
+	unsigned int ch;
+
+	if ((unsigned char)*p < 0x80) {
+	    ch = (unsigned char)*p;
+	    len = 1;
+	}
+	else if (enc == utf8) {
+	    int n = rb_enc_precise_mbclen(p, e, utf8);
+
+	    if (MBCLEN_CHARFOUND_P(n)) {
+		len = MBCLEN_CHARFOUND_LEN(n);
+		ch = rb_enc_mbc_to_codepoint(p, e, utf8);
+	    }
+	    else {
+		len = 1;
+		ch = '?';
+	    }
+	}
+	else {
+	    /* binary, or a string which did not convert */
+	    len = 1;
+	    ch = '?';
+	}
+	p += len;
+	if (ch < 0x20 || (ch >= 0x7f && ch < 0xa0)) {
+	    ch = '?';
+	}
+	if (c >= 0 && c < scr->cols) {
+	    cell.ch = ch;
+	    scr->back[(long)r * scr->cols + c] = cell;
+	}
+	c++;
+    }
+
+    return INT2FIX(c);
+}
+
+/*
+ * call-seq:
+ *   screen.clear
+ *
+ * Clears the grid.
+ */
+static VALUE
+screen_clear(self)
+    VALUE self;
+{
+    struct screen *scr = get_screen(self);
+
+    screen_blank(scr->back, (long)scr->rows * scr->cols);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   screen.invalidate
+ *
+ * Makes the next flush redraw the whole screen.
+ */
+static VALUE
+screen_invalidate(self)
+    VALUE self;
+{
+    get_screen(self)->valid = 0;
+
+    return self;
+}
+
+static void
+screen_sgr(out, cell)
+    VALUE out;
+    const struct screen_cell *cell;
+{
+    char buf[64];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "\033[0");
+    if (cell->attr & SCREEN_BOLD)      n += snprintf(buf + n, sizeof(buf) - n, ";1");
+    if (cell->attr & SCREEN_DIM)       n += snprintf(buf + n, sizeof(buf) - n, ";2");
+    if (cell->attr & SCREEN_ITALIC)    n += snprintf(buf + n, sizeof(buf) - n, ";3");
+    if (cell->attr & SCREEN_UNDERLINE) n += snprintf(buf + n, sizeof(buf) - n, ";4");
+    if (cell->attr & SCREEN_BLINK)     n += snprintf(buf + n, sizeof(buf) - n, ";5");
+    if (cell->attr & SCREEN_REVERSE)   n += snprintf(buf + n, sizeof(buf) - n, ";7");
+    if (cell->fg >= 0 && cell->fg < 8) {
+	n += snprintf(buf + n, sizeof(buf) - n, ";%d", 30 + cell->fg);
+    }
+    else if (cell->fg >= 0) {
+	n += snprintf(buf + n, sizeof(buf) - n, ";38;5;%d", cell->fg);
+    }
+    if (cell->bg >= 0 && cell->bg < 8) {
+	n += snprintf(buf + n, sizeof(buf) - n, ";%d", 40 + cell->bg);
+    }
+    else if (cell->bg >= 0) {
+	n += snprintf(buf + n, sizeof(buf) - n, ";48;5;%d", cell->bg);
+    }
+    n += snprintf(buf + n, sizeof(buf) - n, "m");
+    rb_str_buf_cat(out, buf, n);
+}
+
+static int
+screen_cell_eq(a, b)
+    const struct screen_cell *a, *b;
+{
+    return a->ch == b->ch && a->fg == b->fg && a->bg == b->bg &&
+	a->attr == b->attr;
+}
+
+static int
+screen_style_eq(a, b)
+    const struct screen_cell *a, *b;
+{
+    return a->fg == b->fg && a->bg == b->bg && a->attr == b->attr;
+}
+
+/*
+ * Writes code point ch, which put made a valid one, as UTF-8 into buf and
+ * returns its length.
+ */
+static int
+screen_utf8(ch, buf)
+    unsigned int ch;
+    char *buf;
+{
+    if (ch < 0x80) {
+	buf[0] = (char)ch;
+	return 1;
+    }
+    if (ch < 0x800) {
+	buf[0] = (char)(0xc0 | (ch >> 6));
+	buf[1] = (char)(0x80 | (ch & 0x3f));
+	return 2;
+    }
+    if (ch < 0x10000) {
+	if (ch >= 0xd800 && ch < 0xe000) {
+	    buf[0] = '?';
+	    return 1;
+	}
+	buf[0] = (char)(0xe0 | (ch >> 12));
+	buf[1] = (char)(0x80 | ((ch >> 6) & 0x3f));
+	buf[2] = (char)(0x80 | (ch & 0x3f));
+	return 3;
+    }
+    if (ch < 0x110000) {
+	buf[0] = (char)(0xf0 | (ch >> 18));
+	buf[1] = (char)(0x80 | ((ch >> 12) & 0x3f));
+	buf[2] = (char)(0x80 | ((ch >> 6) & 0x3f));
+	buf[3] = (char)(0x80 | (ch & 0x3f));
+	return 4;
+    }
+    buf[0] = '?';
+    return 1;
+}
+
+/*
+ * Builds the output which turns front into back.  front, a blank screen
+ * if it is not valid, is updated only once the output is complete.
+ */
+static VALUE
+screen_diff(scr)
+    struct screen *scr;
+{
+    VALUE out = rb_str_buf_new(0);
+    struct screen_cell style, blank[1];
+    int r, cur_r = -1, cur_c = -1;
+
+    /* every frame leaves the terminal with the default rendition */
+    style.fg = style.bg = -1;
+    style.attr = 0;
+    screen_blank(blank, 1);
+    if (!scr->valid) {
+	rb_str_buf_cat2(out, "\033[0m\033[H\033[2J");
+	cur_r = cur_c = 0;
+    }
+
+#define SCREEN_FRONT(c) (scr->valid ? &f[c] : blank)
+    for (r = 0; r < scr->rows; r++) {
+	struct screen_cell *b = scr->back + (long)r * scr->cols;
+	struct screen_cell *f = scr->front + (long)r * scr->cols;
+	int c = 0;
+
+	while (c < scr->cols) {
+	    int end, gap;
+
+	    if (screen_cell_eq(&b[c], SCREEN_FRONT(c))) {
+		c++;
+		continue;
+	    }
+	    /* a run of changes, absorbing short unchanged gaps */
+	    end = c + 1;
+	    gap = 0;
+	    while (end + gap < scr->cols && gap <= SCREEN_MAX_GAP) {
+		if (screen_cell_eq(&b[end + gap], SCREEN_FRONT(end + gap))) {
+		    gap++;
+		}
+		else {
+		    end += gap + 1;
+		    gap = 0;
+		}
+	    }
+
+	    if (cur_r != r || cur_c != c) {
+		char buf[32];
+		int n;
+
+		if (cur_r == r && c > cur_c && c - cur_c <= SCREEN_MAX_GAP) {
+		    /* rewriting cells is shorter than moving over them */
+		    c = cur_c;
+		}
+		else {
+		    n = snprintf(buf, sizeof(buf), "\033[%d;%dH", r + 1, c + 1);
+		    rb_str_buf_cat(out, buf, n);
+		}
+	    }
+	    for (; c < end; c++) {
+		char buf[8];
+		int n;
+
+		if (!screen_style_eq(&b[c], &style)) {
+		    screen_sgr(out, &b[c]);
+		    style = b[c];
+		}
+		n = screen_utf8(b[c].ch, buf);
+		rb_str_buf_cat(out, buf, n);
+	    }
+	    cur_r = r;
+	    cur_c = c;
+	    if (cur_c >= scr->cols) {
+		cur_r = cur_c = -1;	/* pending wrap */
+	    }
+	}
+    }
+#undef SCREEN_FRONT
+    if (style.attr || style.fg >= 0 || style.bg >= 0) {
+	rb_str_buf_cat2(out, "\033[0m");
+    }
+    MEMCPY(scr->front, scr->back, struct screen_cell, (long)scr->rows * scr->cols);
+    scr->valid = 1;
+
+    return out;
+}
+
+/*
+ * call-seq:
+ *   screen.flush(force = false)
+ *
+ * Writes the changes since the previous frame to the terminal and returns
+ * the number of bytes written.  If the screen is paced and the terminal is
+ * still transmitting the previous frame, it returns nil without writing
+ * unless force is true.
+ */
+static VALUE
+screen_flush(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct screen *scr = get_screen(self);
+    VALUE force, out;
+    double now = termios_monotonic();
+
+    rb_scan_args(argc, argv, "01", &force);
+    if (scr->pace && !RTEST(force)) {
+#ifdef TIOCOUTQ
+	int queued;
+
+	if (ioctl(termios_io_fileno(scr->io), TIOCOUTQ, &queued) == 0 &&
+	    queued > 0) {
+	    return Qnil;
+	}
+#endif
+	if (now < scr->busy_until) {
+	    return Qnil;
+	}
+    }
+
+    out = screen_diff(scr);
+    if (RSTRING_LEN(out) > 0) {
+	rb_io_write(scr->io, out);
+	scr->busy_until = now + RSTRING_LEN(out) * scr->char_time;
+    }
+
+    return LONG2NUM(RSTRING_LEN(out));
+}
+
+/*
+ * call-seq:
+ *   screen.rows
+ *
+ * Returns the number of rows.
+ */
+static VALUE
+screen_rows(self)
+    VALUE self;
+{
+    return INT2FIX(get_screen(self)->rows);
+}
+
+/*
+ * call-seq:
+ *   screen.cols
+ *
+ * Returns the number of columns.
+ */
+static VALUE
+screen_cols(self)
+    VALUE self;
+{
+    return INT2FIX(get_screen(self)->cols);
+}
+
+/*
+ * Document-class: Termios::Device
+ *
+ * A serial port opened by path which owns its file descriptor.  The port
+ * is opened with O_NOCTTY and O_NONBLOCK, so that neither a missing
+ * carrier nor becoming the controlling terminal gets in the way, then
+ * switched back to blocking mode and locked with TIOCEXCL.
+ *
+ * The termios parameter and the modem lines are cached in the object;
+ * Termios::Device#getattr and Termios::Device#modem_lines do not make a
+ * system call, and Termios::Device#refresh reads them again.  Reads,
+ * writes and drains are done without the GVL.
+ *
+ *   require 'termios'
+ *
+ *   Termios::Device.open('/dev/ttyUSB0', profile) {|dev|
+ *     dev.write("AT\r")
+ *     dev.read(64)
+ *   }
+ *
+ * A device must not be closed while another thread is using it.
+ */
+
+struct device {
+    int fd;
+    int modem;			/* -1: no modem lines */
+    struct termios t;
+    VALUE path;
+};
+
+static VALUE cDevice;
+
+static void
+device_mark(ptr)
+    void *ptr;
+{
+    rb_gc_mark(((struct device *)ptr)->path);
+}
+
+static void
+device_free(ptr)
+    void *ptr;
+{
+    struct device *dev = ptr;
+
+    if (dev->fd >= 0) {
+	close(dev->fd);
+    }
+    xfree(dev);
+}
+
+static const rb_data_type_t device_type = {
+    "Termios::Device",
+    {device_mark, device_free, 0,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+device_alloc(klass)
+    VALUE klass;
+{
+    struct device *dev;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct(klass, struct device, &device_type, dev);
+    dev->fd = -1;
+    dev->modem = -1;
+    dev->path = Qnil;
+
+    return obj;
+}
+
+static struct device *
+get_device(self)
+    VALUE self;
+{
+    struct device *dev;
+
+    TypedData_Get_Struct(self, struct device, &device_type, dev);
+    if (dev->fd < 0) {
+	rb_raise(rb_eIOError, "closed device");
+    }
+    return dev;
+}
+
+static void
+device_read_modem(dev)
+    struct device *dev;
+{
+#ifdef TIOCMGET
+    if (ioctl(dev->fd, TIOCMGET, &dev->modem) < 0) {
+	dev->modem = -1;
+    }
+#endif
+}
+
+/*
+ * call-seq:
+ *   Termios::Device.new(path, profile = nil)
+ *
+ * Opens the port at path and locks it with TIOCEXCL.  If profile, a
+ * Termios::Termios object, is given, it is set to the port.
+ */
+static VALUE
+device_initialize(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct device *dev;
+    VALUE path, profile;
+    int fd, flags, e;
+
+    rb_scan_args(argc, argv, "11", &path, &profile);
+    FilePathValue(path);
+    if (!NIL_P(profile)) {
+	termios_check_Termios(profile);
+    }
+    TypedData_Get_Struct(self, struct device, &device_type, dev);
+    if (dev->fd >= 0) {
+	rb_raise(rb_eArgError, "already initialized device");
+    }
+
+    fd = rb_cloexec_open(StringValueCStr(path),
+			 O_RDWR | O_NOCTTY | O_NONBLOCK, 0);
+    if (fd < 0) {
+	rb_sys_fail_str(path);
+    }
+    rb_update_max_fd(fd);
+    if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+	fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0 ||
+	tcgetattr(fd, &dev->t) < 0
+#ifdef TIOCEXCL
+	|| ioctl(fd, TIOCEXCL) < 0
+#endif
+	) {
+	e = errno;
+	close(fd);
+	rb_syserr_fail_str(e, path);
+    }
+    dev->fd = fd;
+    dev->path = rb_str_new_frozen(path);
+    device_read_modem(dev);
+
+    if (!NIL_P(profile)) {
+	struct termios t = dev->t;
+
+	Termios_to_termios(profile, &t);
+	if (tcsetattr(fd, TCSANOW, &t) < 0) {
+	    rb_sys_fail("tcsetattr");
+	}
+	dev->t = t;
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   device.close
+ *
+ * Releases the TIOCEXCL lock and closes the port.
+ */
+static VALUE
+device_close(self)
+    VALUE self;
+{
+    struct device *dev = get_device(self);
+    int fd = dev->fd;
+
+    dev->fd = -1;
+#ifdef TIOCNXCL
+    ioctl(fd, TIOCNXCL);
+#endif
+    if (close(fd) < 0) {
+	rb_sys_fail("close");
+    }
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   device.closed?
+ *
+ * Returns true if the device is closed.
+ */
+static VALUE
+device_closed_p(self)
+    VALUE self;
+{
+    struct device *dev;
+
+    TypedData_Get_Struct(self, struct device, &device_type, dev);
+    return dev->fd < 0 ? Qtrue : Qfalse;
+}
+
+static VALUE
+device_close_if_open(self)
+    VALUE self;
+{
+    if (!RTEST(device_closed_p(self))) {
+	device_close(self);
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   Termios::Device.open(path, profile = nil)
+ *   Termios::Device.open(path, profile = nil) {|device| ... }
+ *
+ * Same as Termios::Device.new, but with a block, the device is passed to
+ * the block and closed when it returns.  Returns the value of the block.
+ */
+static VALUE
+device_s_open(argc, argv, klass)
+    int argc;
+    VALUE *argv;
+    VALUE klass;
+{
+    VALUE dev = rb_class_new_instance(argc, argv, klass);
+
+    if (rb_block_given_p()) {
+	return rb_ensure(rb_yield, dev, device_close_if_open, dev);
+    }
+    return dev;
+}
+
+/*
+ * call-seq:
+ *   device.fileno
+ *
+ * Returns the file descriptor of the port.
+ */
+static VALUE
+device_fileno(self)
+    VALUE self;
+{
+    return INT2FIX(get_device(self)->fd);
+}
+
+/*
+ * call-seq:
+ *   device.path
+ *
+ * Returns the path the port was opened with.
+ */
+static VALUE
+device_path(self)
+    VALUE self;
+{
+    struct device *dev;
+
+    TypedData_Get_Struct(self, struct device, &device_type, dev);
+    return dev->path;
+}
+
+/*
+ * call-seq:
+ *   device.getattr
+ *
+ * Returns the cached termios parameter as a new Termios::Termios object.
+ */
+static VALUE
+device_getattr(self)
+    VALUE self;
+{
+    return termios_to_Termios(&get_device(self)->t);
+}
+
+/*
+ * call-seq:
+ *   device.setattr(option, termios)
+ *
+ * Sets termios to the port with option (Termios::TCSANOW and so on) and
+ * caches it, even if it is the cached one, so that Termios::TCSAFLUSH
+ * flushes and changes made behind the back of the device are undone.
+ * Returns the device.
+ */
+static VALUE
+device_setattr(self, opt, param)
+    VALUE self, opt, param;
+{
+    struct device *dev = get_device(self);
+    struct termios t;
+
+    Check_Type(opt, T_FIXNUM);
+    if (rb_ary_includes(tcsetattr_opt, opt) != Qtrue) {
+	rb_raise(rb_eArgError, "wrong option value %d", FIX2INT(opt));
+    }
+    termios_check_Termios(param);
+    t = dev->t;
+    Termios_to_termios(param, &t);
+    /* always: the cache may be stale, and TCSAFLUSH flushes anyway */
+    if (tcsetattr(dev->fd, FIX2INT(opt), &t) < 0) {
+	rb_sys_fail("tcsetattr");
+    }
+    dev->t = t;
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   device.modem_lines
+ *
+ * Returns the cached modem lines, a combination of Termios::TIOCM_* bits,
+ * or nil if the port has none.
+ */
+static VALUE
+device_modem_lines(self)
+    VALUE self;
+{
+    struct device *dev = get_device(self);
+
+    return dev->modem < 0 ? Qnil : INT2NUM(dev->modem);
+}
+
+/*
+ * call-seq:
+ *   device.refresh
+ *
+ * Reads the termios parameter and the modem lines of the port into the
+ * cache.  Returns the device.
+ */
+static VALUE
+device_refresh(self)
+    VALUE self;
+{
+    struct device *dev = get_device(self);
+
+    if (tcgetattr(dev->fd, &dev->t) < 0) {
+	rb_sys_fail("tcgetattr");
+    }
+    device_read_modem(dev);
+
+    return self;
+}
+
+struct device_io_arg {
+    int fd;
+    char *ptr;
+    long len;
+    long done;
+    int err;
+    int eof;
+};
+
+static void *
+device_read_body(ptr)
+    void *ptr;
+{
+    struct device_io_arg *arg = ptr;
+    ssize_t n = read(arg->fd, arg->ptr, arg->len);
+
+    if (n < 0) {
+	arg->err = errno;
+    }
+    else {
+	arg->done = n;
+    }
+    if (n == 0 && arg->len > 0) {
+	struct pollfd pfd;
+	struct termios t;
+
+	/*
+	 * read(2) also returns 0 when VMIN is 0 and VTIME expires; only a
+	 * hangup or the EOF character of canonical mode is end of file
+	 */
+	pfd.fd = arg->fd;
+	pfd.events = POLLIN;
+	arg->eof = (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLHUP)) ||
+		   (tcgetattr(arg->fd, &t) == 0 && (t.c_lflag & ICANON));
+    }
+    return NULL;
+}
+
+static void *
+device_write_body(ptr)
+    void *ptr;
+{
+    struct device_io_arg *arg = ptr;
+
+    arg->done += termios_write_full(arg->fd, arg->ptr + arg->done,
+				    arg->len - arg->done);
+    if (arg->done < arg->len) {
+	arg->err = errno;
+    }
+    return NULL;
+}
+
+static void *
+device_drain_body(ptr)
+    void *ptr;
+{
+    struct device_io_arg *arg = ptr;
+
+    if (tcdrain(arg->fd) < 0) {
+	arg->err = errno;
+    }
+    return NULL;
+}
+
+static void
+device_run(self, func, arg, mesg)
+    VALUE self;
+    void *(*func)(void *);
+    struct device_io_arg *arg;
+    const char *mesg;
+{
+    for (;;) {
+	arg->fd = get_device(self)->fd;
+	arg->err = 0;
+	termios_without_gvl(func, arg, RUBY_UBF_IO, 0);
+	if (arg->err == 0) {
+	    break;
+	}
+	if (arg->err != EINTR) {
+	    errno = arg->err;
+	    rb_sys_fail(mesg);
+	}
+	rb_thread_check_ints();
+    }
+}
+
+/*
+ * call-seq:
+ *   device.read(maxlen = 4096)
+ *
+ * Reads at most maxlen bytes with one read(2) according to the VMIN and
+ * VTIME of the port.  Returns an empty string when VMIN is 0 and no byte
+ * arrived in time, and nil at end of file: after a hangup, or on the EOF
+ * character in canonical mode.
+ */
+static VALUE
+device_read(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct device_io_arg arg;
+    VALUE maxlen, str;
+
+    rb_scan_args(argc, argv, "01", &maxlen);
+    memset(&arg, 0, sizeof(arg));
+    arg.len = NIL_P(maxlen) ? 4096 : NUM2LONG(maxlen);
+    if (arg.len < 0) {
+	rb_raise(rb_eArgError, "negative length %ld given", arg.len);
+    }
+    str = rb_str_new(0, arg.len);
+    arg.ptr = RSTRING_PTR(str);
+    device_run(self, device_read_body, &arg, "read");
+    if (arg.eof) {
+	return Qnil;
+    }
+    rb_str_set_len(str, arg.done);
+
+    return str;
+}
+
+/*
+ * call-seq:
+ *   device.write(str)
+ *
+ * Writes all of str and returns its length.
+ */
+static VALUE
+device_write(self, str)
+    VALUE self, str;
+{
+    struct device_io_arg arg;
+
+    str = rb_str_new_frozen(rb_obj_as_string(str));
+    memset(&arg, 0, sizeof(arg));
+    arg.ptr = RSTRING_PTR(str);
+    arg.len = RSTRING_LEN(str);
+    device_run(self, device_write_body, &arg, "write");
+    RB_GC_GUARD(str);
+
+    return LONG2NUM(arg.done);
+}
+
+/*
+ * call-seq:
+ *   device.drain
+ *
+ * Waits until all output written to the port is transmitted.
+ */
+static VALUE
+device_drain(self)
+    VALUE self;
+{
+    struct device_io_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+    device_run(self, device_drain_body, &arg, "tcdrain");
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   device.flush(queue_selector = Termios::TCIOFLUSH)
+ *
+ * Discards data in the queues of the port.
+ */
+static VALUE
+device_flush(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct device *dev = get_device(self);
+    VALUE qs;
+
+    rb_scan_args(argc, argv, "01", &qs);
+    if (NIL_P(qs)) {
+	qs = INT2FIX(TCIOFLUSH);
+    }
+    Check_Type(qs, T_FIXNUM);
+    if (rb_ary_includes(tcflush_qs, qs) != Qtrue) {
+	rb_raise(rb_eArgError, "wrong queue-selector value %d", FIX2INT(qs));
+    }
+    if (tcflush(dev->fd, FIX2INT(qs)) < 0) {
+	rb_sys_fail("tcflush");
+    }
+
+    return self;
+}
+
+struct broadcast_port {
+    int fd;
+    int flags;			/* F_GETFL before the broadcast, or -1 */
+    long done;
+    int err;
+    int draining;
+};
+
+struct broadcast_arg {
+    struct broadcast_port *ports;
+    int n;
+    const char *ptr;
+    long len;
+    int drain;
+    double deadline;		/* < 0: no timeout */
+    int err;
+};
+
+/*
+ * Returns the poll(2) timeout left until the deadline of arg, 0 once it
+ * has passed.
+ */
+static int
+termios_broadcast_timeout(arg)
+    struct broadcast_arg *arg;
+{
+    double left;
+
+    if (arg->deadline < 0) {
+	return -1;
+    }
+    left = arg->deadline - termios_monotonic();
+    return left <= 0.0 ? 0 : (int)(left * 1000.0) + 1;
+}
+
+static void *
+termios_broadcast_body(ptr)
+    void *ptr;
+{
+    struct broadcast_arg *arg = ptr;
+    struct pollfd *pfd = (struct pollfd *)(arg->ports + arg->n);
+    int *idx = (int *)(pfd + arg->n);
+    int i, j, timeout;
+
+    /* write to every port as it becomes writable */
+    for (;;) {
+	int npfd = 0;
+
+	for (i = 0; i < arg->n; i++) {
+	    struct broadcast_port *port = &arg->ports[i];
+
+	    if (port->err || port->done >= arg->len) {
+		continue;
+	    }
+	    pfd[npfd].fd = port->fd;
+	    pfd[npfd].events = POLLOUT;
+	    idx[npfd] = i;
+	    npfd++;
+	}
+	if (npfd == 0) {
+	    break;
+	}
+	if ((timeout = termios_broadcast_timeout(arg)) == 0) {
+	    /* the ports which did not finish are reported */
+	    for (j = 0; j < npfd; j++) {
+		arg->ports[idx[j]].err = ETIMEDOUT;
+	    }
+	    break;
+	}
+	if (poll(pfd, npfd, timeout) < 0) {
+	    arg->err = errno;
+	    return NULL;
+	}
+	for (j = 0; j < npfd; j++) {
+	    struct broadcast_port *port = &arg->ports[idx[j]];
+	    ssize_t n;
+
+	    if (!pfd[j].revents) {
+		continue;
+	    }
+	    n = write(port->fd, arg->ptr + port->done, arg->len - port->done);
+	    if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		    port->err = errno;
+		}
+		continue;
+	    }
+	    port->done += n;
+	}
+    }
+
+    if (!arg->drain) {
+	return NULL;
+    }
+
+    /* wait for the output queues of all ports at once */
+    for (i = 0; i < arg->n; i++) {
+	arg->ports[i].draining = !arg->ports[i].err;
+    }
+    for (;;) {
+	int busy = 0;
+
+	for (i = 0; i < arg->n; i++) {
+	    struct broadcast_port *port = &arg->ports[i];
+#ifdef TIOCOUTQ
+	    int queued;
+
+	    if (!port->draining) {
+		continue;
+	    }
+	    if (ioctl(port->fd, TIOCOUTQ, &queued) == 0 && queued > 0) {
+		busy = 1;
+		continue;
+	    }
+#endif
+	    /* the rest, if any, is in the transmitter */
+	    if (port->draining && tcdrain(port->fd) < 0) {
+		if (errno == EINTR) {
+		    arg->err = EINTR;
+		    return NULL;
+		}
+		port->err = errno;
+	    }
+	    port->draining = 0;
+	}
+	if (!busy) {
+	    break;
+	}
+	if (termios_broadcast_timeout(arg) == 0) {
+	    for (i = 0; i < arg->n; i++) {
+		if (arg->ports[i].draining) {
+		    arg->ports[i].err = ETIMEDOUT;
+		    arg->ports[i].draining = 0;
+		}
+	    }
+	    break;
+	}
+	if (termios_nap(0.001) < 0) {
+	    arg->err = errno;
+	    return NULL;
+	}
+    }
+
+    return NULL;
+}
+
+static VALUE
+termios_broadcast_restore(ptr)
+    VALUE ptr;
+{
+    struct broadcast_arg *arg = (struct broadcast_arg *)ptr;
+    int i;
+
+    /*
+     * backwards: a port sharing its file description with an earlier
+     * one saved the flags with O_NONBLOCK already set
+     */
+    for (i = arg->n - 1; i >= 0; i--) {
+	if (arg->ports[i].flags >= 0) {
+	    fcntl(arg->ports[i].fd, F_SETFL, arg->ports[i].flags);
+	}
+    }
+    return Qnil;
+}
+
+static VALUE
+termios_broadcast_run(ptr)
+    VALUE ptr;
+{
+    struct broadcast_arg *arg = (struct broadcast_arg *)ptr;
+    int i;
+
+    for (i = 0; i < arg->n; i++) {
+	struct broadcast_port *port = &arg->ports[i];
+
+	if ((port->flags = fcntl(port->fd, F_GETFL)) < 0 ||
+	    fcntl(port->fd, F_SETFL, port->flags | O_NONBLOCK) < 0) {
+	    port->err = errno;
+	    port->flags = -1;
+	}
+    }
+    for (;;) {
+	arg->err = 0;
+	termios_without_gvl(termios_broadcast_body, arg, RUBY_UBF_IO, 0);
+	if (arg->err == 0) {
+	    break;
+	}
+	if (arg->err != EINTR) {
+	    errno = arg->err;
+	    rb_sys_fail("broadcast");
+	}
+	rb_thread_check_ints();
+    }
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   Termios.broadcast(ios, data, drain: false, timeout: nil)
+ *
+ * Writes data to every port of ios in one native call without the GVL,
+ * and returns an array with the number of bytes written to each port, or
+ * the SystemCallError of a port which failed.  Ports are written as they
+ * become writable, so a slow port delays only itself.  If drain is true,
+ * it also waits until the output of all ports is transmitted, watching
+ * their queues at once.
+ *
+ * If timeout is given, the call returns after timeout seconds at most; a
+ * port which has not taken all of data, or not drained it, by then is
+ * reported as Errno::ETIMEDOUT.  Without it, a port held by flow control
+ * blocks the call.
+ *
+ * The elements of ios are IO or Termios::Device objects.  Their file
+ * descriptors are put in non-blocking mode during the call.
+ *
+ *   Termios.broadcast(modems, "ATZ\r", drain: true)  #=> [4, 4, 4, ...]
+ *
+ * See also: write(2), tcdrain(3)
+ */
+static VALUE
+termios_s_broadcast(argc, argv, obj)
+    int argc;
+    VALUE *argv;
+    VALUE obj;
+{
+    static ID keywords[2];
+    struct broadcast_arg arg;
+    VALUE ios, data, opts, kw[2], buf, result;
+    long i;
+
+    rb_scan_args(argc, argv, "2:", &ios, &data, &opts);
+    kw[0] = kw[1] = Qundef;
+    if (!NIL_P(opts)) {
+	if (!keywords[0]) {
+	    keywords[0] = rb_intern("drain");
+	    keywords[1] = rb_intern("timeout");
+	}
+	rb_get_kwargs(opts, keywords, 0, 2, kw);
+    }
+    ios = rb_convert_type(ios, T_ARRAY, "Array", "to_ary");
+    data = rb_str_new_frozen(rb_obj_as_string(data));
+
+    memset(&arg, 0, sizeof(arg));
+    arg.n = (int)RARRAY_LEN(ios);
+    arg.ptr = RSTRING_PTR(data);
+    arg.len = RSTRING_LEN(data);
+    arg.drain = kw[0] != Qundef && RTEST(kw[0]);
+    arg.deadline = -1.0;
+    if (kw[1] != Qundef && !NIL_P(kw[1])) {
+	arg.deadline = termios_monotonic() + NUM2DBL(kw[1]);
+    }
+    buf = rb_str_tmp_new((sizeof(struct broadcast_port) +
+			  sizeof(struct pollfd) + sizeof(int)) * arg.n);
+    arg.ports = (struct broadcast_port *)RSTRING_PTR(buf);
+    memset(arg.ports, 0, sizeof(struct broadcast_port) * arg.n);
+    for (i = 0; i < arg.n; i++) {
+	VALUE io = RARRAY_AREF(ios, i);
+
+	arg.ports[i].fd = rb_typeddata_is_kind_of(io, &device_type) ?
+	    get_device(io)->fd : termios_io_fileno(io);
+	arg.ports[i].flags = -1;
+    }
+
+    rb_ensure(termios_broadcast_run, (VALUE)&arg,
+	      termios_broadcast_restore, (VALUE)&arg);
+
+    result = rb_ary_new2(arg.n);
+    for (i = 0; i < arg.n; i++) {
+	if (arg.ports[i].err) {
+	    rb_ary_push(result, rb_syserr_new(arg.ports[i].err, "broadcast"));
+	}
+	else {
+	    rb_ary_push(result, LONG2NUM(arg.ports[i].done));
+	}
+    }
+    rb_str_resize(buf, 0);
+    RB_GC_GUARD(data);
+
+    return result;
+}
+
+/*
+ * Document-class: Termios::IOEngine
+ *
+ * Multiplexes reads and writes of many terminals, such as thousands of
+ * pseudo terminal masters, in native code.  Registered ports always have
+ * a read pending; Termios::IOEngine#write queues data and
+ * Termios::IOEngine#submit starts the queued writes in one batch, and
+ * Termios::IOEngine#reap waits without the GVL and returns everything
+ * which completed at once:
+ *
+ *   require 'termios'
+ *
+ *   engine = Termios::IOEngine.new
+ *   masters.each {|m| engine.register(m) }
+ *   loop {
+ *     engine.reap.each {|io, event, value|
+ *       case event
+ *       when :read  then engine.write(peer_of(io), value)
+ *       when :eof   then engine.unregister(io)
+ *       end
+ *     }
+ *     engine.submit
+ *   }
+ *
+ * The backend is chosen when the engine is created: io_uring with a pool
+ * of provided buffers where the kernel supports it, epoll(7) on Linux,
+ * and poll(2) elsewhere.  Termios::IOEngine.backends lists the backends
+ * compiled in.  An engine is meant to be used by one thread.
+ */
+
+#define IO_ENGINE_POLL		0
+#define IO_ENGINE_EPOLL		1
+#define IO_ENGINE_URING		2
+
+#define IO_ENGINE_READ		1
+#define IO_ENGINE_WRITE		2
+#define IO_ENGINE_EOF		3
+#define IO_ENGINE_ERROR		4
+
+#define IO_ENGINE_MAX_EVENTS	256
+#define IO_ENGINE_SLICE_MS	100	/* longest single wait in reap */
+
+#ifdef HAVE_IO_URING
+#define URING_ENTRIES		1024
+#define URING_BUFFERS		1024
+#define URING_GROUP		1
+
+/* operations in the low byte of user_data, the port slot above it */
+#define URING_OP_READ		1
+#define URING_OP_WRITE		2
+#define URING_OP_PROVIDE	3
+#define URING_OP_CANCEL		4
+
+struct termios_uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    unsigned to_submit;
+};
+#endif
+
+struct io_engine_port {
+    int fd;			/* -1: free slot */
+    int registered;		/* a read is wanted */
+    int inflight;		/* io_uring operations not completed */
+    int want_out;		/* epoll: EPOLLOUT is set */
+    int polled;			/* epoll: in the interest list */
+    int flags;			/* F_GETFL at register */
+    VALUE io;
+    char *wq;			/* queued by write */
+    long wq_len, wq_off, wq_capa;
+    char *wf;			/* io_uring: being written */
+    long wf_len, wf_off, wf_capa;
+};
+
+struct io_engine_completion {
+    int slot;
+    int kind;
+    long off;			/* READ: offset in the arena */
+    long len;			/* READ, WRITE: bytes; ERROR: errno */
+};
+
+struct io_engine {
+    int backend;
+    int epfd;
+    long bufsize;
+    struct io_engine_port *ports;
+    int nports, capa;
+    VALUE slots;		/* fd => slot */
+    char *arena;
+    long arena_used;
+    struct io_engine_completion *done;
+    int ndone, done_capa;
+    struct pollfd *pfd;		/* poll: scratch of nports entries */
+    int *pfd_slot;
+    int pfd_capa;
+    int timeout_ms;		/* for a round of reap */
+    int err;
+    VALUE reaper;		/* the thread in reap, or nil */
+    int closing;		/* close is deferred until reap returns */
+#ifdef HAVE_IO_URING
+    struct termios_uring ring;
+    char *bufs;
+#endif
+};
+
+static VALUE cIOEngine;
+#ifdef HAVE_IO_URING
+static void uring_quiesce(struct io_engine *);
+#endif
+static VALUE sym_read, sym_write, sym_eof, sym_error;
+
+static void
+io_engine_mark(ptr)
+    void *ptr;
+{
+    struct io_engine *e = ptr;
+    int i;
+
+    rb_gc_mark(e->slots);
+    rb_gc_mark(e->reaper);
+    for (i = 0; i < e->nports; i++) {
+	rb_gc_mark(e->ports[i].io);
+    }
+}
+
+static void
+io_engine_release(e)
+    struct io_engine *e;
+{
+    int i;
+
+#ifdef HAVE_IO_URING
+    if (e->ring.fd >= 0) {
+	uring_quiesce(e);
+    }
+#endif
+    for (i = 0; i < e->nports; i++) {
+	xfree(e->ports[i].wq);
+	xfree(e->ports[i].wf);
+    }
+    xfree(e->ports);
+    xfree(e->arena);
+    xfree(e->done);
+    xfree(e->pfd);
+    xfree(e->pfd_slot);
+    e->pfd = NULL;
+    e->pfd_slot = NULL;
+    e->ports = NULL;
+    e->arena = NULL;
+    e->done = NULL;
+    e->nports = e->capa = 0;
+    if (e->epfd >= 0) {
+	close(e->epfd);
+	e->epfd = -1;
+    }
+#ifdef HAVE_IO_URING
+    if (e->ring.fd >= 0) {
+	if (e->ring.cq_ptr != e->ring.sq_ptr) {
+	    munmap(e->ring.cq_ptr, e->ring.cq_size);
+	}
+	munmap(e->ring.sq_ptr, e->ring.sq_size);
+	munmap(e->ring.sqes, e->ring.sq_entries * sizeof(struct io_uring_sqe));
+	close(e->ring.fd);
+	e->ring.fd = -1;
+    }
+    if (e->bufs) {
+	free(e->bufs);
+	e->bufs = NULL;
+    }
+#endif
+}
+
+static void
+io_engine_free(ptr)
+    void *ptr;
+{
+    io_engine_release(ptr);
+    xfree(ptr);
+}
+
+static const rb_data_type_t io_engine_type = {
+    "Termios::IOEngine",
+    {io_engine_mark, io_engine_free, 0,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+io_engine_alloc(klass)
+    VALUE klass;
+{
+    struct io_engine *e;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct(klass, struct io_engine, &io_engine_type, e);
+    e->epfd = -1;
+    e->slots = Qnil;
+    e->reaper = Qnil;
+#ifdef HAVE_IO_URING
+    e->ring.fd = -1;
+#endif
+
+    return obj;
+}
+
+static struct io_engine *
+get_io_engine(self)
+    VALUE self;
+{
+    struct io_engine *e;
+
+    TypedData_Get_Struct(self, struct io_engine, &io_engine_type, e);
+    if (!e->done || e->closing) {
+	rb_raise(rb_eIOError, "closed engine");
+    }
+    return e;
+}
+
+/*
+ * Returns the engine of self, which no other thread is reaping: reap
+ * works on the ports and buffers without the GVL.
+ */
+static struct io_engine *
+get_idle_io_engine(self)
+    VALUE self;
+{
+    struct io_engine *e = get_io_engine(self);
+
+    if (!NIL_P(e->reaper)) {
+	rb_raise(rb_eIOError, "engine in use by reap in another thread");
+    }
+    return e;
+}
+
+/*
+ * Adds a completion.  The caller makes sure there is room.
+ */
+static void
+io_engine_complete(e, slot, kind, off, len)
+    struct io_engine *e;
+    int slot, kind;
+    long off, len;
+{
+    struct io_engine_completion *c = &e->done[e->ndone++];
+
+    c->slot = slot;
+    c->kind = kind;
+    c->off = off;
+    c->len = len;
+}
+
+static int
+io_engine_full(e)
+    struct io_engine *e;
+{
+    return e->ndone >= e->done_capa ||
+	e->arena_used + e->bufsize > e->bufsize * IO_ENGINE_MAX_EVENTS;
+}
+
+#ifdef HAVE_IO_URING
+static int
+uring_setup(ring)
+    struct termios_uring *ring;
+{
+    struct io_uring_params p;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) {
+	return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {	/* needed for timeouts */
+	close(fd);
+	errno = ENOSYS;
+	return -1;
+    }
+    ring->fd = fd;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+	ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(0, ring->sq_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+	goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	ring->cq_ptr = ring->sq_ptr;
+    }
+    else {
+	ring->cq_ptr = mmap(0, ring->cq_size, PROT_READ|PROT_WRITE,
+			    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ptr == MAP_FAILED) {
+	    munmap(ring->sq_ptr, ring->sq_size);
+	    goto fail;
+	}
+    }
+    ring->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+		      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+	if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	goto fail;
+    }
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+    ring->to_submit = 0;
+    return 0;
+
+  fail:
+    close(fd);
+    ring->fd = -1;
+    return -1;
+}
+
+static int
+uring_enter(ring, wait_nr, timeout_ms)
+    struct termios_uring *ring;
+    unsigned wait_nr;
+    int timeout_ms;
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+    int n;
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait_nr > 0) {
+	flags |= IORING_ENTER_GETEVENTS;
+	if (timeout_ms >= 0) {
+	    ts.tv_sec = timeout_ms / 1000;
+	    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	    arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	flags |= IORING_ENTER_EXT_ARG;
+    }
+    n = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr,
+		     flags, wait_nr > 0 ? (void *)&arg : NULL,
+		     wait_nr > 0 ? sizeof(arg) : 0);
+    if (n >= 0) {
+	ring->to_submit -= (unsigned)n < ring->to_submit ? (unsigned)n : ring->to_submit;
+    }
+    return n;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(ring)
+    struct termios_uring *ring;
+{
+    unsigned tail = *ring->sq_tail, idx;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+	/* the ring is full; hand it to the kernel first */
+	if (uring_enter(ring, 0, 0) < 0 ||
+	    tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+	    return NULL;
+	}
+    }
+    idx = tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+static int
+uring_provide(e, bid, n)
+    struct io_engine *e;
+    int bid, n;
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&e->ring);
+
+    if (!sqe) {
+	return -1;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = n;
+    sqe->addr = (uint64_t)(uintptr_t)(e->bufs + (long)bid * e->bufsize);
+    sqe->len = (unsigned)e->bufsize;
+    sqe->off = bid;
+    sqe->buf_group = URING_GROUP;
+    sqe->user_data = URING_OP_PROVIDE;
+    return 0;
+}
+
+static int
+uring_post_read(e, slot)
+    struct io_engine *e;
+    int slot;
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&e->ring);
+
+    if (!sqe) {
+	return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = e->ports[slot].fd;
+    sqe->off = (uint64_t)-1;
+    sqe->len = (unsigned)e->bufsize;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    sqe->user_data = ((uint64_t)slot << 8) | URING_OP_READ;
+    e->ports[slot].inflight++;
+    return 0;
+}
+
+static int
+uring_post_write(e, slot)
+    struct io_engine *e;
+    int slot;
+{
+    struct io_engine_port *port = &e->ports[slot];
+    struct io_uring_sqe *sqe;
+
+    if (port->wf_off >= port->wf_len) {
+	char *tmp;
+	long capa;
+
+	if (port->wq_len == 0) {
+	    return 0;
+	}
+	/* the queue becomes the buffer in flight */
+	tmp = port->wf; port->wf = port->wq; port->wq = tmp;
+	capa = port->wf_capa; port->wf_capa = port->wq_capa; port->wq_capa = capa;
+	port->wf_len = port->wq_len;
+	port->wf_off = 0;
+	port->wq_len = 0;
+    }
+    if (!(sqe = uring_get_sqe(&e->ring))) {
+	return -1;
+    }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = port->fd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uint64_t)(uintptr_t)(port->wf + port->wf_off);
+    sqe->len = (unsigned)(port->wf_len - port->wf_off);
+    sqe->user_data = ((uint64_t)slot << 8) | URING_OP_WRITE;
+    port->inflight++;
+    return 0;
+}
+
+static void
+uring_reap(e, timeout)
+    struct io_engine *e;
+    int timeout;
+{
+    struct termios_uring *ring = &e->ring;
+    unsigned head, tail;
+
+    if (uring_enter(ring, e->ndone > 0 ? 0 : 1, timeout) < 0 &&
+	errno != ETIME && errno != EBUSY) {
+	e->err = errno;
+	return;
+    }
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && !io_engine_full(e)) {
+	struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+	int op = (int)(cqe->user_data & 0xff);
+	int slot = (int)(cqe->user_data >> 8);
+	struct io_engine_port *port = &e->ports[slot];
+	int res = cqe->res;
+
+	head++;
+	if (op == URING_OP_READ) {
+	    port->inflight--;
+	    if (res > 0) {
+		int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		memcpy(e->arena + e->arena_used, e->bufs + (long)bid * e->bufsize, res);
+		io_engine_complete(e, slot, IO_ENGINE_READ, e->arena_used, (long)res);
+		e->arena_used += res;
+		uring_provide(e, bid, 1);
+		if (port->registered) {
+		    uring_post_read(e, slot);
+		}
+	    }
+	    else if (res == 0 || res == -EIO) {	/* EIO: the slave is closed */
+		if (port->registered) {
+		    port->registered = 0;
+		    io_engine_complete(e, slot, IO_ENGINE_EOF, 0, 0);
+		}
+	    }
+	    else if (res == -ECANCELED) {
+		/* unregistered */
+	    }
+	    else if (res == -ENOBUFS || res == -EAGAIN || res == -EINTR) {
+		if (port->registered) {
+		    uring_post_read(e, slot);
+		}
+	    }
+	    else if (port->registered) {
+		port->registered = 0;
+		io_engine_complete(e, slot, IO_ENGINE_ERROR, 0, (long)-res);
+	    }
+	}
+	else if (op == URING_OP_WRITE) {
+	    port->inflight--;
+	    if (res >= 0) {
+		port->wf_off += res;
+		io_engine_complete(e, slot, IO_ENGINE_WRITE, 0, (long)res);
+		if (port->fd >= 0) {
+		    uring_post_write(e, slot);
+		}
+	    }
+	    else if (res == -EAGAIN || res == -EINTR) {
+		uring_post_write(e, slot);
+	    }
+	    else {
+		port->wf_off = port->wf_len;
+		port->wq_len = 0;
+		io_engine_complete(e, slot, IO_ENGINE_ERROR, 0, (long)-res);
+	    }
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (ring->to_submit > 0) {
+	uring_enter(ring, 0, 0);
+    }
+}
+#endif
+
+/*
+ * Writes the queue of a port without blocking, for the epoll and poll
+ * backends.  Returns 1 if data is left.
+ */
+static int
+io_engine_flush_port(e, slot)
+    struct io_engine *e;
+    int slot;
+{
+    struct io_engine_port *port = &e->ports[slot];
+
+    while (port->wq_off < port->wq_len && e->ndone < e->done_capa) {
+	ssize_t n = write(port->fd, port->wq + port->wq_off,
+			  port->wq_len - port->wq_off);
+
+	if (n < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		return 1;
+	    }
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (e->ndone < e->done_capa) {
+		io_engine_complete(e, slot, IO_ENGINE_ERROR, 0, (long)errno);
+	    }
+	    port->wq_len = port->wq_off = 0;
+	    return 0;
+	}
+	port->wq_off += n;
+	io_engine_complete(e, slot, IO_ENGINE_WRITE, 0, (long)n);
+    }
+    if (port->wq_off < port->wq_len) {
+	return 1;
+    }
+    port->wq_len = port->wq_off = 0;
+    return 0;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static void
+io_engine_epoll_set(e, slot)
+    struct io_engine *e;
+    int slot;
+{
+    struct io_engine_port *port = &e->ports[slot];
+    struct epoll_event ev;
+    int want_out = port->wq_off < port->wq_len;
+
+    if (!port->polled || want_out == port->want_out) {
+	return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (port->registered ? EPOLLIN : 0) | (want_out ? EPOLLOUT : 0);
+    ev.data.u32 = slot;
+    epoll_ctl(e->epfd, EPOLL_CTL_MOD, port->fd, &ev);
+    port->want_out = want_out;
+}
+#endif
+
+static void
+io_engine_ready(e, slot, readable, writable)
+    struct io_engine *e;
+    int slot, readable, writable;
+{
+    struct io_engine_port *port = &e->ports[slot];
+
+    if (port->fd < 0) {
+	return;
+    }
+    if (writable) {
+	io_engine_flush_port(e, slot);
+    }
+    if (readable && port->registered && !io_engine_full(e)) {
+	ssize_t n = read(port->fd, e->arena + e->arena_used, e->bufsize);
+
+	if (n > 0) {
+	    io_engine_complete(e, slot, IO_ENGINE_READ, e->arena_used, (long)n);
+	    e->arena_used += n;
+	}
+	else if (n == 0 || errno == EIO) {	/* EIO: the slave is closed */
+	    port->registered = 0;
+	    io_engine_complete(e, slot, IO_ENGINE_EOF, 0, 0);
+	}
+	else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+	    port->registered = 0;
+	    io_engine_complete(e, slot, IO_ENGINE_ERROR, 0, (long)errno);
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	/* a hung up fd would be reported again and again */
+	if (!port->registered && e->backend == IO_ENGINE_EPOLL && port->polled) {
+	    epoll_ctl(e->epfd, EPOLL_CTL_DEL, port->fd, NULL);
+	    port->polled = 0;
+	}
+#endif
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (e->backend == IO_ENGINE_EPOLL) {
+	io_engine_epoll_set(e, slot);
+    }
+#endif
+}
+
+static void
+io_engine_reap_once(e, timeout)
+    struct io_engine *e;
+    int timeout;
+{
+    int i, n;
+
+#ifdef HAVE_IO_URING
+    if (e->backend == IO_ENGINE_URING) {
+	uring_reap(e, timeout);
+	return;
+    }
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    if (e->backend == IO_ENGINE_EPOLL) {
+	struct epoll_event evs[IO_ENGINE_MAX_EVENTS];
+
+	n = epoll_wait(e->epfd, evs, IO_ENGINE_MAX_EVENTS, timeout);
+	if (n < 0) {
+	    e->err = errno;
+	    return;
+	}
+	for (i = 0; i < n; i++) {
+	    io_engine_ready(e, (int)evs[i].data.u32,
+			    evs[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR),
+			    evs[i].events & (EPOLLOUT|EPOLLERR));
+	}
+	return;
+    }
+#endif
+    {
+	struct pollfd *pfd = e->pfd;
+	int *idx = e->pfd_slot;
+	int npfd = 0;
+
+	for (i = 0; i < e->nports; i++) {
+	    struct io_engine_port *port = &e->ports[i];
+	    short events = (port->registered ? POLLIN : 0) |
+		(port->wq_off < port->wq_len ? POLLOUT : 0);
+
+	    if (port->fd < 0 || !events) {
+		continue;
+	    }
+	    pfd[npfd].fd = port->fd;
+	    pfd[npfd].events = events;
+	    pfd[npfd].revents = 0;
+	    idx[npfd++] = i;
+	}
+	n = poll(pfd, npfd, timeout);
+	if (n < 0) {
+	    e->err = errno;
+	    return;
+	}
+	for (i = 0; i < npfd; i++) {
+	    if (pfd[i].revents) {
+		io_engine_ready(e, idx[i],
+				pfd[i].revents & (POLLIN|POLLHUP|POLLERR),
+				pfd[i].revents & (POLLOUT|POLLERR));
+	    }
+	}
+    }
+}
+
+static void *
+io_engine_reap_body(ptr)
+    void *ptr;
+{
+    struct io_engine *e = ptr;
+    int timeout = e->ndone > 0 ? 0 : e->timeout_ms;
+    double deadline = termios_monotonic() + timeout / 1000.0;
+
+    /* readiness without data, EAGAIN for example, does not count */
+    for (;;) {
+	int slice = timeout;
+
+	/* wake up now and then so a close from another thread is seen */
+	if (slice < 0 || slice > IO_ENGINE_SLICE_MS) {
+	    slice = IO_ENGINE_SLICE_MS;
+	}
+	io_engine_reap_once(e, slice);
+	if (e->ndone > 0 || e->err || e->closing || timeout == 0) {
+	    break;
+	}
+	if (timeout > 0) {
+	    double left = deadline - termios_monotonic();
+
+	    if (left <= 0.0) {
+		break;
+	    }
+	    timeout = (int)(left * 1000.0) + 1;
+	}
+    }
+
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+static void
+uring_cancel(e, user_data)
+    struct io_engine *e;
+    uint64_t user_data;
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&e->ring);
+
+    if (sqe) {
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = URING_OP_CANCEL;
+    }
+}
+
+/*
+ * Cancels the operations in flight and waits a while for them, so that
+ * the kernel no longer uses the buffers when they are freed.
+ */
+static void
+uring_quiesce(e)
+    struct io_engine *e;
+{
+    struct termios_uring *ring = &e->ring;
+    int i, tries, busy;
+
+    for (i = 0; i < e->nports; i++) {
+	if (e->ports[i].inflight > 0) {
+	    uring_cancel(e, ((uint64_t)i << 8) | URING_OP_READ);
+	    uring_cancel(e, ((uint64_t)i << 8) | URING_OP_WRITE);
+	}
+    }
+    for (tries = 0; tries < 10; tries++) {
+	unsigned head, tail;
+
+	for (busy = 0, i = 0; i < e->nports; i++) {
+	    busy += e->ports[i].inflight;
+	}
+	if (!busy) {
+	    break;
+	}
+	uring_enter(ring, 1, 100);
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+	    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+	    int op = (int)(cqe->user_data & 0xff);
+
+	    if (op == URING_OP_READ || op == URING_OP_WRITE) {
+		e->ports[cqe->user_data >> 8].inflight--;
+	    }
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+static int
+uring_init(e)
+    struct io_engine *e;
+{
+    struct termios_uring *ring = &e->ring;
+    unsigned head;
+    int res;
+
+    if (uring_setup(ring) < 0) {
+	return -1;
+    }
+    e->bufs = malloc((size_t)URING_BUFFERS * e->bufsize);
+    if (!e->bufs || uring_provide(e, 0, URING_BUFFERS) < 0 ||
+	uring_enter(ring, 1, -1) < 0) {
+	goto fail;
+    }
+    head = *ring->cq_head;
+    res = ring->cqes[head & *ring->cq_mask].res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    if (res < 0) {		/* no IORING_OP_PROVIDE_BUFFERS */
+	errno = -res;
+	goto fail;
+    }
+    return 0;
+
+  fail:
+    res = errno;
+    if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    close(ring->fd);
+    ring->fd = -1;
+    free(e->bufs);
+    e->bufs = NULL;
+    errno = res;
+    return -1;
+}
+#endif
+
+static VALUE
+io_engine_backend_name(backend)
+    int backend;
+{
+    switch (backend) {
+      case IO_ENGINE_URING: return ID2SYM(rb_intern("io_uring"));
+      case IO_ENGINE_EPOLL: return ID2SYM(rb_intern("epoll"));
+      default:              return ID2SYM(rb_intern("poll"));
+    }
+}
+
+/*
+ * call-seq:
+ *   Termios::IOEngine.backends
+ *
+ * Returns the backends compiled in, the preferred first.  io_uring is
+ * listed even when the running kernel does not allow it.
+ */
+static VALUE
+io_engine_s_backends(klass)
+    VALUE klass;
+{
+    VALUE ary = rb_ary_new();
+
+#ifdef HAVE_IO_URING
+    rb_ary_push(ary, io_engine_backend_name(IO_ENGINE_URING));
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    rb_ary_push(ary, io_engine_backend_name(IO_ENGINE_EPOLL));
+#endif
+    rb_ary_push(ary, io_engine_backend_name(IO_ENGINE_POLL));
+
+    return ary;
+}
+
+/*
+ * call-seq:
+ *   Termios::IOEngine.new(backend = nil, bufsize = 4096)
+ *
+ * Returns a new engine using backend, one of :io_uring, :epoll and :poll.
+ * Without backend, the first of them which works is used.  Reads are done
+ * in chunks of up to bufsize bytes.
+ */
+static VALUE
+io_engine_initialize(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct io_engine *e;
+    VALUE backend, bufsize;
+    int want = -1;
+
+    rb_scan_args(argc, argv, "02", &backend, &bufsize);
+    TypedData_Get_Struct(self, struct io_engine, &io_engine_type, e);
+    if (e->done) {
+	rb_raise(rb_eArgError, "already initialized engine");
+    }
+    if (!NIL_P(backend)) {
+	if (rb_ary_includes(io_engine_s_backends(cIOEngine), backend) != Qtrue) {
+	    rb_raise(rb_eArgError, "unsupported backend %"PRIsVALUE, backend);
+	}
+	want = backend == io_engine_backend_name(IO_ENGINE_URING) ? IO_ENGINE_URING :
+	    backend == io_engine_backend_name(IO_ENGINE_EPOLL) ? IO_ENGINE_EPOLL :
+	    IO_ENGINE_POLL;
+    }
+    e->bufsize = NIL_P(bufsize) ? 4096 : NUM2LONG(bufsize);
+    if (e->bufsize <= 0 || e->bufsize > (1L << 20)) {
+	rb_raise(rb_eArgError, "bufsize out of range");
+    }
+
+    e->backend = IO_ENGINE_POLL;
+#ifdef HAVE_IO_URING
+    if (want < 0 || want == IO_ENGINE_URING) {
+	if (uring_init(e) == 0) {
+	    e->backend = IO_ENGINE_URING;
+	}
+	else if (want == IO_ENGINE_URING) {
+	    rb_sys_fail("io_uring_setup");
+	}
+    }
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    if (e->backend == IO_ENGINE_POLL && (want < 0 || want == IO_ENGINE_EPOLL)) {
+	e->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (e->epfd < 0) {
+	    rb_sys_fail("epoll_create1");
+	}
+	rb_update_max_fd(e->epfd);
+	e->backend = IO_ENGINE_EPOLL;
+    }
+#endif
+
+    e->slots = rb_hash_new();
+    e->arena = ALLOC_N(char, e->bufsize * IO_ENGINE_MAX_EVENTS);
+    e->done_capa = IO_ENGINE_MAX_EVENTS;
+    e->done = ALLOC_N(struct io_engine_completion, e->done_capa);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   engine.backend
+ *
+ * Returns the backend in use.
+ */
+static VALUE
+io_engine_backend(self)
+    VALUE self;
+{
+    return io_engine_backend_name(get_io_engine(self)->backend);
+}
+
+static int
+io_engine_fd(io)
+    VALUE io;
+{
+    return rb_typeddata_is_kind_of(io, &device_type) ?
+	get_device(io)->fd : termios_io_fileno(io);
+}
+
+static int
+io_engine_fd_slot(e, fd)
+    struct io_engine *e;
+    int fd;
+{
+    VALUE slot = rb_hash_lookup(e->slots, INT2FIX(fd));
+
+    return NIL_P(slot) ? -1 : FIX2INT(slot);
+}
+
+/*
+ * Returns the slot of io, or -1.  A slot registered by another IO which
+ * had the same fd number does not count.
+ */
+static int
+io_engine_slot(e, io)
+    struct io_engine *e;
+    VALUE io;
+{
+    int slot = io_engine_fd_slot(e, io_engine_fd(io));
+
+    return slot >= 0 && e->ports[slot].io == io ? slot : -1;
+}
+
+/*
+ * Stops watching the port in slot.  The fd flags saved by
+ * Termios::IOEngine#register are put back when restore is set.
+ */
+static void
+io_engine_drop(e, slot, restore)
+    struct io_engine *e;
+    int slot, restore;
+{
+    struct io_engine_port *port = &e->ports[slot];
+
+    rb_hash_delete(e->slots, INT2FIX(port->fd));
+#ifdef HAVE_SYS_EPOLL_H
+    if (e->backend == IO_ENGINE_EPOLL && port->polled) {
+	epoll_ctl(e->epfd, EPOLL_CTL_DEL, port->fd, NULL);
+	port->polled = 0;
+    }
+#endif
+#ifdef HAVE_IO_URING
+    if (e->backend == IO_ENGINE_URING && port->inflight > 0) {
+	uring_cancel(e, ((uint64_t)slot << 8) | URING_OP_READ);
+	if (port->wf_off < port->wf_len) {
+	    uring_cancel(e, ((uint64_t)slot << 8) | URING_OP_WRITE);
+	}
+    }
+#endif
+    if (restore && port->flags >= 0) {
+	fcntl(port->fd, F_SETFL, port->flags);
+    }
+    port->fd = -1;
+    port->io = Qnil;
+    port->registered = 0;
+    port->wq_len = port->wq_off = 0;
+}
+
+/*
+ * call-seq:
+ *   engine.register(io)
+ *
+ * Starts reading io, an IO or a Termios::Device.  Data read is returned by
+ * Termios::IOEngine#reap as [io, :read, data].  The io is put in
+ * non-blocking mode until it is unregistered.
+ */
+static VALUE
+io_engine_register(self, io)
+    VALUE self, io;
+{
+    struct io_engine *e = get_idle_io_engine(self);
+    struct io_engine_port *port;
+    int fd, slot;
+
+    fd = io_engine_fd(io);
+    if ((slot = io_engine_fd_slot(e, fd)) >= 0) {
+	VALUE old = e->ports[slot].io;
+
+	if (old == io) {
+	    return self;
+	}
+	/*
+	 * the fd number is reused after the registered IO was closed; its
+	 * saved flags belong to another file
+	 */
+	io_engine_drop(e, slot, !RTEST(rb_funcall(old, id_closed_p, 0)));
+    }
+
+    for (slot = 0; slot < e->nports; slot++) {
+	if (e->ports[slot].fd < 0 && e->ports[slot].inflight == 0) {
+	    break;
+	}
+    }
+    if (slot == e->nports) {
+	if (e->nports == e->capa) {
+	    e->capa = e->capa ? e->capa * 2 : 16;
+	    REALLOC_N(e->ports, struct io_engine_port, e->capa);
+	}
+	memset(&e->ports[slot], 0, sizeof(e->ports[slot]));
+	e->ports[slot].fd = -1;
+	e->ports[slot].io = Qnil;
+	e->nports++;
+    }
+    port = &e->ports[slot];
+    port->wq_len = port->wq_off = 0;
+    port->wf_len = port->wf_off = 0;
+    port->want_out = 0;
+    port->polled = 0;
+    port->flags = -1;
+
+    /* io_uring too: a blocking write to a tty would block the submission */
+    if ((port->flags = fcntl(fd, F_GETFL)) < 0 ||
+	fcntl(fd, F_SETFL, port->flags | O_NONBLOCK) < 0) {
+	rb_sys_fail("fcntl");
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (e->backend == IO_ENGINE_EPOLL) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = slot;
+	if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	    int err = errno;
+
+	    fcntl(fd, F_SETFL, port->flags);
+	    rb_syserr_fail(err, "epoll_ctl");
+	}
+	port->polled = 1;
+    }
+#endif
+    port->fd = fd;
+    port->io = io;
+    port->registered = 1;
+#ifdef HAVE_IO_URING
+    if (e->backend == IO_ENGINE_URING && uring_post_read(e, slot) < 0) {
+	fcntl(fd, F_SETFL, port->flags);
+	port->fd = -1;
+	port->io = Qnil;
+	port->registered = 0;
+	rb_raise(rb_eIOError, "submission queue full");
+    }
+#endif
+    rb_hash_aset(e->slots, INT2FIX(fd), INT2FIX(slot));
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   engine.unregister(io)
+ *
+ * Stops reading and writing io.  Queued writes are discarded.
+ */
+static VALUE
+io_engine_unregister(self, io)
+    VALUE self, io;
+{
+    struct io_engine *e = get_idle_io_engine(self);
+    int slot = io_engine_slot(e, io);
+
+    if (slot >= 0) {
+	io_engine_drop(e, slot, 1);
+    }
+    return self;
+}
+
+/*
+ * call-seq:
+ *   engine.write(io, data)
+ *
+ * Queues data to be written to the registered io by the next
+ * Termios::IOEngine#submit.  Returns the number of bytes queued for io.
+ */
+static VALUE
+io_engine_write(self, io, data)
+    VALUE self, io, data;
+{
+    struct io_engine *e = get_idle_io_engine(self);
+    struct io_engine_port *port;
+    int slot = io_engine_slot(e, io);
+    long len;
+
+    if (slot < 0) {
+	rb_raise(rb_eArgError, "not registered");
+    }
+    port = &e->ports[slot];
+    StringValue(data);
+    len = RSTRING_LEN(data);
+    if (port->wq_off > 0 && port->wq_off == port->wq_len) {
+	port->wq_off = port->wq_len = 0;
+    }
+    if (port->wq_len + len > port->wq_capa) {
+	if (port->wq_off > 0) {
+	    memmove(port->wq, port->wq + port->wq_off, port->wq_len - port->wq_off);
+	    port->wq_len -= port->wq_off;
+	    port->wq_off = 0;
+	}
+	if (port->wq_len + len > port->wq_capa) {
+	    port->wq_capa = (port->wq_len + len) * 2;
+	    REALLOC_N(port->wq, char, port->wq_capa);
+	}
+    }
+    memcpy(port->wq + port->wq_len, RSTRING_PTR(data), len);
+    port->wq_len += len;
+
+    return LONG2NUM(port->wq_len - port->wq_off);
+}
+
+static void
+io_engine_reserve(e, n)
+    struct io_engine *e;
+    int n;
+{
+    if (e->done_capa < e->ndone + n) {
+	e->done_capa = e->ndone + n;
+	REALLOC_N(e->done, struct io_engine_completion, e->done_capa);
+    }
+}
+
+/*
+ * call-seq:
+ *   engine.submit
+ *
+ * Starts all queued writes in one batch.  Writes which cannot complete
+ * at once continue in the background, and their completions are returned
+ * by Termios::IOEngine#reap as [io, :write, bytes].
+ */
+static VALUE
+io_engine_submit(self)
+    VALUE self;
+{
+    struct io_engine *e = get_idle_io_engine(self);
+    int slot;
+
+    io_engine_reserve(e, IO_ENGINE_MAX_EVENTS + e->nports);
+    for (slot = 0; slot < e->nports; slot++) {
+	struct io_engine_port *port = &e->ports[slot];
+
+	if (port->fd < 0 || port->wq_off >= port->wq_len) {
+	    continue;
+	}
+#ifdef HAVE_IO_URING
+	if (e->backend == IO_ENGINE_URING) {
+	    if (port->wf_off >= port->wf_len && uring_post_write(e, slot) < 0) {
+		rb_raise(rb_eIOError, "submission queue full");
+	    }
+	    continue;
+	}
+#endif
+	if (e->ndone >= e->done_capa) {
+	    io_engine_reserve(e, e->nports);
+	}
+	io_engine_flush_port(e, slot);
+#ifdef HAVE_SYS_EPOLL_H
+	if (e->backend == IO_ENGINE_EPOLL) {
+	    io_engine_epoll_set(e, slot);
+	}
+#endif
+    }
+#ifdef HAVE_IO_URING
+    if (e->backend == IO_ENGINE_URING && e->ring.to_submit > 0 &&
+	uring_enter(&e->ring, 0, 0) < 0) {
+	rb_sys_fail("io_uring_enter");
+    }
+#endif
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   engine.reap(timeout = nil)
+ *
+ * Waits up to timeout seconds (forever if nil) without the GVL until
+ * something completes, and returns all completions as an array of
+ *
+ *   [io, :read, data]
+ *   [io, :eof, nil]
+ *   [io, :write, bytes]
+ *   [io, :error, exception]
+ *
+ * Reading stops at :eof and :error.  It returns an empty array on
+ * timeout.
+ */
+static void io_engine_shutdown(struct io_engine *);
+
+static VALUE
+io_engine_reap_run(ptr)
+    VALUE ptr;
+{
+    struct io_engine *e = (struct io_engine *)ptr;
+    VALUE result;
+    int i;
+
+    for (;;) {
+	e->err = 0;
+	termios_without_gvl(io_engine_reap_body, e, RUBY_UBF_IO, 0);
+	if (e->err == 0 || e->ndone > 0 || e->closing) {
+	    break;
+	}
+	if (e->err != EINTR) {
+	    errno = e->err;
+	    rb_sys_fail("reap");
+	}
+	rb_thread_check_ints();
+	if (e->closing) {
+	    break;
+	}
+    }
+
+    result = rb_ary_new2(e->ndone);
+    for (i = 0; i < e->ndone; i++) {
+	struct io_engine_completion *c = &e->done[i];
+	VALUE io = e->ports[c->slot].io, ev;
+
+	if (NIL_P(io)) {		/* unregistered meanwhile */
+	    continue;
+	}
+	switch (c->kind) {
+	  case IO_ENGINE_READ:
+	    ev = rb_ary_new3(3, io, sym_read, rb_str_new(e->arena + c->off, c->len));
+	    break;
+	  case IO_ENGINE_WRITE:
+	    ev = rb_ary_new3(3, io, sym_write, LONG2NUM(c->len));
+	    break;
+	  case IO_ENGINE_EOF:
+	    ev = rb_ary_new3(3, io, sym_eof, Qnil);
+	    break;
+	  default:
+	    ev = rb_ary_new3(3, io, sym_error, rb_syserr_new((int)c->len, "reap"));
+	    break;
+	}
+	rb_ary_push(result, ev);
+    }
+    e->ndone = 0;
+    e->arena_used = 0;
+
+    return result;
+}
+
+static VALUE
+io_engine_reap_done(ptr)
+    VALUE ptr;
+{
+    struct io_engine *e = (struct io_engine *)ptr;
+
+    e->reaper = Qnil;
+    if (e->closing) {
+	io_engine_shutdown(e);
+    }
+    return Qnil;
+}
+
+static VALUE
+io_engine_reap(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct io_engine *e = get_idle_io_engine(self);
+    VALUE timeout;
+
+    rb_scan_args(argc, argv, "01", &timeout);
+    e->timeout_ms = NIL_P(timeout) ? -1 : (int)(NUM2DBL(timeout) * 1000.0);
+    io_engine_reserve(e, IO_ENGINE_MAX_EVENTS);
+    if (e->backend == IO_ENGINE_POLL && e->pfd_capa < e->nports) {
+	e->pfd_capa = e->nports;
+	REALLOC_N(e->pfd, struct pollfd, e->pfd_capa);
+	REALLOC_N(e->pfd_slot, int, e->pfd_capa);
+    }
+
+    e->reaper = rb_thread_current();
+    return rb_ensure(io_engine_reap_run, (VALUE)e, io_engine_reap_done, (VALUE)e);
+}
+
+static void
+io_engine_shutdown(e)
+    struct io_engine *e;
+{
+    int slot;
+
+    for (slot = 0; slot < e->nports; slot++) {
+	if (e->ports[slot].fd >= 0 && e->ports[slot].flags >= 0) {
+	    fcntl(e->ports[slot].fd, F_SETFL, e->ports[slot].flags);
+	}
+    }
+    io_engine_release(e);
+    e->slots = Qnil;
+    e->closing = 0;
+}
+
+/*
+ * call-seq:
+ *   engine.close
+ *
+ * Unregisters all ports and releases the engine.  If another thread is
+ * in Termios::IOEngine#reap, it is woken up and returns what completed so
+ * far, and the engine is released as it returns.
+ */
+static VALUE
+io_engine_close(self)
+    VALUE self;
+{
+    struct io_engine *e = get_io_engine(self);
+
+    if (!NIL_P(e->reaper)) {
+	e->closing = 1;
+	rb_funcall(e->reaper, rb_intern("wakeup"), 0);
+	return Qnil;
+    }
+    io_engine_shutdown(e);
+
+    return Qnil;
+}
+
+/*
+ * Document-class: Termios::Modbus
+ *
+ * Frames and deframes Modbus RTU or ASCII messages on a serial port.  The
+ * RTU timing is derived from the ispeed and character format of the port:
+ * a frame ends at 3.5 character times of silence (1.75 ms above 19200
+ * baud), and the master waits as long after the last byte on the line
+ * before it sends.  Reads, writes and the CRC-16 of RTU frames are done
+ * in native code without the GVL, several frames per call.
+ *
+ *   require 'termios'
+ *
+ *   mb = Termios::Modbus.new(port)
+ *   mb.write_frame(1, "\x03\x00\x00\x00\x0a")	# read 10 registers
+ *   unit, pdu = mb.read_frames(1, timeout: 0.5).first
+ *
+ * Since a driver may hand over the bytes of a frame in several pieces,
+ * an RTU frame is taken as soon as its CRC checks, and pending bytes are
+ * split at the points where the CRC checks when the line falls silent.
+ * Bytes which do not make a frame are dropped and counted in
+ * Termios::Modbus#errors.
+ *
+ * A framer must not be used by two threads at once.
+ */
+
+#define MODBUS_RTU_MAX	256	/* unit, PDU and CRC */
+#define MODBUS_ASCII_MAX 513	/* ':', hex of unit, PDU and LRC, CRLF */
+#define MODBUS_BUFSIZE	2048
+#define MODBUS_ASCII_TIMEOUT 1.0 /* between characters of an ASCII frame */
+
+struct modbus {
+    VALUE io;
+    int ascii;
+    double char_time;
+    double t35, t15;
+    double idle_at;		/* when the line is free to send */
+    long errors;
+    long len;
+    unsigned char buf[MODBUS_BUFSIZE];
+};
+
+static VALUE cModbus;
+static VALUE sym_rtu, sym_ascii;
+static unsigned short modbus_crc_table[256];
+
+static void
+init_modbus_crc_table()
+{
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+	unsigned short crc = i;
+
+	for (j = 0; j < 8; j++) {
+	    crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+	modbus_crc_table[i] = crc;
+    }
+}
+
+static unsigned int
+modbus_crc16(crc, p, len)
+    unsigned int crc;
+    const unsigned char *p;
+    long len;
+{
+    while (len-- > 0) {
+	crc = (crc >> 8) ^ modbus_crc_table[(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+static unsigned int
+modbus_lrc(p, len)
+    const unsigned char *p;
+    long len;
+{
+    unsigned int sum = 0;
+
+    while (len-- > 0) {
+	sum += *p++;
+    }
+    return (-sum) & 0xff;
+}
+
+static void
+modbus_mark(ptr)
+    void *ptr;
+{
+    rb_gc_mark(((struct modbus *)ptr)->io);
+}
+
+static const rb_data_type_t modbus_type = {
+    "Termios::Modbus",
+    {modbus_mark, RUBY_TYPED_DEFAULT_FREE, 0,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+modbus_alloc(klass)
+    VALUE klass;
+{
+    struct modbus *mb;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct(klass, struct modbus, &modbus_type, mb);
+    mb->io = Qnil;
+
+    return obj;
+}
+
+static struct modbus *
+get_modbus(self)
+    VALUE self;
+{
+    struct modbus *mb;
+
+    TypedData_Get_Struct(self, struct modbus, &modbus_type, mb);
+    if (NIL_P(mb->io)) {
+	rb_raise(rb_eArgError, "uninitialized Modbus framer");
+    }
+    return mb;
+}
+
+/*
+ * Returns the length of the ADU of unit and pdu, and writes it to dst
+ * unless dst is NULL.
+ */
+static long
+modbus_encode(ascii, unit, pdu, len, dst)
+    int ascii;
+    unsigned int unit;
+    const unsigned char *pdu;
+    long len;
+    unsigned char *dst;
+{
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned int check;
+    long i, n;
+
+    if (!ascii) {
+	if (dst) {
+	    dst[0] = unit;
+	    memcpy(dst + 1, pdu, len);
+	    check = modbus_crc16(0xFFFF, dst, len + 1);
+	    dst[len + 1] = check & 0xff;
+	    dst[len + 2] = check >> 8;
+	}
+	return len + 3;
+    }
+
+    n = 1 + 2 * (len + 2) + 2;
+    if (dst) {
+	check = (modbus_lrc(pdu, len) - unit) & 0xff;
+	*dst++ = ':';
+	*dst++ = hex[unit >> 4];
+	*dst++ = hex[unit & 15];
+	for (i = 0; i < len; i++) {
+	    *dst++ = hex[pdu[i] >> 4];
+	    *dst++ = hex[pdu[i] & 15];
+	}
+	*dst++ = hex[check >> 4];
+	*dst++ = hex[check & 15];
+	*dst++ = '\r';
+	*dst++ = '\n';
+    }
+    return n;
+}
+
+static int
+modbus_hex(c)
+    int c;
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+/*
+ * Decodes the ASCII frame between ':' and CRLF at src into dst, which
+ * has room for MODBUS_RTU_MAX bytes, and returns the length of unit and PDU, or -1 if it is malformed or the
+ * LRC does not check.
+ */
+static long
+modbus_decode_ascii(src, len, dst)
+    const unsigned char *src;
+    long len;
+    unsigned char *dst;
+{
+    long i, n = len / 2;
+
+    if (len % 2 != 0 || n < 3 || n > MODBUS_RTU_MAX) {
+	return -1;
+    }
+    for (i = 0; i < n; i++) {
+	int hi = modbus_hex(src[2 * i]), lo = modbus_hex(src[2 * i + 1]);
+
+	if (hi < 0 || lo < 0) {
+	    return -1;
+	}
+	dst[i] = hi << 4 | lo;
+    }
+    if (modbus_lrc(dst, n) != 0) {	/* the LRC makes the sum zero */
+	return -1;
+    }
+    return n - 1;
+}
+
+static void
+modbus_timing(mb, fd)
+    struct modbus *mb;
+    int fd;
+{
+    struct termios t;
+    speed_t speed;
+
+    if (tcgetattr(fd, &t) < 0) {
+	rb_sys_fail("tcgetattr");
+    }
+    speed = cfgetispeed(&t);
+    mb->char_time = termios_char_time(speed, t.c_cflag);
+    if (mb->char_time == 0.0 || termios_speed_to_bps(speed) > 19200) {
+	/* fixed values of the specification for high speeds */
+	mb->t35 = 0.00175;
+	mb->t15 = 0.00075;
+    }
+    else {
+	mb->t35 = 3.5 * mb->char_time;
+	mb->t15 = 1.5 * mb->char_time;
+    }
+}
+
+/*
+ * call-seq:
+ *   Termios::Modbus.new(io, mode = :rtu)
+ *
+ * Creates a framer for the serial port io in mode :rtu or :ascii.  The
+ * timing is taken from the termios of io; call Termios::Modbus#refresh
+ * after changing its speed.
+ */
+static VALUE
+modbus_initialize(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    struct modbus *mb;
+    VALUE io, mode;
+
+    TypedData_Get_Struct(self, struct modbus, &modbus_type, mb);
+    rb_scan_args(argc, argv, "11", &io, &mode);
+    if (NIL_P(mode) || mode == sym_rtu) {
+	mb->ascii = 0;
+    }
+    else if (mode == sym_ascii) {
+	mb->ascii = 1;
+    }
+    else {
+	rb_raise(rb_eArgError, "unknown mode %"PRIsVALUE, rb_inspect(mode));
+    }
+    modbus_timing(mb, termios_io_fileno(io));
+    mb->io = io;
+    mb->len = 0;
+    mb->errors = 0;
+    mb->idle_at = 0.0;
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   modbus.refresh
+ *
+ * Reads the speed and character format of the port again.
+ */
+static VALUE
+modbus_refresh(self)
+    VALUE self;
+{
+    struct modbus *mb = get_modbus(self);
+
+    modbus_timing(mb, termios_io_fileno(mb->io));
+    return self;
+}
+
+/*
+ * call-seq:
+ *   Termios::Modbus.crc16(str)
+ *
+ * Returns the Modbus CRC-16 of str.
+ */
+static VALUE
+modbus_s_crc16(obj, str)
+    VALUE obj, str;
+{
+    StringValue(str);
+    return UINT2NUM(modbus_crc16(0xFFFF, (unsigned char *)RSTRING_PTR(str),
+				 RSTRING_LEN(str)));
+}
+
+/*
+ * call-seq:
+ *   Termios::Modbus.lrc(str)
+ *
+ * Returns the Modbus ASCII LRC of str.
+ */
+static VALUE
+modbus_s_lrc(obj, str)
+    VALUE obj, str;
+{
+    StringValue(str);
+    return UINT2NUM(modbus_lrc((unsigned char *)RSTRING_PTR(str),
+			       RSTRING_LEN(str)));
+}
+
+/*
+ * Checks unit and pdu and returns the length of their frame.  They are
+ * replaced with the Integer and String they convert to, which are what
+ * must be encoded.
+ */
+static long
+modbus_check_pdu(mb, unit, pdu)
+    struct modbus *mb;
+    VALUE *unit, *pdu;
+{
+    unsigned int u = NUM2UINT(*unit);
+
+    StringValue(*pdu);
+    if (u > 255) {
+	rb_raise(rb_eArgError, "unit %u out of range", u);
+    }
+    if (RSTRING_LEN(*pdu) < 1 || RSTRING_LEN(*pdu) > MODBUS_RTU_MAX - 3) {
+	rb_raise(rb_eArgError, "PDU of %ld bytes", RSTRING_LEN(*pdu));
+    }
+    *unit = UINT2NUM(u);
+    return modbus_encode(mb->ascii, u, NULL, RSTRING_LEN(*pdu), NULL);
+}
+
+/*
+ * call-seq:
+ *   modbus.encode(unit, pdu)
+ *
+ * Returns the frame of pdu, a String starting with the function code,
+ * for the unit address unit: with a CRC-16 in RTU mode, or in hex with
+ * an LRC, ':' and CRLF in ASCII mode.
+ */
+static VALUE
+modbus_encode_m(self, unit, pdu)
+    VALUE self, unit, pdu;
+{
+    struct modbus *mb = get_modbus(self);
+    long n = modbus_check_pdu(mb, &unit, &pdu);
+    VALUE frame = rb_str_new(0, n);
+
+    modbus_encode(mb->ascii, NUM2UINT(unit),
+		  (unsigned char *)RSTRING_PTR(pdu), RSTRING_LEN(pdu),
+		  (unsigned char *)RSTRING_PTR(frame));
+    return frame;
+}
+
+/*
+ * call-seq:
+ *   modbus.decode(frame)
+ *
+ * Returns [unit, pdu] of a frame, or nil if it is malformed or its check
+ * does not match.
+ */
+static VALUE
+modbus_decode_m(self, frame)
+    VALUE self, frame;
+{
+    struct modbus *mb = get_modbus(self);
+    const unsigned char *p;
+    unsigned char tmp[MODBUS_RTU_MAX];
+    long len;
+
+    StringValue(frame);
+    p = (const unsigned char *)RSTRING_PTR(frame);
+    len = RSTRING_LEN(frame);
+    if (!mb->ascii) {
+	if (len < 4 || len > MODBUS_RTU_MAX || modbus_crc16(0xFFFF, p, len) != 0) {
+	    return Qnil;
+	}
+	return rb_assoc_new(INT2FIX(p[0]), rb_str_new((const char *)p + 1, len - 3));
+    }
+    if (len < 3 || len > MODBUS_ASCII_MAX || p[0] != ':' ||
+	p[len - 2] != '\r' || p[len - 1] != '\n' ||
+	(len = modbus_decode_ascii(p + 1, len - 3, tmp)) < 0) {
+	return Qnil;
+    }
+    return rb_assoc_new(INT2FIX(tmp[0]), rb_str_new((const char *)tmp + 1, len - 1));
+}
+
+struct modbus_write_arg {
+    struct modbus *mb;
+    int fd;
+    const unsigned char *buf;
+    const long *lens;
+    int nframes;
+    int frame;			/* frames written */
+    long off;			/* of the next frame in buf */
+    int err;
+};
+
+static void *
+modbus_write_body(ptr)
+    void *ptr;
+{
+    struct modbus_write_arg *arg = ptr;
+    struct modbus *mb = arg->mb;
+
+    while (arg->frame < arg->nframes) {
+	long len = arg->lens[arg->frame];
+	double now = termios_monotonic();
+
+	if (!mb->ascii && mb->idle_at > now) {
+	    if (termios_nap(mb->idle_at - now) < 0) {
+		arg->err = errno;
+		break;
+	    }
+	}
+	if (termios_write_full(arg->fd, (const char *)arg->buf + arg->off, len) < len) {
+	    arg->err = errno;
+	    break;
+	}
+	/* the frame leaves the UART at the line speed, then the gap */
+	mb->idle_at = termios_monotonic() + len * mb->char_time + mb->t35;
+	arg->off += len;
+	arg->frame++;
+    }
+    return NULL;
+}
+
+/*
+ * call-seq:
+ *   modbus.write_frames(frames)
+ *
+ * Sends frames, an array of [unit, pdu] pairs, in one native call,
+ * keeping 3.5 character times of silence before each RTU frame.  Returns
+ * the number of frames.
+ */
+static VALUE
+modbus_write_frames(self, frames)
+    VALUE self, frames;
+{
+    struct modbus *mb = get_modbus(self);
+    struct modbus_write_arg arg;
+    VALUE buf, lens, checked;
+    long i, total = 0, n;
+
+    Check_Type(frames, T_ARRAY);
+    n = RARRAY_LEN(frames);
+    lens = rb_str_tmp_new(n * sizeof(long));
+    /* the converted pairs, as to_ary and to_str may return anything */
+    checked = rb_ary_new2(n);
+    for (i = 0; i < n; i++) {
+	VALUE f = rb_check_array_type(rb_ary_entry(frames, i));
+	VALUE unit, pdu;
+
+	if (NIL_P(f) || RARRAY_LEN(f) != 2) {
+	    rb_raise(rb_eArgError, "frame must be [unit, pdu]");
+	}
+	unit = RARRAY_AREF(f, 0);
+	pdu = RARRAY_AREF(f, 1);
+	((long *)RSTRING_PTR(lens))[i] = modbus_check_pdu(mb, &unit, &pdu);
+	total += ((long *)RSTRING_PTR(lens))[i];
+	rb_ary_push(checked, rb_assoc_new(unit, pdu));
+    }
+    buf = rb_str_tmp_new(total);
+    for (i = 0, total = 0; i < n; i++) {
+	VALUE f = RARRAY_AREF(checked, i);
+	VALUE pdu = RARRAY_AREF(f, 1);
+
+	total += modbus_encode(mb->ascii, NUM2UINT(RARRAY_AREF(f, 0)),
+			       (unsigned char *)RSTRING_PTR(pdu),
+			       RSTRING_LEN(pdu),
+			       (unsigned char *)RSTRING_PTR(buf) + total);
+    }
+    RB_GC_GUARD(checked);
+
+    memset(&arg, 0, sizeof(arg));
+    arg.mb = mb;
+    arg.fd = termios_io_fileno(mb->io);
+    arg.buf = (unsigned char *)RSTRING_PTR(buf);
+    arg.lens = (long *)RSTRING_PTR(lens);
+    arg.nframes = (int)n;
+    for (;;) {
+	arg.err = 0;
+	termios_without_gvl(modbus_write_body, &arg, RUBY_UBF_IO, 0);
+	if (arg.err == 0) {
+	    break;
+	}
+	if (arg.err != EINTR) {
+	    rb_syserr_fail(arg.err, "write");
+	}
+	rb_thread_check_ints();
+    }
+    rb_str_resize(buf, 0);
+    rb_str_resize(lens, 0);
+
+    return LONG2NUM(n);
+}
+
+/*
+ * call-seq:
+ *   modbus.write_frame(unit, pdu)
+ *
+ * Sends one frame.
+ */
+static VALUE
+modbus_write_frame(self, unit, pdu)
+    VALUE self, unit, pdu;
+{
+    modbus_write_frames(self, rb_ary_new3(1, rb_assoc_new(unit, pdu)));
+    return self;
+}
+
+struct modbus_read_arg {
+    struct modbus *mb;
+    int fd;
+    unsigned char *out;		/* unit and PDU of each frame */
+    long outlen;
+    long outcap;
+    long *lens;
+    int max;
+    int nframes;
+    double deadline;		/* < 0: wait for the first frame */
+    int err;
+};
+
+static int
+modbus_emit(arg, p, len)
+    struct modbus_read_arg *arg;
+    const unsigned char *p;
+    long len;
+{
+    if (len < 1 || arg->nframes >= arg->max || len > arg->outcap - arg->outlen) {
+	arg->mb->errors++;
+	return 0;
+    }
+    memcpy(arg->out + arg->outlen, p, len);
+    arg->outlen += len;
+    arg->lens[arg->nframes++] = len;
+    return arg->nframes < arg->max;
+}
+
+static void
+modbus_consume(mb, n)
+    struct modbus *mb;
+    long n;
+{
+    memmove(mb->buf, mb->buf + n, mb->len - n);
+    mb->len -= n;
+}
+
+/*
+ * Sets reach[pos] for pos from the end of the buffer down to from to how
+ * far the chain of frames from pos which covers the most bytes gets, and
+ * next[pos] to the end of its first frame (0 if there is none).
+ */
+static void
+modbus_best_chain(mb, from, reach, next)
+    struct modbus *mb;
+    long from;
+    short *reach, *next;
+{
+    long pos, len = mb->len;
+
+    reach[len] = len;
+    for (pos = len - 1; pos >= from; pos--) {
+	unsigned int crc = 0xFFFF;
+	long k;
+
+	reach[pos] = pos;
+	next[pos] = 0;
+	for (k = pos; k < len && k - pos < MODBUS_RTU_MAX; k++) {
+	    crc = (crc >> 8) ^ modbus_crc_table[(crc ^ mb->buf[k]) & 0xff];
+	    if (crc == 0 && k + 1 - pos >= 4 && reach[k + 1] > reach[pos]) {
+		reach[pos] = reach[k + 1];
+		next[pos] = k + 1;
+	    }
+	}
+    }
+}
+
+/*
+ * Takes the RTU frames out of the buffer.  Unless the line fell silent,
+ * only a buffer whose CRC checks as a whole is a frame.  Otherwise the
+ * buffer is split where the running CRC reaches zero, which is where a
+ * frame with its CRC appended ends.  That also happens by chance inside
+ * a frame, after which the split goes astray; so from the last split on,
+ * the chain of frames covering the most bytes is looked for.  At
+ * silence, or when the bytes cannot be the start of one frame, bytes
+ * before and after the chain are dropped.
+ */
+static void
+modbus_extract_rtu(arg, silence)
+    struct modbus_read_arg *arg;
+    int silence;
+{
+    struct modbus *mb = arg->mb;
+    short reach[MODBUS_BUFSIZE + 1], next[MODBUS_BUFSIZE + 1];
+    long k, pos, last, start, end, len = mb->len;
+    unsigned int crc;
+
+    if (len >= 4 && len <= MODBUS_RTU_MAX &&
+	modbus_crc16(0xFFFF, mb->buf, len) == 0) {
+	modbus_emit(arg, mb->buf, len - 2);
+	mb->len = 0;
+	return;
+    }
+    if (!silence && len <= MODBUS_RTU_MAX) {
+	return;
+    }
+
+    last = pos = 0;
+    crc = 0xFFFF;
+    for (k = 0; k < len && k - pos < MODBUS_RTU_MAX; k++) {
+	crc = (crc >> 8) ^ modbus_crc_table[(crc ^ mb->buf[k]) & 0xff];
+	if (crc == 0 && k + 1 - pos >= 4) {
+	    next[pos] = k + 1;
+	    last = pos;
+	    pos = k + 1;
+	    crc = 0xFFFF;
+	}
+    }
+    end = pos;
+    if (end < len) {
+	modbus_best_chain(mb, last, reach, next);
+	if (reach[last] > end) {
+	    end = reach[last];
+	}
+    }
+
+    start = 0;
+    if (end == 0) {
+	/* lost sync: resume at the chain that gets furthest */
+	for (pos = 1; pos < len; pos++) {
+	    if (next[pos] != 0 && (start == 0 || reach[pos] > reach[start])) {
+		start = pos;
+	    }
+	}
+	if (start == 0) {
+	    if (silence || len > MODBUS_RTU_MAX) {
+		mb->errors++;
+		modbus_consume(mb, silence ? len : len - MODBUS_RTU_MAX);
+	    }
+	    return;
+	}
+	mb->errors++;
+	end = reach[start];
+    }
+    for (pos = start; pos < end && arg->nframes < arg->max; pos = next[pos]) {
+	if (next[pos] <= pos) {
+	    break;
+	}
+	modbus_emit(arg, mb->buf + pos, next[pos] - pos - 2);
+    }
+    if (silence && pos == end && pos < len) {
+	mb->errors++;
+	pos = len;
+    }
+    modbus_consume(mb, pos);
+}
+
+/*
+ * Takes the ASCII frames, ':' to CRLF, out of the buffer.  At silence an
+ * unfinished frame is dropped.
+ */
+static void
+modbus_extract_ascii(arg, silence)
+    struct modbus_read_arg *arg;
+    int silence;
+{
+    struct modbus *mb = arg->mb;
+    unsigned char tmp[MODBUS_RTU_MAX];
+
+    while (mb->len > 0 && arg->nframes < arg->max) {
+	unsigned char *colon = memchr(mb->buf, ':', mb->len);
+	long i, n;
+
+	if (colon == NULL) {
+	    mb->errors++;
+	    mb->len = 0;
+	    break;
+	}
+	if (colon != mb->buf) {
+	    mb->errors++;
+	    modbus_consume(mb, colon - mb->buf);
+	}
+	for (i = 1; i + 1 < mb->len; i++) {
+	    if (mb->buf[i] == '\r' && mb->buf[i + 1] == '\n') {
+		break;
+	    }
+	}
+	if (i + 1 >= mb->len) {
+	    if (silence || mb->len > MODBUS_ASCII_MAX) {
+		mb->errors++;
+		mb->len = 0;
+	    }
+	    break;
+	}
+	n = modbus_decode_ascii(mb->buf + 1, i - 1, tmp);
+	if (n < 0) {
+	    mb->errors++;
+	}
+	else {
+	    modbus_emit(arg, tmp, n);
+	}
+	modbus_consume(mb, i + 2);
+    }
+}
+
+static void
+modbus_extract(arg, silence)
+    struct modbus_read_arg *arg;
+    int silence;
+{
+    if (arg->mb->ascii) {
+	modbus_extract_ascii(arg, silence);
+    }
+    else {
+	modbus_extract_rtu(arg, silence);
+    }
+}
+
+static void *
+modbus_read_body(ptr)
+    void *ptr;
+{
+    struct modbus_read_arg *arg = ptr;
+    struct modbus *mb = arg->mb;
+
+    modbus_extract(arg, 0);
+    while (arg->nframes < arg->max) {
+	struct pollfd pfd;
+	double gap = mb->ascii ? MODBUS_ASCII_TIMEOUT : mb->t35;
+	double wait = -1.0;
+	int silence = 0, timeout;
+	ssize_t n;
+
+	if (arg->nframes > 0) {
+	    wait = 0.0;		/* only what is already there */
+	}
+	else if (mb->len > 0) {
+	    wait = gap;
+	    silence = 1;
+	}
+	if (arg->deadline >= 0 && arg->nframes == 0) {
+	    double left = arg->deadline - termios_monotonic();
+
+	    if (left <= 0.0) {
+		break;
+	    }
+	    if (wait < 0 || left < wait) {
+		wait = left;
+		silence = 0;
+	    }
+	}
+	timeout = wait < 0 ? -1 : (int)(wait * 1000.0 + 0.999);
+	pfd.fd = arg->fd;
+	pfd.events = POLLIN;
+	n = poll(&pfd, 1, timeout);
+	if (n < 0) {
+	    arg->err = errno;
+	    break;
+	}
+	if (n == 0) {
+	    if (silence) {
+		modbus_extract(arg, 1);
+		continue;
+	    }
+	    if (arg->nframes > 0) {
+		break;
+	    }
+	    continue;
+	}
+	n = read(arg->fd, mb->buf + mb->len, MODBUS_BUFSIZE - mb->len);
+	if (n < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		continue;
+	    }
+	    arg->err = errno;
+	    break;
+	}
+	if (n == 0) {
+	    break;
+	}
+	mb->len += n;
+	/* a master waits for the silence after a reply before sending */
+	mb->idle_at = termios_monotonic() + mb->t35;
+	modbus_extract(arg, 0);
+    }
+    return NULL;
+}
+
+/*
+ * call-seq:
+ *   modbus.read_frames(max = 16, timeout: nil)
+ *
+ * Reads frames from the port and returns them as an array of [unit,
+ * pdu] pairs.  Frames whose CRC or LRC does not check are dropped.
+ *
+ * Without timeout, it waits for the first frame and then returns with
+ * the frames which are complete without waiting.  With timeout, it
+ * returns an empty array if no frame arrives within timeout seconds.  It
+ * also returns at end of file.
+ */
+static VALUE
+modbus_read_frames(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    static ID keywords[1];
+    struct modbus *mb = get_modbus(self);
+    struct modbus_read_arg arg;
+    VALUE max, opts, kw[1], out, result;
+    long i, off;
+
+    rb_scan_args(argc, argv, "01:", &max, &opts);
+    kw[0] = Qundef;
+    if (!NIL_P(opts)) {
+	if (!keywords[0]) {
+	    keywords[0] = rb_intern("timeout");
+	}
+	rb_get_kwargs(opts, keywords, 0, 1, kw);
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.mb = mb;
+    arg.fd = termios_io_fileno(mb->io);
+    arg.max = NIL_P(max) ? 16 : NUM2INT(max);
+    if (arg.max <= 0) {
+	rb_raise(rb_eArgError, "max must be positive");
+    }
+    arg.deadline = -1.0;
+    if (kw[0] != Qundef && !NIL_P(kw[0])) {
+	arg.deadline = termios_monotonic() + NUM2DBL(kw[0]);
+    }
+    out = rb_str_tmp_new((long)arg.max * (MODBUS_RTU_MAX + sizeof(long)));
+    arg.lens = (long *)RSTRING_PTR(out);
+    arg.out = (unsigned char *)(arg.lens + arg.max);
+    arg.outcap = (long)arg.max * MODBUS_RTU_MAX;
+
+    for (;;) {
+	arg.err = 0;
+	termios_without_gvl(modbus_read_body, &arg, RUBY_UBF_IO, 0);
+	if (arg.err == 0) {
+	    break;
+	}
+	if (arg.err != EINTR) {
+	    rb_syserr_fail(arg.err, "read");
+	}
+	rb_thread_check_ints();
+    }
+
+    result = rb_ary_new2(arg.nframes);
+    for (i = 0, off = 0; i < arg.nframes; i++) {
+	rb_ary_push(result,
+		    rb_assoc_new(INT2FIX(arg.out[off]),
+				 rb_str_new((const char *)arg.out + off + 1,
+					    arg.lens[i] - 1)));
+	off += arg.lens[i];
+    }
+    rb_str_resize(out, 0);
+
+    return result;
+}
+
+/*
+ * call-seq:
+ *   modbus.t35
+ *   modbus.t15
+ *
+ * Returns the inter-frame and inter-character times in seconds.
+ */
+static VALUE
+modbus_t35(self)
+    VALUE self;
+{
+    return DBL2NUM(get_modbus(self)->t35);
+}
+
+static VALUE
+modbus_t15(self)
+    VALUE self;
+{
+    return DBL2NUM(get_modbus(self)->t15);
+}
+
+/*
+ * call-seq:
+ *   modbus.errors
+ *
+ * Returns the number of frames dropped because they were malformed or
+ * their check did not match.
+ */
+static VALUE
+modbus_errors(self)
+    VALUE self;
+{
+    return LONG2NUM(get_modbus(self)->errors);
+}
+
+/*
+ * call-seq:
+ *   modbus.mode
+ *
+ * Returns :rtu or :ascii.
+ */
+static VALUE
+modbus_mode(self)
+    VALUE self;
+{
+    return get_modbus(self)->ascii ? sym_ascii : sym_rtu;
+}
+
+/*
+ * call-seq:
+ *   modbus.io
+ *
+ * Returns the port.
+ */
+static VALUE
+modbus_io(self)
+    VALUE self;
+{
+    return get_modbus(self)->io;
+}
+
+/*
+ * Document-class: Termios::Broadcaster
+ *
+ * Shares the output of a pseudo terminal master among any number of
+ * readers.  One thread reads the master without the GVL into a ring
+ * buffer, and each Termios::Broadcaster::Subscriber reads the ring at
+ * its own cursor, so a chunk is read and stored once whatever the number
+ * of subscribers, and a subscriber which passes a buffer to
+ * Termios::Broadcaster::Subscriber#read allocates nothing.  Data written
+ * by any subscriber goes to the master, one write at a time.
+ *
+ *   require 'termios'
+ *
+ *   bc = Termios::Broadcaster.new(master, capacity: 1 << 20)
+ *   tabs.each {|ws|
+ *     sub = bc.subscribe
+ *     Thread.new { buf = String.new; ws.send(buf) while sub.read(nil, buf) }
+ *     ws.on_message {|data| sub.write(data) }
+ *   }
+ *
+ * A subscriber which falls behind by more than the capacity of the ring
+ * has lost data.  With policy :resync its cursor is moved to the oldest
+ * data left in the ring and the bytes skipped are counted in
+ * Termios::Broadcaster::Subscriber#lost; with policy :drop the subscriber
+ * is closed.  The reader thread never waits for a subscriber.
+ */
+
+#define BROADCASTER_CHUNK	4096
+#define BROADCASTER_MIN_CAPACITY BROADCASTER_CHUNK
+
+struct broadcaster {
+    VALUE io;
+    VALUE thread;
+    VALUE write_lock;
+    int fd;
+    int drop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char *ring;
+    size_t capacity;		/* a power of two */
+    uint64_t head;		/* bytes read from the master so far */
+    int eof;
+    int err;
+    int closed;
+    char chunk[BROADCASTER_CHUNK];
+};
+
+struct broadcast_subscriber {
+    VALUE broadcaster;
+    uint64_t cursor;
+    uint64_t lost;
+    int closed;
+};
+
+struct broadcaster_pump_arg {
+    struct broadcaster *bc;
+    ssize_t n;
+    int err;
+};
+
+struct broadcaster_wait_arg {
+    struct broadcaster *bc;
+    struct broadcast_subscriber *sub;
+    double deadline;		/* realtime; 0 waits without a limit */
+    int interrupted;
+};
+
+struct broadcaster_write_arg {
+    int fd;
+    const char *buf;
+    long len;
+    long done;
+    int err;
+};
+
+static VALUE cBroadcaster, cBroadcastSubscriber;
+static VALUE sym_drop, sym_resync;
+
+static void
+broadcaster_mark(ptr)
+    void *ptr;
+{
+    struct broadcaster *bc = ptr;
+
+    rb_gc_mark(bc->io);
+    rb_gc_mark(bc->thread);
+    rb_gc_mark(bc->write_lock);
+}
+
+static void
+broadcaster_free(ptr)
+    void *ptr;
+{
+    struct broadcaster *bc = ptr;
+
+    pthread_mutex_destroy(&bc->lock);
+    pthread_cond_destroy(&bc->cond);
+    xfree(bc->ring);
+    xfree(bc);
+}
+
+static const rb_data_type_t broadcaster_type = {
+    "Termios::Broadcaster",
+    {broadcaster_mark, broadcaster_free, 0,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+broadcaster_alloc(klass)
+    VALUE klass;
+{
+    struct broadcaster *bc;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct(klass, struct broadcaster, &broadcaster_type, bc);
+    bc->io = Qnil;
+    bc->thread = Qnil;
+    bc->write_lock = Qnil;
+    bc->fd = -1;
+    pthread_mutex_init(&bc->lock, NULL);
+    pthread_cond_init(&bc->cond, NULL);
+
+    return obj;
+}
+
+static struct broadcaster *
+get_broadcaster(self)
+    VALUE self;
+{
+    struct broadcaster *bc;
+
+    TypedData_Get_Struct(self, struct broadcaster, &broadcaster_type, bc);
+    if (!bc->ring) {
+	rb_raise(rb_eArgError, "uninitialized Broadcaster");
+    }
+    return bc;
+}
+
+static void *
+broadcaster_pump_body(ptr)
+    void *ptr;
+{
+    struct broadcaster_pump_arg *arg = ptr;
+    struct broadcaster *bc = arg->bc;
+    struct pollfd pfd;
+
+    pfd.fd = bc->fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) < 0) {
+	arg->err = errno;
+	return NULL;
+    }
+    arg->n = read(bc->fd, bc->chunk, sizeof(bc->chunk));
+    if (arg->n < 0) {
+	arg->err = errno;
+    }
+    return NULL;
+}
+
+/*
+ * Copies len bytes of data to the ring at the head.  The caller must hold
+ * bc->lock.
+ */
+static void
+broadcaster_store(bc, data, len)
+    struct broadcaster *bc;
+    const char *data;
+    size_t len;
+{
+    size_t at = (size_t)(bc->head & (bc->capacity - 1));
+    size_t n = bc->capacity - at < len ? bc->capacity - at : len;
+
+    memcpy(bc->ring + at, data, n);
+    memcpy(bc->ring, data + n, len - n);
+    bc->head += len;
+}
+
+static VALUE
+broadcaster_pump(ptr)
+    void *ptr;
+{
+    VALUE self = (VALUE)ptr;
+    struct broadcaster *bc = get_broadcaster(self);
+    struct broadcaster_pump_arg arg;
+
+    arg.bc = bc;
+    for (;;) {
+	arg.n = 0;
+	arg.err = 0;
+	termios_without_gvl(broadcaster_pump_body, &arg, RUBY_UBF_IO, 0);
+	if (arg.err == EINTR || arg.err == EAGAIN || arg.err == EWOULDBLOCK) {
+	    rb_thread_check_ints();
+	    continue;
+	}
+	pthread_mutex_lock(&bc->lock);
+	if (arg.n > 0) {
+	    broadcaster_store(bc, bc->chunk, (size_t)arg.n);
+	}
+	else {
+	    /* a master reads EIO once the last slave is closed */
+	    bc->eof = 1;
+	    bc->err = arg.err == EIO ? 0 : arg.err;
+	}
+	pthread_cond_broadcast(&bc->cond);
+	pthread_mutex_unlock(&bc->lock);
+	if (bc->eof) {
+	    break;
+	}
+    }
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   Termios::Broadcaster.new(master, capacity: 65536, policy: :resync)
+ *
+ * Starts a thread which reads master into a ring of capacity bytes,
+ * rounded up to a power of two.  policy is :resync or :drop and tells
+ * what happens to a subscriber which falls behind by more than the ring.
+ */
+static VALUE
+broadcaster_initialize(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
+{
+    static ID keywords[2];
+    struct broadcaster *bc;
+    VALUE io, opts, kw[2];
+    size_t capacity = 65536, want;
+
+    rb_scan_args(argc, argv, "1:", &io, &opts);
+    kw[0] = kw[1] = Qundef;
+    if (!NIL_P(opts)) {
+	if (!keywords[0]) {
+	    keywords[0] = rb_intern("capacity");
+	    keywords[1] = rb_intern("policy");
+	}
+	rb_get_kwargs(opts, keywords, 0, 2, kw);
+    }
+
+    TypedData_Get_Struct(self, struct broadcaster, &broadcaster_type, bc);
+    if (bc->ring) {
+	rb_raise(rb_eArgError, "Broadcaster already initialized");
+    }
+    if (kw[0] != Qundef && !NIL_P(kw[0])) {
+	want = NUM2SIZET(kw[0]);
+	if (want < BROADCASTER_MIN_CAPACITY) {
+	    rb_raise(rb_eArgError, "capacity must be at least %d bytes",
+		     BROADCASTER_MIN_CAPACITY);
+	}
+	if (want > ((size_t)1 << 30)) {
+	    rb_raise(rb_eArgError, "capacity too large");
+	}
+	for (capacity = BROADCASTER_MIN_CAPACITY; capacity < want; capacity <<= 1)
+	    ;
+    }
+    if (kw[1] == Qundef || NIL_P(kw[1]) || kw[1] == sym_resync) {
+	bc->drop = 0;
+    }
+    else if (kw[1] == sym_drop) {
+	bc->drop = 1;
+    }
+    else {
+	rb_raise(rb_eArgError, "policy must be :resync or :drop");
+    }
+
+    bc->fd = termios_io_fileno(io);
+    bc->io = io;
+    bc->write_lock = rb_mutex_new();
+    bc->ring = ALLOC_N(unsigned char, capacity);
+    bc->capacity = capacity;
+    bc->thread = rb_thread_create(broadcaster_pump, (void *)self);
+    rb_ivar_set(bc->thread, rb_intern("__termios_broadcaster__"), self);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   broadcaster.subscribe
+ *
+ * Returns a new Termios::Broadcaster::Subscriber which reads from the
+ * data read next.
+ */
+static VALUE
+broadcaster_subscribe(self)
+    VALUE self;
+{
+    get_broadcaster(self);
+    return rb_class_new_instance(1, &self, cBroadcastSubscriber);
+}
+
+static void *
+broadcaster_write_body(ptr)
+    void *ptr;
+{
+    struct broadcaster_write_arg *arg = ptr;
+
+    arg->done += termios_write_full(arg->fd, arg->buf + arg->done,
+				    arg->len - arg->done);
+    if (arg->done < arg->len) {
+	arg->err = errno;
+    }
+    return NULL;
+}
+
+static VALUE
+broadcaster_write_locked(data)
+    VALUE data;
+{
+    struct broadcaster_write_arg *arg = (struct broadcaster_write_arg *)data;
+
+    while (arg->done < arg->len) {
+	arg->err = 0;
+	termios_without_gvl(broadcaster_write_body, arg, RUBY_UBF_IO, 0);
+	if (arg->err == EINTR) {
+	    rb_thread_check_ints();
+	}
+	else if (arg->err) {
+	    rb_syserr_fail(arg->err, "write");
+	}
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   broadcaster.write(str)
+ *
+ * Writes str to the master.  Writes from several threads are not
+ * interleaved.  Returns the number of bytes written.
+ */
+static VALUE
+broadcaster_write(self, str)
+    VALUE self, str;
+{
+    struct broadcaster *bc = get_broadcaster(self);
+    struct broadcaster_write_arg arg;
+
+    StringValue(str);
+    str = rb_str_new_frozen(str);
+    arg.fd = bc->fd;
+    arg.buf = RSTRING_PTR(str);
+    arg.len = RSTRING_LEN(str);
+    arg.done = 0;
+    rb_mutex_synchronize(bc->write_lock, broadcaster_write_locked, (VALUE)&arg);
+    RB_GC_GUARD(str);
+
+    return LONG2NUM(arg.done);
+}
+
+/*
+ * call-seq:
+ *   broadcaster.close
+ *
+ * Stops the reader thread.  Subscribers read the data left in the ring
+ * and then nil.  The master is not closed.
+ */
+static VALUE
+broadcaster_close(self)
+    VALUE self;
+{
+    struct broadcaster *bc = get_broadcaster(self);
+
+    pthread_mutex_lock(&bc->lock);
+    bc->closed = 1;
+    pthread_cond_broadcast(&bc->cond);
+    pthread_mutex_unlock(&bc->lock);
+    if (!NIL_P(bc->thread) && bc->thread != rb_thread_current()) {
+	rb_funcall(bc->thread, rb_intern("kill"), 0);
+	rb_funcall(bc->thread, rb_intern("join"), 0);
+    }
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   broadcaster.closed?
+ *
+ * Returns true once the broadcaster is closed or the master reached the
+ * end of file.
+ */
+static VALUE
+broadcaster_closed_p(self)
+    VALUE self;
+{
+    struct broadcaster *bc = get_broadcaster(self);
+
+    return (bc->closed || bc->eof) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   broadcaster.position
+ *
+ * Returns the number of bytes read from the master so far.
+ */
+static VALUE
+broadcaster_position(self)
+    VALUE self;
+{
+    struct broadcaster *bc = get_broadcaster(self);
+    uint64_t head;
+
+    pthread_mutex_lock(&bc->lock);
+    head = bc->head;
+    pthread_mutex_unlock(&bc->lock);
+
+    return ULL2NUM(head);
+}
+
+/*
+ * call-seq:
+ *   broadcaster.capacity
+ *
+ * Returns the size of the ring in bytes.
+ */
+static VALUE
+broadcaster_capacity(self)
+    VALUE self;
+{
+    return SIZET2NUM(get_broadcaster(self)->capacity);
+}
+
+/*
+ * call-seq:
+ *   broadcaster.policy
+ *
+ * Returns :resync or :drop.
+ */
+static VALUE
+broadcaster_policy(self)
+    VALUE self;
+{
+    return get_broadcaster(self)->drop ? sym_drop : sym_resync;
 }
 
 /*
  * call-seq:
- *   Termios.tcsendbreak(io, duration)
- *   io.tcsendbreak(duration)
+ *   broadcaster.io
  *
- * Sends a continuous stream of 0-bits for a specific duration.
- *
- * See also: tcsendbreak(3)
+ * Returns the master.
  */
 static VALUE
-termios_tcsendbreak(io, duration)
-    VALUE io, duration;
+broadcaster_io(self)
+    VALUE self;
 {
-    OpenFile *fptr;
-
-    Check_Type(io,       T_FILE);
-    Check_Type(duration, T_FIXNUM);
+    return get_broadcaster(self)->io;
+}
 
-    GetOpenFile(io, fptr);
-    if (tcsendbreak(FILENO(fptr), FIX2INT(duration)) < 0) {
-        rb_sys_fail("tcsendbreak");
-    }
+/*
+ * Document-class: Termios::Broadcaster::Subscriber
+ *
+ * A cursor into the ring of a Termios::Broadcaster, made by
+ * Termios::Broadcaster#subscribe.  A subscriber must not be read by two
+ * threads at once; each thread should subscribe on its own.
+ */
 
-    return Qtrue;
+static void
+broadcast_subscriber_mark(ptr)
+    void *ptr;
+{
+    rb_gc_mark(((struct broadcast_subscriber *)ptr)->broadcaster);
 }
 
+static const rb_data_type_t broadcast_subscriber_type = {
+    "Termios::Broadcaster::Subscriber",
+    {broadcast_subscriber_mark, RUBY_TYPED_DEFAULT_FREE, 0,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
 static VALUE
-termios_s_tcsendbreak(obj, io, duration)
-    VALUE obj, io, duration;
+broadcast_subscriber_alloc(klass)
+    VALUE klass;
 {
-    return termios_tcsendbreak(io, duration);
+    struct broadcast_subscriber *sub;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct(klass, struct broadcast_subscriber,
+				&broadcast_subscriber_type, sub);
+    sub->broadcaster = Qnil;
+
+    return obj;
+}
+
+static struct broadcast_subscriber *
+get_broadcast_subscriber(self)
+    VALUE self;
+{
+    struct broadcast_subscriber *sub;
+
+    TypedData_Get_Struct(self, struct broadcast_subscriber,
+			 &broadcast_subscriber_type, sub);
+    if (NIL_P(sub->broadcaster)) {
+	rb_raise(rb_eArgError, "uninitialized Subscriber");
+    }
+    return sub;
 }
 
 /*
  * call-seq:
- *   Termios.tcdrain(io)
- *   io.tcdrain
- *
- * Waits until all output to the object has been sent.
+ *   Termios::Broadcaster::Subscriber.new(broadcaster)
  *
- * See also: tcdrain(3)
+ * Same as broadcaster.subscribe.
  */
 static VALUE
-termios_tcdrain(io)
-    VALUE io;
+broadcast_subscriber_initialize(self, broadcaster)
+    VALUE self, broadcaster;
 {
-    OpenFile *fptr;
+    struct broadcast_subscriber *sub;
+    struct broadcaster *bc = get_broadcaster(broadcaster);
 
-    Check_Type(io, T_FILE);
-
-    GetOpenFile(io, fptr);
-    if (tcdrain(FILENO(fptr)) < 0) {
-        rb_sys_fail("tcdrain");
-    }
-
-    return Qtrue;
-}
+    TypedData_Get_Struct(self, struct broadcast_subscriber,
+			 &broadcast_subscriber_type, sub);
+    pthread_mutex_lock(&bc->lock);
+    sub->cursor = bc->head;
+    pthread_mutex_unlock(&bc->lock);
+    sub->broadcaster = broadcaster;
 
-static VALUE
-termios_s_tcdrain(obj, io)
-    VALUE obj, io;
-{
-    return termios_tcdrain(io);
+    return self;
 }
 
 /*
- * call-seq:
- *   Termios.tcflush(io, qs)
- *   io.tcflush(qs)
- *
- * Cancels data written to the object but not send or data received but not
- * read.
- *
- * See also: tcflush(3)
+ * Applies the policy to a subscriber lapped by the reader thread.  The
+ * caller must hold bc->lock.
  */
-static VALUE
-termios_tcflush(io, qs)
-    VALUE io, qs;
+static void
+broadcaster_catch_up(bc, sub)
+    struct broadcaster *bc;
+    struct broadcast_subscriber *sub;
 {
-    OpenFile *fptr;
-    int queue_selector;
+    uint64_t oldest = bc->head > bc->capacity ? bc->head - bc->capacity : 0;
 
-    Check_Type(io, T_FILE);
-    Check_Type(qs, T_FIXNUM);
-    queue_selector = FIX2INT(qs);
-    if (rb_ary_includes(tcflush_qs, qs) != Qtrue) {
-	rb_raise(rb_eArgError, 
-		 "wrong queue-selector value %d", queue_selector);
+    if (sub->cursor >= oldest) {
+	return;
     }
-
-    GetOpenFile(io, fptr);
-    if (tcflush(FILENO(fptr), queue_selector) < 0) {
-        rb_sys_fail("tcflush");
+    if (bc->drop) {
+	sub->closed = 1;
+    }
+    else {
+	sub->lost += oldest - sub->cursor;
+	sub->cursor = oldest;
     }
+}
 
-    return Qtrue;
+static void *
+broadcaster_wait_body(ptr)
+    void *ptr;
+{
+    struct broadcaster_wait_arg *arg = ptr;
+    struct broadcaster *bc = arg->bc;
+    struct timespec ts;
+
+    if (arg->deadline > 0.0) {
+	ts.tv_sec = (time_t)arg->deadline;
+	ts.tv_nsec = (long)((arg->deadline - (double)ts.tv_sec) * 1e9);
+    }
+    pthread_mutex_lock(&bc->lock);
+    while (!arg->interrupted && arg->sub->cursor == bc->head &&
+	   !bc->eof && !bc->closed) {
+	if (arg->deadline > 0.0) {
+	    if (pthread_cond_timedwait(&bc->cond, &bc->lock, &ts) == ETIMEDOUT) {
+		break;
+	    }
+	}
+	else {
+	    pthread_cond_wait(&bc->cond, &bc->lock);
+	}
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return NULL;
 }
 
-static VALUE
-termios_s_tcflush(obj, io, qs)
-    VALUE obj, io, qs;
+static void
+broadcaster_wait_ubf(ptr)
+    void *ptr;
 {
-    return termios_tcflush(io, qs);
+    struct broadcaster_wait_arg *arg = ptr;
+
+    pthread_mutex_lock(&arg->bc->lock);
+    arg->interrupted = 1;
+    pthread_cond_broadcast(&arg->bc->cond);
+    pthread_mutex_unlock(&arg->bc->lock);
 }
 
 /*
  * call-seq:
- *   Termios.tcflow(io, action)
- *   io.tcflow(action)
- *
- * Suspends write or read of data on the object.
+ *   subscriber.read(maxlen = nil, buf = nil, timeout: nil)
  *
- * See also: tcflow(3)
+ * Returns the data read from the master since the last call, at most
+ * maxlen bytes of it, waiting without the GVL while there is none.  The
+ * data is stored in buf when it is given.  Returns an empty string when
+ * timeout seconds pass without data, and nil at the end of the data or
+ * once the subscriber is closed or dropped.
  */
 static VALUE
-termios_tcflow(io, act)
-    VALUE io, act;
+broadcast_subscriber_read(argc, argv, self)
+    int argc;
+    VALUE *argv;
+    VALUE self;
 {
-    OpenFile *fptr;
-    int action;
+    static ID keywords[1];
+    struct broadcast_subscriber *sub = get_broadcast_subscriber(self);
+    struct broadcaster *bc = get_broadcaster(sub->broadcaster);
+    struct broadcaster_wait_arg arg;
+    VALUE maxlen, buf, opts, timeout = Qundef;
+    uint64_t avail;
+    size_t at, len, n;
+    long max;
+    int err;
+
+    rb_scan_args(argc, argv, "02:", &maxlen, &buf, &opts);
+    if (!NIL_P(opts)) {
+	if (!keywords[0]) {
+	    keywords[0] = rb_intern("timeout");
+	}
+	rb_get_kwargs(opts, keywords, 0, 1, &timeout);
+    }
+    max = NIL_P(maxlen) ? -1 : NUM2LONG(maxlen);
+    if (!NIL_P(maxlen) && max < 0) {
+	rb_raise(rb_eArgError, "negative length %ld given", max);
+    }
+    if (!NIL_P(buf)) {
+	StringValue(buf);
+	rb_str_modify(buf);
+    }
 
-    Check_Type(io,  T_FILE);
-    Check_Type(act, T_FIXNUM);
-    action = FIX2INT(act);
-    if (rb_ary_includes(tcflow_act, act) != Qtrue) {
-	rb_raise(rb_eArgError, 
-		 "wrong action value %d", action);
+    arg.bc = bc;
+    arg.sub = sub;
+    arg.deadline = 0.0;
+    if (timeout != Qundef && !NIL_P(timeout)) {
+	arg.deadline = termios_realtime_ns() / 1e9 + NUM2DBL(timeout);
     }
 
-    GetOpenFile(io, fptr);
-    if (tcflow(FILENO(fptr), action) < 0) {
-        rb_sys_fail("tcflow");
+    for (;;) {
+	pthread_mutex_lock(&bc->lock);
+	if (!sub->closed) {
+	    broadcaster_catch_up(bc, sub);
+	}
+	if (sub->closed || bc->head != sub->cursor || bc->eof || bc->closed ||
+	    (arg.deadline > 0.0 && termios_realtime_ns() / 1e9 >= arg.deadline)) {
+	    break;		/* with the lock held */
+	}
+	pthread_mutex_unlock(&bc->lock);
+	arg.interrupted = 0;
+	termios_without_gvl(broadcaster_wait_body, &arg,
+			    broadcaster_wait_ubf, &arg);
+	rb_thread_check_ints();
     }
 
-    return Qtrue;
+    avail = sub->closed ? 0 : bc->head - sub->cursor;
+    if (avail == 0 || max == 0) {
+	err = bc->err;
+	pthread_mutex_unlock(&bc->lock);
+	if (avail == 0 && (sub->closed || bc->eof || bc->closed)) {
+	    if (err && !sub->closed) {
+		rb_syserr_fail(err, "read");
+	    }
+	    if (!NIL_P(buf)) {
+		rb_str_set_len(buf, 0);
+	    }
+	    return Qnil;
+	}
+	if (NIL_P(buf)) {
+	    return rb_str_new(0, 0);
+	}
+	rb_str_set_len(buf, 0);
+	return buf;
+    }
+    len = (max >= 0 && (uint64_t)max < avail) ? (size_t)max : (size_t)avail;
+    pthread_mutex_unlock(&bc->lock);
+
+    /* size the string without the lock; it may allocate */
+    if (NIL_P(buf)) {
+	buf = rb_str_new(0, len);
+    }
+    else {
+	rb_str_resize(buf, len);
+    }
+
+    pthread_mutex_lock(&bc->lock);
+    broadcaster_catch_up(bc, sub);
+    if (sub->closed) {
+	pthread_mutex_unlock(&bc->lock);
+	rb_str_set_len(buf, 0);
+	return Qnil;
+    }
+    if (bc->head - sub->cursor < len) {
+	len = (size_t)(bc->head - sub->cursor);	/* resynced meanwhile */
+    }
+    at = (size_t)(sub->cursor & (bc->capacity - 1));
+    n = bc->capacity - at < len ? bc->capacity - at : len;
+    memcpy(RSTRING_PTR(buf), bc->ring + at, n);
+    memcpy(RSTRING_PTR(buf) + n, bc->ring, len - n);
+    sub->cursor += len;
+    pthread_mutex_unlock(&bc->lock);
+    rb_str_set_len(buf, len);
+
+    return buf;
 }
 
+/*
+ * call-seq:
+ *   subscriber.write(str)
+ *
+ * Writes str to the master of the broadcaster.
+ */
 static VALUE
-termios_s_tcflow(obj, io, act)
-    VALUE obj, io, act;
+broadcast_subscriber_write(self, str)
+    VALUE self, str;
 {
-    return termios_tcflow(io, act);
+    return broadcaster_write(get_broadcast_subscriber(self)->broadcaster, str);
 }
 
 /*
  * call-seq:
- *   Termios.tcgetpgrp(io)
- *   io.tcgetpgrp
- *
- * Returns the process group ID of the foreground process group  the
- * terminal associated to the object.
+ *   subscriber.lag
  *
- * See also: tcgetpgrp(3)
+ * Returns the number of bytes read from the master which the subscriber
+ * has not read yet.
  */
 static VALUE
-termios_tcgetpgrp(io)
-    VALUE io;
+broadcast_subscriber_lag(self)
+    VALUE self;
 {
-    OpenFile *fptr;
-    pid_t pid;
+    struct broadcast_subscriber *sub = get_broadcast_subscriber(self);
+    struct broadcaster *bc = get_broadcaster(sub->broadcaster);
+    uint64_t lag;
 
-    Check_Type(io,  T_FILE);
-    GetOpenFile(io, fptr);
-    if ((pid = tcgetpgrp(FILENO(fptr))) < 0) {
-        rb_sys_fail("tcgetpgrp");
-    }
+    pthread_mutex_lock(&bc->lock);
+    lag = sub->closed ? 0 : bc->head - sub->cursor;
+    pthread_mutex_unlock(&bc->lock);
 
-    return LONG2NUM(pid);
+    return ULL2NUM(lag);
 }
 
+/*
+ * call-seq:
+ *   subscriber.lost
+ *
+ * Returns the number of bytes skipped by resyncs.
+ */
 static VALUE
-termios_s_tcgetpgrp(obj, io)
-    VALUE obj, io;
+broadcast_subscriber_lost(self)
+    VALUE self;
 {
-    return termios_tcgetpgrp(io);
+    return ULL2NUM(get_broadcast_subscriber(self)->lost);
 }
 
 /*
  * call-seq:
- *   Termios.tcsetpgrp(io, pgrpid)
- *   io.tcsetpgrp(pgrpid)
- *
- * Makes the process group with pgrpid the foreground process group on the
- * terminal associated to the object.
+ *   subscriber.close
  *
- * See also: tcsetpgrp(3)
+ * Stops reading; the next read returns nil.
  */
 static VALUE
-termios_tcsetpgrp(io, pgrpid)
-    VALUE io, pgrpid;
+broadcast_subscriber_close(self)
+    VALUE self;
 {
-    OpenFile *fptr;
-    pid_t pgrp;
-
-    Check_Type(io,     T_FILE);
-    pgrp = NUM2LONG(pgrpid);
-
-    GetOpenFile(io, fptr);
-    if (tcsetpgrp(FILENO(fptr), pgrp) < 0) {
-        rb_sys_fail("tcsetpgrp");
-    }
+    struct broadcast_subscriber *sub = get_broadcast_subscriber(self);
+    struct broadcaster *bc = get_broadcaster(sub->broadcaster);
 
-    return Qtrue;
-}
+    pthread_mutex_lock(&bc->lock);
+    sub->closed = 1;
+    pthread_cond_broadcast(&bc->cond);
+    pthread_mutex_unlock(&bc->lock);
 
-static VALUE
-termios_s_tcsetpgrp(obj, io, pgrpid)
-    VALUE obj, io, pgrpid;
-{
-    return termios_tcsetpgrp(io, pgrpid);
+    return Qnil;
 }
 
 /*
  * call-seq:
- *   Termios.new_termios
+ *   subscriber.closed?
  *
- * Returns new Termios::Termios object.
+ * Returns true when the subscriber was closed, or dropped by the :drop
+ * policy.
  */
 static VALUE
-termios_s_newtermios(argc, argv, klass)
-    int argc;
-    VALUE *argv;
-    VALUE klass;
+broadcast_subscriber_closed_p(self)
+    VALUE self;
 {
-    return rb_funcall2(cTermios, rb_intern("new"), argc, argv);
+    return get_broadcast_subscriber(self)->closed ? Qtrue : Qfalse;
 }
 
 /*
  * call-seq:
- *   termios.dup
+ *   subscriber.broadcaster
  *
- * Produces a shallow copy of the object.
+ * Returns the broadcaster.
  */
 static VALUE
-termios_dup(self)
+broadcast_subscriber_broadcaster(self)
     VALUE self;
 {
-    VALUE result;
-    VALUE cc_ary;
-
-    result = rb_call_super(0, 0);
-    cc_ary = rb_ivar_get(self, id_cc);
-    rb_ivar_set(result, id_cc, rb_ary_dup(cc_ary));
-
-    return result;
+    return get_broadcast_subscriber(self)->broadcaster;
 }
 
 void
@@ -667,6 +10539,7 @@ Init_termios()
     rb_define_singleton_method(mTermios,"tcgetattr",  termios_s_tcgetattr,  1);
     rb_define_module_function(mTermios,   "getattr",  termios_s_tcgetattr,  1);
     rb_define_method(mTermios,          "tcgetattr",  termios_tcgetattr,    0);
+    rb_define_module_function(mTermios, "getattr_into", termios_s_getattr_into, 2);
 
     rb_define_singleton_method(mTermios,"tcsetattr",  termios_s_tcsetattr,  3);
     rb_define_module_function(mTermios,   "setattr",  termios_s_tcsetattr,  3);
@@ -696,6 +10569,57 @@ Init_termios()
     rb_define_module_function(mTermios,   "setpgrp",  termios_s_tcsetpgrp,  2);
     rb_define_method(mTermios,          "tcsetpgrp",  termios_tcsetpgrp,    1);
 
+#if defined(TIOCGETD)
+    rb_define_singleton_method(mTermios,"line_discipline",
+			       termios_s_line_discipline, 1);
+    rb_define_method(mTermios, "line_discipline", termios_line_discipline, 0);
+#endif
+#if defined(TIOCSETD)
+    rb_define_singleton_method(mTermios,"set_line_discipline",
+			       termios_s_set_line_discipline, 2);
+    rb_define_method(mTermios, "set_line_discipline",
+		     termios_set_line_discipline, 1);
+#endif
+
+    rb_define_singleton_method(mTermios,"getwinsize", termios_s_getwinsize, 1);
+    rb_define_method(mTermios,          "getwinsize", termios_getwinsize,   0);
+
+    rb_define_singleton_method(mTermios,"setwinsize", termios_s_setwinsize, 2);
+    rb_define_method(mTermios,          "setwinsize", termios_setwinsize,   1);
+
+    rb_define_singleton_method(mTermios,"openpty",   termios_s_openpty,   -1);
+
+    rb_define_singleton_method(mTermios,"relay",     termios_s_relay,     -1);
+
+    rb_define_singleton_method(mTermios,"update",    termios_s_update,    -1);
+    update_locks = rb_hash_new();
+    rb_global_variable(&update_locks);
+    query_cache = rb_hash_new();
+    rb_global_variable(&query_cache);
+    query_typeahead = rb_hash_new();
+    rb_global_variable(&query_typeahead);
+
+    rb_define_singleton_method(mTermios,"remember",  termios_s_remember,   1);
+    rb_define_singleton_method(mTermios,"forget",    termios_s_forget,     1);
+    rb_define_singleton_method(mTermios,"restore_all", termios_s_restore_all, 0);
+
+    rb_define_singleton_method(mTermios,"broadcast", termios_s_broadcast, -1);
+
+    rb_define_singleton_method(mTermios,"spawn_on_tty", termios_s_spawn_on_tty, -1);
+
+    rb_define_singleton_method(mTermios,"query", termios_s_query, -1);
+    rb_define_singleton_method(mTermios,"clear_query_cache", termios_s_clear_query_cache, -1);
+    rb_define_singleton_method(mTermios,"query_typeahead", termios_s_query_typeahead, 1);
+
+    rb_define_singleton_method(mTermios,"timestamped_read", termios_s_timestamped_read, -1);
+
+#ifdef TIOCMGET
+    id_push = rb_intern("push");
+    id_closed_p = rb_intern("closed?");
+    id_tiocmget = rb_intern("tiocmget");
+    rb_define_singleton_method(mTermios,"watch_modem_lines", termios_s_watch_modem_lines, -1);
+#endif
+
     rb_define_module_function(mTermios,"new_termios",termios_s_newtermios, -1);
 
     /* class Termios::Termios */
@@ -709,6 +10633,7 @@ Init_termios()
     id_cc     = rb_intern("@cc");
     id_ispeed = rb_intern("@ispeed");
     id_ospeed = rb_intern("@ospeed");
+    id_new = rb_intern("new");
 
     /* input modes */
     rb_define_attr(cTermios, "iflag",  1, 0);
@@ -728,6 +10653,13 @@ Init_termios()
     rb_define_private_method(cTermios, "initialize", termios_initialize, -1);
     rb_define_method(cTermios, "dup", termios_dup, 0);
     rb_define_method(cTermios, "clone", termios_dup, 0);
+    rb_define_method(cTermios, "process_output", termios_process_output, -1);
+    rb_define_method(cTermios, "char_time", termios_get_char_time, 0);
+    rb_define_method(cTermios, "==", termios_equal, 1);
+    rb_define_method(cTermios, "eql?", termios_equal, 1);
+    rb_define_method(cTermios, "hash", termios_hash, 0);
+    rb_define_method(cTermios, "diff", termios_diff, 1);
+    init_output_class();
 
     rb_define_method(cTermios, "iflag=",  termios_set_iflag,  1);
     rb_define_method(cTermios, "oflag=",  termios_set_oflag,  1);
@@ -752,6 +10684,206 @@ Init_termios()
     rb_define_alias(cTermios, "c_ospeed",  "ospeed");
     rb_define_alias(cTermios, "c_ospeed=", "ospeed=");
 
+    /* class Termios::PacedWriter */
+
+    cPacedWriter = rb_define_class_under(mTermios, "PacedWriter", rb_cObject);
+    rb_define_alloc_func(cPacedWriter, paced_writer_alloc);
+    rb_define_private_method(cPacedWriter, "initialize",
+			     paced_writer_initialize, -1);
+    rb_define_method(cPacedWriter, "write",     paced_writer_write,      1);
+    rb_define_method(cPacedWriter, "urgent",    paced_writer_urgent,     1);
+    rb_define_method(cPacedWriter, "queued",    paced_writer_get_queued, 0);
+    rb_define_method(cPacedWriter, "refresh",   paced_writer_refresh,    0);
+    rb_define_method(cPacedWriter, "io",        paced_writer_io,         0);
+    rb_define_method(cPacedWriter, "depth",     paced_writer_depth,      0);
+    rb_define_method(cPacedWriter, "depth=",    paced_writer_set_depth,  1);
+    rb_define_method(cPacedWriter, "char_time", paced_writer_char_time,  0);
+
+    /* class Termios::Recorder */
+
+    cRecorder = rb_define_class_under(mTermios, "Recorder", rb_cObject);
+    rb_define_alloc_func(cRecorder, recorder_alloc);
+    rb_define_private_method(cRecorder, "initialize", recorder_initialize, -1);
+    rb_define_method(cRecorder, "attach",      recorder_attach,      1);
+    rb_define_method(cRecorder, "relay",       recorder_relay,      -1);
+    rb_define_method(cRecorder, "record",      recorder_record_m,    2);
+    rb_define_method(cRecorder, "each_record", recorder_each_record, 0);
+    rb_define_method(cRecorder, "start_time",  recorder_start_time,  0);
+    rb_define_method(cRecorder, "dropped",     recorder_dropped,     0);
+    rb_define_method(cRecorder, "sync",        recorder_sync,        0);
+    rb_define_method(cRecorder, "close",       recorder_close,       0);
+    /* data read from the terminal */
+    rb_define_const(cRecorder, "OUTPUT",  INT2FIX(RECORDER_OUTPUT));
+    /* data written to the terminal */
+    rb_define_const(cRecorder, "INPUT",   INT2FIX(RECORDER_INPUT));
+    /* termios changes of the attached terminal */
+    rb_define_const(cRecorder, "TERMIOS", INT2FIX(RECORDER_TERMIOS));
+    /* window size changes of the attached terminal */
+    rb_define_const(cRecorder, "WINSIZE", INT2FIX(RECORDER_WINSIZE));
+
+    /* class Termios::KeyDecoder */
+
+    cKeyDecoder = rb_define_class_under(mTermios, "KeyDecoder", rb_cObject);
+    rb_define_alloc_func(cKeyDecoder, key_decoder_alloc);
+    rb_define_private_method(cKeyDecoder, "initialize",
+			     key_decoder_initialize, -1);
+    rb_define_method(cKeyDecoder, "feed",     key_decoder_feed,      1);
+    rb_define_method(cKeyDecoder, "flush",    key_decoder_flush,     0);
+    rb_define_method(cKeyDecoder, "expire",   key_decoder_expire,    0);
+    rb_define_method(cKeyDecoder, "pending?", key_decoder_pending_p, 0);
+    rb_define_method(cKeyDecoder, "timeout_remaining",
+		     key_decoder_timeout_remaining, 0);
+    /* shift modifier */
+    rb_define_const(cKeyDecoder, "SHIFT", INT2FIX(KEY_SHIFT));
+    /* alt (meta) modifier */
+    rb_define_const(cKeyDecoder, "ALT",   INT2FIX(KEY_ALT));
+    /* control modifier */
+    rb_define_const(cKeyDecoder, "CTRL",  INT2FIX(KEY_CTRL));
+    /* super modifier */
+    rb_define_const(cKeyDecoder, "SUPER", INT2FIX(KEY_SUPER));
+
+    /* class Termios::LineDiscipline */
+
+    cLineDiscipline = rb_define_class_under(mTermios, "LineDiscipline",
+					    rb_cObject);
+    rb_define_alloc_func(cLineDiscipline, line_discipline_alloc);
+    rb_define_private_method(cLineDiscipline, "initialize",
+			     line_discipline_initialize, 1);
+    rb_define_method(cLineDiscipline, "feed",     line_discipline_feed,     1);
+    rb_define_method(cLineDiscipline, "pending",  line_discipline_pending,  0);
+    rb_define_method(cLineDiscipline, "flush",    line_discipline_flush,    0);
+    rb_define_method(cLineDiscipline, "termios",  line_discipline_termios,  0);
+    rb_define_method(cLineDiscipline, "termios=",
+		     line_discipline_set_termios, 1);
+
+    /* class Termios::Screen */
+
+    cScreen = rb_define_class_under(mTermios, "Screen", rb_cObject);
+    rb_define_alloc_func(cScreen, screen_alloc);
+    rb_define_private_method(cScreen, "initialize", screen_initialize, -1);
+    rb_define_method(cScreen, "put",        screen_put,        -1);
+    rb_define_method(cScreen, "clear",      screen_clear,       0);
+    rb_define_method(cScreen, "flush",      screen_flush,      -1);
+    rb_define_method(cScreen, "invalidate", screen_invalidate,  0);
+    rb_define_method(cScreen, "resize",     screen_resize,      0);
+    rb_define_method(cScreen, "rows",       screen_rows,        0);
+    rb_define_method(cScreen, "cols",       screen_cols,        0);
+    rb_define_const(cScreen, "BOLD",      INT2FIX(SCREEN_BOLD));
+    rb_define_const(cScreen, "UNDERLINE", INT2FIX(SCREEN_UNDERLINE));
+    rb_define_const(cScreen, "REVERSE",   INT2FIX(SCREEN_REVERSE));
+    rb_define_const(cScreen, "BLINK",     INT2FIX(SCREEN_BLINK));
+    rb_define_const(cScreen, "DIM",       INT2FIX(SCREEN_DIM));
+    rb_define_const(cScreen, "ITALIC",    INT2FIX(SCREEN_ITALIC));
+
+    /* class Termios::Device */
+
+    cDevice = rb_define_class_under(mTermios, "Device", rb_cObject);
+    rb_define_alloc_func(cDevice, device_alloc);
+    rb_define_singleton_method(cDevice, "open", device_s_open, -1);
+    rb_define_private_method(cDevice, "initialize", device_initialize, -1);
+    rb_define_method(cDevice, "getattr",     device_getattr,      0);
+    rb_define_method(cDevice, "setattr",     device_setattr,      2);
+    rb_define_method(cDevice, "modem_lines", device_modem_lines,  0);
+    rb_define_method(cDevice, "refresh",     device_refresh,      0);
+    rb_define_method(cDevice, "read",        device_read,        -1);
+    rb_define_method(cDevice, "write",       device_write,        1);
+    rb_define_method(cDevice, "drain",       device_drain,        0);
+    rb_define_method(cDevice, "flush",       device_flush,       -1);
+    rb_define_method(cDevice, "close",       device_close,        0);
+    rb_define_method(cDevice, "closed?",     device_closed_p,     0);
+    rb_define_method(cDevice, "fileno",      device_fileno,       0);
+    rb_define_method(cDevice, "path",        device_path,         0);
+
+    /* class Termios::IOEngine */
+
+    cIOEngine = rb_define_class_under(mTermios, "IOEngine", rb_cObject);
+    rb_define_alloc_func(cIOEngine, io_engine_alloc);
+    rb_define_singleton_method(cIOEngine, "backends", io_engine_s_backends, 0);
+    rb_define_private_method(cIOEngine, "initialize", io_engine_initialize, -1);
+    rb_define_method(cIOEngine, "backend",    io_engine_backend,     0);
+    rb_define_method(cIOEngine, "register",   io_engine_register,    1);
+    rb_define_method(cIOEngine, "unregister", io_engine_unregister,  1);
+    rb_define_method(cIOEngine, "write",      io_engine_write,       2);
+    rb_define_method(cIOEngine, "submit",     io_engine_submit,      0);
+    rb_define_method(cIOEngine, "reap",       io_engine_reap,       -1);
+    rb_define_method(cIOEngine, "close",      io_engine_close,       0);
+
+    /* class Termios::Modbus */
+
+    init_modbus_crc_table();
+    cModbus = rb_define_class_under(mTermios, "Modbus", rb_cObject);
+    rb_define_alloc_func(cModbus, modbus_alloc);
+    rb_define_singleton_method(cModbus, "crc16", modbus_s_crc16, 1);
+    rb_define_singleton_method(cModbus, "lrc",   modbus_s_lrc,   1);
+    rb_define_private_method(cModbus, "initialize", modbus_initialize, -1);
+    rb_define_method(cModbus, "refresh",      modbus_refresh,      0);
+    rb_define_method(cModbus, "encode",       modbus_encode_m,     2);
+    rb_define_method(cModbus, "decode",       modbus_decode_m,     1);
+    rb_define_method(cModbus, "write_frame",  modbus_write_frame,  2);
+    rb_define_method(cModbus, "write_frames", modbus_write_frames, 1);
+    rb_define_method(cModbus, "read_frames",  modbus_read_frames, -1);
+    rb_define_method(cModbus, "t35",          modbus_t35,          0);
+    rb_define_method(cModbus, "t15",          modbus_t15,          0);
+    rb_define_method(cModbus, "errors",       modbus_errors,       0);
+    rb_define_method(cModbus, "mode",         modbus_mode,         0);
+    rb_define_method(cModbus, "io",           modbus_io,           0);
+
+    /* class Termios::Broadcaster */
+
+    cBroadcaster = rb_define_class_under(mTermios, "Broadcaster", rb_cObject);
+    rb_define_alloc_func(cBroadcaster, broadcaster_alloc);
+    rb_define_private_method(cBroadcaster, "initialize", broadcaster_initialize, -1);
+    rb_define_method(cBroadcaster, "subscribe", broadcaster_subscribe, 0);
+    rb_define_method(cBroadcaster, "write",     broadcaster_write,     1);
+    rb_define_method(cBroadcaster, "close",     broadcaster_close,     0);
+    rb_define_method(cBroadcaster, "closed?",   broadcaster_closed_p,  0);
+    rb_define_method(cBroadcaster, "position",  broadcaster_position,  0);
+    rb_define_method(cBroadcaster, "capacity",  broadcaster_capacity,  0);
+    rb_define_method(cBroadcaster, "policy",    broadcaster_policy,    0);
+    rb_define_method(cBroadcaster, "io",        broadcaster_io,        0);
+
+    cBroadcastSubscriber = rb_define_class_under(cBroadcaster, "Subscriber",
+						 rb_cObject);
+    rb_define_alloc_func(cBroadcastSubscriber, broadcast_subscriber_alloc);
+    rb_define_private_method(cBroadcastSubscriber, "initialize",
+			     broadcast_subscriber_initialize, 1);
+    rb_define_method(cBroadcastSubscriber, "read",    broadcast_subscriber_read,   -1);
+    rb_define_method(cBroadcastSubscriber, "write",   broadcast_subscriber_write,   1);
+    rb_define_method(cBroadcastSubscriber, "lag",     broadcast_subscriber_lag,     0);
+    rb_define_method(cBroadcastSubscriber, "lost",    broadcast_subscriber_lost,    0);
+    rb_define_method(cBroadcastSubscriber, "close",   broadcast_subscriber_close,   0);
+    rb_define_method(cBroadcastSubscriber, "closed?", broadcast_subscriber_closed_p, 0);
+    rb_define_method(cBroadcastSubscriber, "broadcaster",
+		     broadcast_subscriber_broadcaster, 0);
+
+    sym_read = key_name("read");
+    sym_write = key_name("write");
+    sym_eof = key_name("eof");
+    sym_error = key_name("error");
+
+    sym_rtu = key_name("rtu");
+    sym_ascii = key_name("ascii");
+
+    sym_drop = key_name("drop");
+    sym_resync = key_name("resync");
+
+    sym_INT = key_name("INT");
+    sym_QUIT = key_name("QUIT");
+    sym_TSTP = key_name("TSTP");
+    sym_XOFF = key_name("XOFF");
+    sym_XON = key_name("XON");
+
+    sym_text = key_name("text");
+    sym_key = key_name("key");
+    sym_paste = key_name("paste");
+    sym_mouse = key_name("mouse");
+    sym_focus = key_name("focus");
+    sym_cursor_position = key_name("cursor_position");
+    sym_unknown = key_name("unknown");
+    sym_press = key_name("press");
+    sym_release = key_name("release");
+    sym_drag = key_name("drag");
+
     /* constants under Termios module */
 
     /* number of control characters */
@@ -1534,4 +11666,106 @@ Init_termios()
 #ifdef PPPDISC
 	define_flag(line_disciplines, PPPDISC)
 #endif
+#ifdef N_TTY
+	define_flag(line_disciplines, N_TTY)
+#endif
+#ifdef N_SLIP
+	define_flag(line_disciplines, N_SLIP)
+#endif
+#ifdef N_MOUSE
+	define_flag(line_disciplines, N_MOUSE)
+#endif
+#ifdef N_PPP
+	define_flag(line_disciplines, N_PPP)
+#endif
+#ifdef N_STRIP
+	define_flag(line_disciplines, N_STRIP)
+#endif
+#ifdef N_AX25
+	define_flag(line_disciplines, N_AX25)
+#endif
+#ifdef N_X25
+	define_flag(line_disciplines, N_X25)
+#endif
+#ifdef N_6PACK
+	define_flag(line_disciplines, N_6PACK)
+#endif
+#ifdef N_MASC
+	define_flag(line_disciplines, N_MASC)
+#endif
+#ifdef N_R3964
+	define_flag(line_disciplines, N_R3964)
+#endif
+#ifdef N_PROFIBUS_FDL
+	define_flag(line_disciplines, N_PROFIBUS_FDL)
+#endif
+#ifdef N_IRDA
+	define_flag(line_disciplines, N_IRDA)
+#endif
+#ifdef N_SMSBLOCK
+	define_flag(line_disciplines, N_SMSBLOCK)
+#endif
+#ifdef N_HDLC
+	define_flag(line_disciplines, N_HDLC)
+#endif
+#ifdef N_SYNC_PPP
+	define_flag(line_disciplines, N_SYNC_PPP)
+#endif
+#ifdef N_HCI
+	define_flag(line_disciplines, N_HCI)
+#endif
+#ifdef N_GIGASET_M101
+	define_flag(line_disciplines, N_GIGASET_M101)
+#endif
+#ifdef N_SLCAN
+	define_flag(line_disciplines, N_SLCAN)
+#endif
+#ifdef N_PPS
+	define_flag(line_disciplines, N_PPS)
+#endif
+#ifdef N_V253
+	define_flag(line_disciplines, N_V253)
+#endif
+#ifdef N_CAIF
+	define_flag(line_disciplines, N_CAIF)
+#endif
+#ifdef N_GSM0710
+	define_flag(line_disciplines, N_GSM0710)
+#endif
+#ifdef N_TI_WL
+	define_flag(line_disciplines, N_TI_WL)
+#endif
+#ifdef N_TRACESINK
+	define_flag(line_disciplines, N_TRACESINK)
+#endif
+#ifdef N_TRACEROUTER
+	define_flag(line_disciplines, N_TRACEROUTER)
+#endif
+#ifdef N_NCI
+	define_flag(line_disciplines, N_NCI)
+#endif
+#ifdef N_SPEAKUP
+	define_flag(line_disciplines, N_SPEAKUP)
+#endif
+#ifdef N_NULL
+	define_flag(line_disciplines, N_NULL)
+#endif
+#ifdef N_MCTP
+	define_flag(line_disciplines, N_MCTP)
+#endif
+#ifdef N_DEVELOPMENT
+	define_flag(line_disciplines, N_DEVELOPMENT)
+#endif
+
+    /* tables for Termios::Termios#diff */
+    flag_diff_tables = rb_ary_new3(4,
+	termios_flag_diff_table(iflags_names, Qnil, no_diff_skip),
+	termios_flag_diff_table(oflags_names, oflags_choices, no_diff_skip),
+	termios_flag_diff_table(cflags_names, cflags_choices, cflag_diff_skip),
+	termios_flag_diff_table(lflags_names, Qnil, no_diff_skip));
+    rb_global_variable(&flag_diff_tables);
+    ccindex_table = ccindex;
+    rb_global_variable(&ccindex_table);
+    bauds_table = bauds;
+    rb_global_variable(&bauds_table);
 }
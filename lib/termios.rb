@@ -1,4 +1,9 @@
 require 'termios.so'
+require 'termios/pty_pool'
+require 'termios/recorder'
+require 'termios/modem_line_double'
+require 'termios/read_batched'
+require 'termios/adaptive_reader'
 
 module Termios
   VISIBLE_CHAR = {}
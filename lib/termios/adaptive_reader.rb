@@ -0,0 +1,119 @@
+require 'io/nonblock'
+require 'io/wait'
+
+module Termios
+  # Reads a noncanonical port with cc[VMIN] and cc[VTIME] retuned to the
+  # traffic: one byte and no timer while the line is quiet, so a keystroke
+  # or a short reply is returned at once, and a growing VMIN with an
+  # inter-byte timer while data arrives back to back, so a bulk transfer
+  # wakes the reader once per block instead of once per byte.
+  #
+  # The line counts as busy when the bytes of a read arrived no further
+  # apart than +burst_gap+ character times at the ispeed and character
+  # format of the port (see Termios::Termios#char_time), timed from the
+  # first byte so that the line being idle before a burst does not count.
+  # VMIN doubles per busy read up to +max_min+; when a read comes back
+  # short (the burst ended and the VTIME timer of +max_time+ tenths of a
+  # second expired) or the line is quiet, it drops back to one byte.
+  #
+  # The settings are changed with Termios.update only when they change,
+  # so other changes to the termios of the port are kept.  A port in
+  # nonblocking mode ignores VMIN and VTIME, so for one the same rules are
+  # applied by Termios.read_batched instead.
+  #
+  #   reader = Termios::AdaptiveReader.new(port, stats: ->(s) { p s })
+  #   while data = reader.read
+  #     ...
+  #   end
+  #   reader.restore
+  class AdaptiveReader
+    # Counters passed to the stats hook and returned by #stats.  +gap+ is
+    # the mean time between the bytes of the last read in seconds, nil
+    # after a read of one byte.
+    Stats = Struct.new(:reads, :bytes, :retunes, :vmin, :vtime, :gap)
+
+    attr_reader :io, :vmin, :vtime
+
+    def initialize(io, max_min: 64, max_time: 1, burst_gap: 2.0, stats: nil)
+      @io = io
+      @saved = ::Termios.tcgetattr(io)
+      @max_min = [[max_min, 1].max, 255].min
+      @max_time = [[max_time, 1].max, 255].min
+      char_time = @saved.char_time
+      # a pseudo terminal has no line speed worth the name
+      char_time = 10.0 / 38400 if char_time == 0.0
+      @threshold = burst_gap * char_time
+      @hook = stats
+      @emulate = io.nonblock?
+      @stats = Stats.new(0, 0, 0, nil, nil, nil)
+      tune(1, 0)
+    end
+
+    # Returns the counters so far.
+    def stats
+      @stats.dup
+    end
+
+    # Reads at most +maxlen+ bytes, waiting as cc[VMIN] and cc[VTIME]
+    # say, and retunes them for the next read.  It returns nil at end of
+    # file.
+    def read(maxlen = 4096)
+      # with VTIME set, poll(2) reports the first byte, not VMIN of them
+      @io.wait_readable
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      data = if @emulate
+               ::Termios.read_batched(@io, maxlen, min: @vmin, time: @vtime)
+             else
+               begin
+                 @io.sysread(maxlen)
+               rescue EOFError, Errno::EIO
+                 nil
+               end
+             end
+      return nil if data.nil?
+      now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      return data if data.empty?
+
+      n = data.bytesize
+      gap = n > 1 ? (now - start) / (n - 1) : nil
+      @stats.reads += 1
+      @stats.bytes += n
+      @stats.gap = gap
+      # one byte says nothing about how close together bytes arrive
+      if n > 1 && n >= @vmin && gap <= @threshold
+        tune([@vmin * 2, @max_min, maxlen].min, @max_time)
+      elsif @vmin > 1 && (n < @vmin || gap > @threshold)
+        tune(1, 0)
+      end
+      data
+    end
+
+    # Puts back cc[VMIN] and cc[VTIME] of the port as they were.
+    def restore
+      return if @emulate
+      saved = @saved.cc
+      ::Termios.update(@io) {|t|
+        t.cc[VMIN] = saved[VMIN]
+        t.cc[VTIME] = saved[VTIME]
+      }
+    end
+
+    private
+
+    def tune(vmin, vtime)
+      return if vmin == @vmin && vtime == @vtime
+      @vmin = vmin
+      @vtime = vtime
+      unless @emulate
+        ::Termios.update(@io) {|t|
+          t.cc[VMIN] = vmin
+          t.cc[VTIME] = vtime
+        }
+      end
+      @stats.retunes += 1
+      @stats.vmin = vmin
+      @stats.vtime = vtime
+      @hook.call(stats) if @hook
+    end
+  end
+end
@@ -0,0 +1,50 @@
+module Termios
+  # A stand-in for a serial port whose modem lines are set by the program,
+  # for testing code which uses Termios.watch_modem_lines without hardware.
+  # Pseudo terminals have no modem lines, so they cannot be used for this.
+  #
+  #   require 'termios'
+  #
+  #   port = Termios::ModemLineDouble.new
+  #   queue = Termios.watch_modem_lines([port])
+  #   port.up(:TIOCM_CD)
+  #   queue.pop  #=> [port, :TIOCM_CD, true, 1234.5678]
+  class ModemLineDouble
+    # Creates a double whose lines are +state+, a combination of
+    # Termios::TIOCM_* bits.
+    def initialize(state = 0)
+      @state = state
+    end
+
+    # Returns the lines as TIOCMGET does.
+    def tiocmget
+      @state
+    end
+
+    # Sets the lines to +state+, as TIOCMSET does.
+    def tiocmset(state)
+      @state = state
+    end
+
+    # Raises +signal+, a Termios::TIOCM_* bit or its name.
+    def up(signal)
+      @state |= bit(signal)
+    end
+
+    # Lowers +signal+, a Termios::TIOCM_* bit or its name.
+    def down(signal)
+      @state &= ~bit(signal)
+    end
+
+    # Returns true if +signal+ is raised.
+    def up?(signal)
+      @state & bit(signal) != 0
+    end
+
+    private
+
+    def bit(signal)
+      signal.is_a?(Integer) ? signal : ::Termios.const_get(signal)
+    end
+  end
+end
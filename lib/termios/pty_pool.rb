@@ -0,0 +1,148 @@
+require 'io/nonblock'
+
+module Termios
+  # A pool of pseudo terminal pairs which are opened and configured in
+  # advance, so that starting a session does not have to wait for
+  # openpty(3) and tcsetattr(3).
+  #
+  #   require 'termios'
+  #
+  #   pool = Termios::PtyPool.new(16, termios: tio, winsize: [24, 80])
+  #   master, slave = pool.acquire
+  #   ...
+  #   pool.release(master, slave)
+  #
+  # Pairs given back with #release are reset to the baseline termios and
+  # window size and used again, unless some other process still holds the
+  # slave.  The pool is refilled by a background thread.
+  class PtyPool
+    attr_reader :size, :max_idle, :termios, :winsize
+
+    # Creates a pool which keeps at least +size+ pairs ready, and up to
+    # +max_idle+ pairs when they are given back.  +termios+ and +winsize+
+    # are set to every slave; the termios of a fresh pseudo terminal is
+    # used when +termios+ is nil.
+    def initialize(size, max_idle: size * 2, termios: nil, winsize: [24, 80])
+      raise ArgumentError, "size must be positive" unless size > 0
+      @size = size
+      @max_idle = [max_idle, size].max
+      @winsize = winsize
+      @termios = termios || begin
+        master, slave = ::Termios.openpty
+        ::Termios.getattr(slave)
+      ensure
+        master.close if master
+        slave.close if slave
+      end
+      @pairs = Thread::Queue.new
+      @wakeup = Thread::Queue.new
+      @size.times { @pairs << open_pair }
+      @filler = Thread.new { fill }
+    end
+
+    # Returns a pair of [master, slave].  A new pair is opened on the spot
+    # when the pool is empty.
+    def acquire
+      pair = @pairs.pop(true)
+    rescue ThreadError
+      raise IOError, "closed pool" if @pairs.closed?
+      open_pair
+    ensure
+      begin
+        @wakeup << true
+      rescue ClosedQueueError
+      end
+    end
+
+    # Gives a pair back to the pool.  +slave+ is closed, and the pair is
+    # used again only when the master then reports that no other process
+    # has the slave open; a leftover process of the previous session could
+    # otherwise read the input of the next one.  The slave is opened again,
+    # pending output is discarded and the baseline termios is set with
+    # TCSAFLUSH, which discards pending input.  The pair is closed when it
+    # is unusable, still held, or +max_idle+ pairs are ready.
+    def release(master, slave)
+      path = slave.path unless slave.closed?
+      if path.nil? || master.closed? || @pairs.closed? ||
+         @pairs.size >= @max_idle
+        discard(master, slave)
+        return nil
+      end
+      slave.close
+      unless unheld?(master)
+        discard(master, slave)
+        return nil
+      end
+      slave = File.open(path, File::RDWR | File::NOCTTY)
+      ::Termios.setattr(slave, TCSAFLUSH, @termios)
+      if ::Termios.getwinsize(slave)[0, @winsize.size] != @winsize
+        ::Termios.setwinsize(slave, @winsize)
+      end
+      @pairs << [master, slave]
+      nil
+    rescue SystemCallError, IOError, ClosedQueueError
+      discard(master, slave)
+      nil
+    end
+
+    # Returns the number of pairs ready to be acquired.
+    def available
+      @pairs.size
+    end
+
+    # Stops refilling and closes all pairs in the pool.
+    def close
+      @wakeup.close
+      @filler.join
+      @pairs.close
+      while pair = (@pairs.pop(true) rescue nil)
+        discard(*pair)
+      end
+      nil
+    end
+
+    private
+
+    def open_pair
+      ::Termios.openpty(termios: @termios, winsize: @winsize)
+    end
+
+    def discard(master, slave)
+      master.close unless master.closed?
+      slave.close unless slave.closed?
+    end
+
+    # A master reads EIO once every descriptor of its slave is closed, and
+    # would block while one is left open.  Output left by the previous
+    # session is read and dropped on the way.
+    def unheld?(master)
+      nonblock = master.nonblock?
+      64.times {
+        begin
+          master.read_nonblock(4096)
+        rescue Errno::EIO
+          return true
+        rescue IO::WaitReadable, EOFError
+          return false
+        end
+      }
+      false
+    ensure
+      master.nonblock = nonblock unless master.closed?
+    end
+
+    def fill
+      while @wakeup.pop
+        @wakeup.clear
+        while @pairs.size < @size && !@wakeup.closed?
+          begin
+            @pairs << open_pair
+          rescue SystemCallError
+            sleep 0.1
+          end
+        end
+      end
+    rescue ClosedQueueError
+    end
+  end
+end
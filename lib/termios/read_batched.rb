@@ -0,0 +1,52 @@
+require 'io/wait'
+
+module Termios
+  # Reads from +io+ following the VMIN/VTIME rules of a noncanonical
+  # terminal, for ports which are in nonblocking mode where the kernel no
+  # longer applies them.  Waiting is done with IO#wait_readable, so a fiber
+  # scheduler runs other fibers meanwhile.
+  #
+  # +min+ is a number of bytes and +time+ is in tenths of a second; they
+  # default to cc[VMIN] and cc[VTIME] of the port.
+  #
+  # min == 0, time == 0:: returns what is available, possibly "".
+  # min > 0, time == 0::  waits until +min+ bytes are read.
+  # min == 0, time > 0::  waits up to +time+ for the first byte and returns
+  #                       what is available then, or "" on timeout.
+  # min > 0, time > 0::   waits for the first byte, then returns when
+  #                       +min+ bytes are read or no byte arrives for
+  #                       +time+ after the previous one.
+  #
+  # At most +maxlen+ bytes are returned.  It returns nil at end of file if
+  # nothing was read.
+  def self.read_batched(io, maxlen = 4096, min: nil, time: nil)
+    if min.nil? || time.nil?
+      cc = getattr(io).cc
+      min ||= cc[VMIN]
+      time ||= cc[VTIME]
+    end
+    min = maxlen if min > maxlen
+    timeout = time / 10.0
+    buf = String.new
+
+    if min == 0 && time > 0
+      return buf unless io.wait_readable(timeout)
+    end
+    loop {
+      case chunk = io.read_nonblock(maxlen - buf.bytesize, exception: false)
+      when :wait_readable
+        break if min == 0
+        break if buf.bytesize >= min
+        # the inter-byte timer runs once the first byte has arrived
+        wait = (time > 0 && !buf.empty?) ? timeout : nil
+        break unless io.wait_readable(wait)
+      when nil
+        return buf.empty? ? nil : buf
+      else
+        buf << chunk
+        break if min == 0 || buf.bytesize >= min
+      end
+    }
+    buf
+  end
+end
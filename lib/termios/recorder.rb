@@ -0,0 +1,57 @@
+module Termios
+  class Recorder
+    # Converts the records of a ring file at +path+ to asciicast v2 and
+    # writes it to +out+.  Output and input become "o" and "i" events and
+    # window size changes become "r" events.
+    def self.to_asciicast(path, out)
+      require 'json'
+      rec = new(path)
+      begin
+        events = []
+        width, height = 80, 24
+        carry = {}
+        rec.each_record {|type, time, data|
+          t = time / 1e9
+          case type
+          when OUTPUT, INPUT
+            code = type == OUTPUT ? "o" : "i"
+            text = utf8_chunk(carry, code, data)
+            events << [t, code, text] unless text.empty?
+          when WINSIZE
+            if events.empty?
+              height, width = data
+            else
+              events << [t, "r", "#{data[1]}x#{data[0]}"]
+            end
+          end
+        }
+        out.puts JSON.generate({version: 2, width: width, height: height,
+                                timestamp: rec.start_time.to_i})
+        events.each {|e| out.puts JSON.generate(e) }
+      ensure
+        rec.close
+      end
+      out
+    end
+
+    # Returns the valid UTF-8 part of +data+, keeping an incomplete
+    # character at the end for the next chunk of the same direction.
+    def self.utf8_chunk(carry, code, data)
+      s = (carry.delete(code) || "".b) + data.b
+      i = s.bytesize - 1
+      while i >= 0 && i >= s.bytesize - 4 && (s.getbyte(i) & 0xc0) == 0x80
+        i -= 1
+      end
+      if i >= 0
+        lead = s.getbyte(i)
+        need = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1
+        if s.bytesize - i < need
+          carry[code] = s.byteslice(i..-1)
+          s = s.byteslice(0, i)
+        end
+      end
+      s.force_encoding(Encoding::UTF_8).scrub
+    end
+    private_class_method :utf8_chunk
+  end
+end
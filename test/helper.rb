@@ -0,0 +1,23 @@
+# Shared by the test scripts: run each as
+#   ruby -I<build dir> -Ilib test/test_<name>.rb
+require 'termios'
+
+def check(what, cond)
+  abort "FAIL: #{what}" unless cond
+end
+
+# Turns off input and output processing and echo of the terminal io.
+def make_raw(io)
+  Termios.update(io) do |t|
+    t.iflag = 0
+    t.oflag = 0
+    t.lflag = 0
+  end
+  io
+end
+
+# Returns a pseudo terminal master and slave, both raw.
+def raw_pair
+  master, slave = Termios.openpty
+  [make_raw(master), make_raw(slave)]
+end
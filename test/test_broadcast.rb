@@ -0,0 +1,37 @@
+# Checks Termios.broadcast over pseudo terminal pairs.
+require_relative 'helper'
+
+pairs = Array.new(3) { raw_pair }
+slaves = pairs.map(&:last)
+result = Termios.broadcast(slaves, "hello", drain: true)
+check "bytes per port", result == [5, 5, 5]
+check "every port written", pairs.all? {|m, _| m.wait_readable(2) && m.readpartial(16) == "hello" }
+check "blocking mode kept", slaves.none?(&:nonblock?)
+
+# the same port twice, or two descriptors of one open file
+master, slave = pairs[0]
+other = slave.dup
+result = Termios.broadcast([slave, slave, other], "hi")
+check "shared ports written", result == [2, 2, 2]
+check "shared ports stay blocking", !slave.nonblock? && !other.nonblock?
+master.wait_readable(2)
+check "shared data", master.readpartial(16) == "hihihi"
+slave.nonblock = true
+Termios.broadcast([slave, other], "x")
+check "non-blocking mode kept", slave.nonblock? && other.nonblock?
+slave.nonblock = false
+master.readpartial(16)
+
+# a stopped port times out without holding up the others
+Termios.flow(slaves[1], Termios::TCOOFF)
+t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+result = Termios.broadcast(slaves, "late", drain: true, timeout: 0.2)
+elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - t0
+check "timeout honoured", elapsed < 1.5
+check "stopped port reports ETIMEDOUT", result[1].is_a?(Errno::ETIMEDOUT)
+check "other ports done", result[0] == 4 && result[2] == 4
+Termios.flow(slaves[1], Termios::TCOON)
+
+pairs.flatten.each(&:close)
+other.close
+puts "ok"
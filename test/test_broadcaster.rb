@@ -0,0 +1,70 @@
+# Checks Termios::Broadcaster over a pseudo terminal pair: every
+# subscriber sees the data, a lagging one is resynced or dropped, and
+# read returns nil at the end of the data.
+require_relative 'helper'
+
+def read_all(sub, size, timeout = 2)
+  data = String.new
+  while data.bytesize < size
+    chunk = sub.read(nil, nil, timeout: timeout)
+    break if chunk.nil? || chunk.empty?
+    data << chunk
+  end
+  data
+end
+
+master, slave = raw_pair
+bc = Termios::Broadcaster.new(master, capacity: 5000)
+check "capacity rounded up", bc.capacity == 8192
+check "default policy", bc.policy == :resync
+one = bc.subscribe
+two = bc.subscribe
+check "subscriber knows its broadcaster", one.broadcaster.equal?(bc)
+
+slave.syswrite("hello")
+check "first subscriber", read_all(one, 5) == "hello"
+check "second subscriber", read_all(two, 5) == "hello"
+check "nothing pending", one.lag == 0
+check "timeout", one.read(nil, nil, timeout: 0.05) == ""
+
+buf = String.new
+slave.syswrite("into")
+got = one.read(16, buf, timeout: 2)
+check "read into a buffer", got.equal?(buf) && buf == "into"
+check "maxlen", two.read(2, nil, timeout: 2) == "in" && two.read(nil, nil, timeout: 2) == "to"
+
+one.write("up")
+check "subscriber writes go to the master", slave.wait_readable(2) && slave.readpartial(16) == "up"
+bc.write("down")
+check "broadcaster writes go to the master", slave.wait_readable(2) && slave.readpartial(16) == "down"
+
+# nobody reads while four times the ring arrives
+lagging = bc.subscribe
+data = "0123456789abcdef" * 2048
+slave.write(data)
+sleep 0.01 until bc.position >= 9 + data.bytesize
+tail = read_all(lagging, data.bytesize, 0.2)
+check "lagging subscriber lost data", lagging.lost > 0
+check "resync to the oldest data left", tail.bytesize == data.bytesize - lagging.lost &&
+  data.end_with?(tail)
+read_all(one, data.bytesize, 0.2)
+two.close
+check "closed subscriber", two.closed? && two.read(nil, nil, timeout: 0) == nil
+
+slave.close
+check "nil at end of data", one.read(nil, nil, timeout: 2).nil?
+bc.close
+check "closed", bc.closed?
+
+master, slave = raw_pair
+bc = Termios::Broadcaster.new(master, capacity: 4096, policy: :drop)
+check "drop policy", bc.policy == :drop
+sub = bc.subscribe
+keeper = bc.subscribe
+slave.write("x" * 10000)
+read_all(keeper, 10000)
+check "dropped when behind", sub.read(nil, nil, timeout: 2).nil? && sub.closed?
+bc.close
+[master, slave].each(&:close)
+
+puts "ok"
@@ -0,0 +1,59 @@
+# Checks Termios::Device on the slave of a pseudo terminal pair.
+require_relative 'helper'
+
+TIOCGEXCL = 0x80045440		# Linux
+
+master, slave = raw_pair
+dev = Termios::Device.new(slave.path)
+check "path", dev.path == slave.path
+check "blocking after open", !IO.for_fd(dev.fileno, autoclose: false).nonblock?
+if RUBY_PLATFORM =~ /linux/
+  excl = [0].pack("i")
+  IO.for_fd(dev.fileno, autoclose: false).ioctl(TIOCGEXCL, excl)
+  check "locked with TIOCEXCL", excl.unpack("i")[0] != 0
+end
+check "pseudo terminals have no modem lines", dev.modem_lines.nil?
+
+attrs = dev.getattr
+check "termios cached", attrs == Termios.tcgetattr(slave)
+
+# setting the same termios still flushes
+master.write("stale")
+sleep 0.05
+dev.setattr(Termios::TCSAFLUSH, attrs)
+master.write("fresh")
+check "TCSAFLUSH drops pending input", dev.read(16) == "fresh"
+
+# a termios changed behind the back of the device is set again
+Termios.update(slave) {|t| t.lflag |= Termios::ECHO }
+dev.setattr(Termios::TCSANOW, attrs)
+check "stale cache does not skip setattr",
+  Termios.tcgetattr(slave).lflag & Termios::ECHO == 0
+
+changed = attrs.dup
+changed.cc[Termios::VMIN] = 0
+changed.cc[Termios::VTIME] = 1
+dev.setattr(Termios::TCSANOW, changed)
+check "setattr caches", dev.getattr == changed
+check "VTIME timeout reads empty", dev.read(16) == ""
+
+check "write", dev.write("out") == 3
+dev.drain
+check "written", master.wait_readable(2) && master.readpartial(16) == "out"
+
+master.write("gone")
+sleep 0.05
+dev.flush(Termios::TCIFLUSH)
+check "flush", dev.read(16) == ""
+
+Termios.update(slave) {|t| t.lflag |= Termios::ECHO }
+dev.refresh
+check "refresh", dev.getattr.lflag & Termios::ECHO != 0
+
+dev.close
+check "closed", dev.closed?
+Termios::Device.open(slave.path) {|d| check "open with a block", !d.closed? }
+
+master.close
+slave.close
+puts "ok"
@@ -0,0 +1,20 @@
+# Checks that Termios::Termios#== and #hash take any cc without raising.
+require_relative 'helper'
+
+full = Termios.new_termios
+short = full.dup
+short.cc = [1, 2]
+check "short cc differs", !(full == short) && !(short == full)
+check "short cc hashes", short.hash.is_a?(Integer)
+check "short cc equals itself", short == short.dup
+
+padded = Termios.new_termios
+padded.cc = [1, 2] + [0] * (Termios::NCCS - 2)
+check "missing entries count as 0", short == padded && short.hash == padded.hash
+
+odd = Termios.new_termios
+odd.cc = [:x]
+check "unconvertible cc differs", !(odd == full) && odd.hash.is_a?(Integer)
+check "no exception left behind", $!.nil?
+
+puts "ok"
@@ -0,0 +1,77 @@
+# Checks Termios::IOEngine with every backend compiled in, on pseudo
+# terminal pairs.
+require_relative 'helper'
+
+# reaps until +kind+ completes for +io+ or two seconds pass
+def reap_for(engine, io, kind)
+  found = []
+  deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 2
+  while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+    found.concat(engine.reap(0.1))
+    hit = found.select { |ev| ev[0].equal?(io) && ev[1] == kind }
+    return [hit, found] unless hit.empty?
+  end
+  [[], found]
+end
+
+Termios::IOEngine.backends.each do |backend|
+  engine = Termios::IOEngine.new(backend)
+  check "#{backend} backend", engine.backend == backend
+
+  master, slave = raw_pair
+  engine.register(master)
+
+  slave.syswrite("ping")
+  hit, = reap_for(engine, master, :read)
+  check "#{backend} read", hit.map { |ev| ev[2] }.join == "ping"
+
+  engine.write(master, "pong")
+  engine.submit
+  hit, = reap_for(engine, master, :write)
+  check "#{backend} write", hit.inject(0) { |sum, ev| sum + ev[2] } == 4
+  check "#{backend} written", slave.wait_readable(2) && slave.readpartial(16) == "pong"
+
+  engine.unregister(master)
+  slave.syswrite("lost")
+  check "#{backend} unregistered", engine.reap(0.2).empty?
+  master.read_nonblock(16) rescue nil
+
+  engine.register(master)
+  slave.close
+  hit, = reap_for(engine, master, :eof)
+  check "#{backend} eof", !hit.empty?
+
+  # a new IO which gets the fd number of a closed, still registered one
+  fd = master.fileno
+  master.close
+  master, slave = raw_pair
+  check "#{backend} fd reused", master.fileno == fd
+  engine.register(master)
+  slave.syswrite("again")
+  hit, found = reap_for(engine, master, :read)
+  check "#{backend} reused fd read", hit.map { |ev| ev[2] }.join == "again"
+  check "#{backend} nothing for the closed IO", found.all? { |ev| ev[0].equal?(master) }
+  engine.unregister(master)
+  slave.close
+
+  other, other_slave = raw_pair
+  reaper = Thread.new { engine.reap(nil) }
+  Thread.pass until reaper.status == "sleep"
+  begin
+    engine.register(other)
+    check "#{backend} register during reap raises", false
+  rescue IOError
+  end
+
+  engine.close
+  check "#{backend} close wakes reap", reaper.join(2) && reaper.value == []
+  begin
+    engine.reap(0)
+    check "#{backend} reap after close raises", false
+  rescue IOError
+  end
+
+  [master, other, other_slave].each(&:close)
+end
+
+puts "ok"
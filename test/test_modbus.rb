@@ -0,0 +1,65 @@
+# Feeds noise and split frames to the RTU deframer of Termios::Modbus
+# through a pseudo terminal pair.
+require_relative 'helper'
+
+master, slave = raw_pair
+sender = Termios::Modbus.new(master)
+modbus = Termios::Modbus.new(slave)
+frame = sender.encode(17, "\x03\x00\x6b\x00\x03".b)
+
+# reads until the line has been quiet for a while
+def drain(modbus)
+  frames = []
+  loop do
+    got = modbus.read_frames(16, timeout: 0.02)
+    break if got.empty?
+    frames.concat(got)
+  end
+  frames
+end
+
+rng = Random.new(20240)
+100.times do |i|
+  noise = rng.bytes(1 + rng.rand(i.even? ? 300 : 2000))
+  writer = Thread.new { master.write(noise) }
+  frames = drain(modbus)
+  writer.join
+  check "noise frames are well formed", frames.all? { |unit, pdu|
+    (0..255).cover?(unit) && (1..253).cover?(pdu.bytesize)
+  }
+end
+
+errors = modbus.errors
+master.write(frame)
+check "frame after noise", drain(modbus) == [[17, "\x03\x00\x6b\x00\x03".b]]
+check "no error for a clean frame", modbus.errors == errors
+
+writer = Thread.new do
+  master.write(frame[0, 3])
+  master.write(frame[3..-1])
+end
+check "frame split in two writes", drain(modbus) == [[17, "\x03\x00\x6b\x00\x03".b]]
+writer.join
+
+long = sender.encode(1, "\x10".b + rng.bytes(252))
+writer = Thread.new do
+  long.each_char.each_slice(37) { |s| master.write(s.join) }
+end
+check "longest frame split in pieces", drain(modbus) == [[1, long[1...-2]]]
+writer.join
+
+# frames and PDUs are used as to_ary and to_str convert them
+pdu_like = Object.new
+def pdu_like.to_str
+  "\x03\x00\x6b\x00\x03".b
+end
+frame_like = Object.new
+def frame_like.to_ary
+  [17, "\x03\x00\x6b\x00\x03".b]
+end
+check "encode converts the PDU", sender.encode(17, pdu_like) == frame
+sender.write_frames([frame_like, [17, pdu_like]])
+check "write_frames converts frames and PDUs",
+  drain(modbus) == [[17, "\x03\x00\x6b\x00\x03".b]] * 2
+
+puts "ok"
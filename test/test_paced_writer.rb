@@ -0,0 +1,58 @@
+# Checks Termios::PacedWriter over a pseudo terminal pair.  A pty has no
+# output queue to watch, so pacing itself is not observable here.
+require_relative 'helper'
+
+# the number of times the threads of this process went to sleep (Linux)
+def wakeups
+  Dir["/proc/self/task/*/status"].inject(0) do |sum, f|
+    sum + File.read(f)[/^voluntary_ctxt_switches:\s*(\d+)/, 1].to_i
+  end
+end
+
+def read_some(io, size)
+  data = String.new
+  data << io.readpartial(65536) while data.bytesize < size && io.wait_readable(2)
+  data
+end
+
+master, slave = raw_pair
+Termios.update(slave) {|t| t.ospeed = Termios::B9600 }
+writer = Termios::PacedWriter.new(slave)
+check "io", writer.io.equal?(slave)
+check "char time of 8N1 at 9600", (writer.char_time - 10.0 / 9600).abs < 1e-9
+check "default depth at least 64", writer.depth == 64
+writer.depth = 128
+check "depth=", writer.depth == 128
+check "queued", writer.queued >= 0
+
+check "write returns the size", writer.write("hello") == 5
+check "written", read_some(master, 5) == "hello"
+check "urgent", writer.urgent("!") == 1 && read_some(master, 1) == "!"
+
+Termios.update(slave) {|t| t.ospeed = Termios::B38400 }
+writer.refresh
+check "refresh", (writer.char_time - 10.0 / 38400).abs < 1e-9
+
+# without a known speed a write waiting behind an urgent one naps
+Termios.update(slave) {|t| t.ospeed = Termios::B0 }
+writer.refresh
+check "unknown speed", writer.char_time == 0.0
+big = "u" * 200_000
+urgent = Thread.new { writer.urgent(big) }	# blocks: nobody reads
+sleep 0.1
+normal = Thread.new { writer.write("after") }
+sleep 0.1
+if File.exist?("/proc/self/task")
+  before = wakeups
+  sleep 0.5
+  # about 500 naps at 9600 bps, thousands at a 0.1 ms floor
+  check "no busy wait", wakeups - before < 2000
+end
+data = read_some(master, big.bytesize + 5)
+urgent.join
+normal.join
+check "urgent data first", data == big + "after"
+
+master.close
+slave.close
+puts "ok"
@@ -0,0 +1,46 @@
+# Checks Termios::PtyPool.
+require_relative 'helper'
+
+def pairs_of(pool)
+  Array.new(pool.available) { pool.acquire }
+end
+
+pool = Termios::PtyPool.new(2, max_idle: 4, winsize: [30, 90])
+check "filled", pool.available == 2
+
+master, slave = pool.acquire
+check "window size", Termios.getwinsize(slave)[0, 2] == [30, 90]
+Termios.setwinsize(slave, [10, 10])
+make_raw(slave).syswrite("left over")
+master.wait_readable(2)
+pool.release(master, slave)
+check "unheld pair is kept", !master.closed? && slave.closed?
+pair = pairs_of(pool).find { |m, _| m.equal?(master) }
+check "unheld pair is reused", pair
+check "window size is reset", Termios.getwinsize(pair[1])[0, 2] == [30, 90]
+check "old output is dropped", (pair[0].read_nonblock(16) rescue IO::WaitReadable) == IO::WaitReadable
+
+# a leftover process of the previous session still holds the slave
+master, slave = pool.acquire
+r, w = IO.pipe
+pid = fork do
+  w.close
+  r.read
+  exit!(0)
+end
+r.close
+pool.release(master, slave)
+check "held pair is closed", master.closed? && slave.closed?
+check "held pair is not reused", pairs_of(pool).none? { |m, _| m.equal?(master) }
+w.close
+Process.wait(pid)
+
+pool.close
+check "closed", pool.available == 0
+begin
+  pool.acquire
+  check "acquire after close raises", false
+rescue IOError
+end
+
+puts "ok"
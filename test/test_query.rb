@@ -0,0 +1,49 @@
+# Checks that Termios.query gives each request its own response and
+# keeps the bytes which are not a response, with the master of a pseudo
+# terminal playing the terminal.
+require_relative 'helper'
+
+master, slave = Termios.openpty
+
+def answer(master, *chunks)
+  Thread.new do
+    master.readpartial(256)
+    chunks.each { |c| master.write(c); sleep 0.02 }
+  end
+end
+
+t = answer(master, "\eP>|Alacritty 0.13\e\\\e[?62;c")
+r = Termios.query(slave, ["\e[>q", "\e[c"], terminator: ["\e\\", "c"])
+t.join
+check "DCS and CSI responses", r == ["\eP>|Alacritty 0.13\e\\", "\e[?62;c"]
+
+t = answer(master, "typeahead\e[?62;c")
+r = Termios.query(slave, "\e[c", terminator: "c")
+t.join
+check "typeahead not in response", r == "\e[?62;c"
+check "typeahead kept", Termios.query_typeahead(slave) == "typeahead"
+check "typeahead taken", Termios.query_typeahead(slave) == ""
+
+t = answer(master, "\e[A\e[?62;cmore")
+r = Termios.query(slave, ["\e[?u", "\e[c"], terminator: ["u", "c"])
+t.join
+check "unanswered query", r == [nil, "\e[?62;c"]
+check "key and trailing bytes kept", Termios.query_typeahead(slave) == "\e[Amore"
+
+t = answer(master, "\e[?6", "2;c")
+r = Termios.query(slave, "\e[c", terminator: "c")
+t.join
+check "response split across reads", r == "\e[?62;c"
+
+t = answer(master, "x")
+r = Termios.query(slave, "\e[6n", terminator: "R", timeout_ms: 50)
+t.join
+check "timeout", r.nil? && Termios.query_typeahead(slave) == "x"
+
+# the bookkeeping of many requests is not on the stack
+drainer = Thread.new { loop { master.readpartial(65536) } }
+r = Termios.query(slave, ["\e[c"] * 2_000_000, terminator: "c", timeout_ms: 10)
+check "many requests", r.size == 2_000_000 && r.compact.empty?
+drainer.kill
+
+puts "ok"
@@ -0,0 +1,85 @@
+# Checks Termios::Recorder on a temporary ring file.
+require_relative 'helper'
+require 'tmpdir'
+require 'stringio'
+
+R = Termios::Recorder
+CAPACITY = 16384 * 4
+
+# offset of start_realtime in the ring file header
+START_REALTIME = 48
+
+def times(rec)
+  rec.each_record.map { |_, time, _| time }
+end
+
+Dir.mktmpdir do |dir|
+  path = File.join(dir, "session.rec")
+
+  rec = R.new(path, CAPACITY)
+  check "start time", (Time.now - rec.start_time).abs < 5
+  rec.record(R::OUTPUT, "hello")
+  rec.record(R::INPUT, "world")
+  records = rec.each_record.to_a
+  check "record types", records.map(&:first) == [R::OUTPUT, R::INPUT]
+  check "record data", records.map(&:last) == ["hello", "world"]
+  check "record times", records[0][1] >= 0 && records[0][1] <= records[1][1]
+
+  master, slave = raw_pair
+  Termios.setwinsize(master, [30, 100, 0, 0])
+  rec.attach(master)
+  Termios.setwinsize(master, [40, 120, 0, 0])
+  rec.record(R::OUTPUT, "resized")
+  kinds = rec.each_record.map { |type, _, data| [type, data] }
+  check "attach records termios", kinds.any? { |t, d| t == R::TERMIOS && d.is_a?(Termios::Termios) }
+  check "attach records window size", kinds.include?([R::WINSIZE, [30, 100, 0, 0]])
+  check "records window size changes", kinds.include?([R::WINSIZE, [40, 120, 0, 0]])
+  [master, slave].each(&:close)
+
+  src_r, src_w = IO.pipe
+  dst_r, dst_w = IO.pipe
+  src_w.write("relayed")
+  src_w.close
+  check "relay copies", rec.relay(src_r, dst_w) == 7 && dst_r.read_nonblock(16) == "relayed"
+  check "relay records", rec.each_record.to_a.last[2] == "relayed"
+  [src_r, dst_r, dst_w].each(&:close)
+
+  cast = R.to_asciicast(path, StringIO.new).string.lines
+  check "asciicast header and resize", cast[0].include?('"version":2') && cast.any? { |l| l.include?('"r","120x40"') }
+  check "asciicast events", cast.any? { |l| l.include?('"o","hello"') } && cast.any? { |l| l.include?('"i","world"') }
+
+  # the newest records survive; the rest are counted as dropped
+  200.times { |i| rec.record(R::OUTPUT, "%03d" % i + "x" * 1000) }
+  check "dropped", rec.dropped > 0
+  data = rec.each_record.map { |_, _, d| d }
+  check "keeps the newest", data.last.start_with?("199") && data.size < 200
+  check "times never go backwards", times(rec).each_cons(2).all? { |a, b| a <= b }
+  last = times(rec).last
+  rec.close
+
+  # reopened an hour later, maybe after a reboot reset the monotonic clock
+  File.open(path, "r+b") do |f|
+    f.seek(START_REALTIME)
+    start = f.read(8).unpack1("q")
+    f.seek(START_REALTIME)
+    f.write([start - 3600 * 10**9].pack("q"))
+  end
+  rec = R.new(path)
+  rec.record(R::OUTPUT, "after")
+  after = times(rec).last
+  check "reopen follows the wall clock", after >= 3600 * 10**9 && after < 3700 * 10**9
+  check "reopen keeps the records", rec.each_record.map { |_, _, d| d }.include?("after")
+  rec.close
+
+  # the wall clock went backwards since the ring was created
+  File.open(path, "r+b") do |f|
+    f.seek(START_REALTIME)
+    f.write([(Time.now.to_r * 10**9).to_i + 7200 * 10**9].pack("q"))
+  end
+  rec = R.new(path)
+  rec.record(R::OUTPUT, "again")
+  check "reopen never goes backwards", times(rec).last >= after && after > last
+  rec.close
+end
+
+puts "ok"
@@ -0,0 +1,60 @@
+# Checks Termios.relay between a pseudo terminal master and a socket.
+require_relative 'helper'
+require 'socket'
+
+def cpu
+  Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+end
+
+def read_some(io, size)
+  data = String.new
+  data << io.readpartial(size - data.bytesize) while data.bytesize < size && io.wait_readable(2)
+  data
+end
+
+master, slave = raw_pair
+peer, far = UNIXSocket.pair
+relay = Thread.new { Termios.relay(master, peer) }
+slave.write("to the peer")
+check "master to peer", read_some(far, 11) == "to the peer"
+far.write("to the slave")
+check "peer to master", read_some(slave, 12) == "to the slave"
+far.close
+check "ends when a side closes", relay.join(2) && relay.value == [11, 12]
+[master, slave, peer].each(&:close)
+
+# a hung-up master with output pending to a slow peer waits, not spins
+master, slave = raw_pair
+peer, far = UNIXSocket.pair
+[peer, far].each do |s|
+  s.setsockopt(Socket::SOL_SOCKET, Socket::SO_SNDBUF, 4096)
+  s.setsockopt(Socket::SOL_SOCKET, Socket::SO_RCVBUF, 4096)
+end
+relay = Thread.new { Termios.relay(master, peer) }
+writer = Thread.new { slave.write("x" * 12_000); slave.close }
+check "slave hung up", writer.join(2)
+before = cpu
+sleep 0.5
+check "no busy wait", cpu - before < 0.25
+received = 0
+received += far.readpartial(65536).bytesize while received < 12_000 && far.wait_readable(2)
+writer.join
+check "all relayed", relay.join(5) && received == 12_000 && relay.value[0] == 12_000
+[master, peer, far].each(&:close)
+
+# packet mode strips the leading byte and yields control bytes
+master, slave = raw_pair
+master.ioctl(Termios::TIOCPKT, [1].pack("i"))
+peer, far = UNIXSocket.pair
+ctrls = []
+relay = Thread.new { Termios.relay(master, peer, packet: true) {|c| ctrls << c } }
+slave.write("pkt")
+check "packet data", read_some(far, 3) == "pkt"
+Termios.flush(slave, Termios::TCIFLUSH)
+sleep 0.1
+check "control byte yielded", ctrls.any? {|c| c & Termios::TIOCPKT_FLUSHREAD != 0 }
+far.close
+relay.join(2)
+[master, slave, peer].each(&:close)
+
+puts "ok"
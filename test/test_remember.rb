@@ -0,0 +1,59 @@
+# Checks Termios.remember, Termios.restore_all and Termios.forget, and
+# that a process dying of a crash signal restores what it remembered.
+require_relative 'helper'
+
+def echo?(io)
+  Termios.tcgetattr(io).lflag & Termios::ECHO != 0
+end
+
+def echo_off(io)
+  Termios.update(io) {|t| t.lflag &= ~Termios::ECHO }
+end
+
+pairs = Array.new(40) { Termios.openpty }
+slaves = pairs.map(&:last)
+check "echo on at first", slaves.all? {|s| echo?(s) }
+
+# more than the first table holds, so that it grows
+slaves.each {|s| Termios.remember(s) }
+check "remember returns the io", Termios.remember(slaves[0]).equal?(slaves[0])
+slaves.each {|s| echo_off(s) }
+check "restore_all counts", Termios.restore_all == slaves.size
+check "restore_all restores", slaves.all? {|s| echo?(s) }
+
+echo_off(slaves[0])
+check "forget", Termios.forget(slaves[0]) == true && Termios.forget(slaves[0]) == false
+check "forgotten one stays", Termios.restore_all == slaves.size - 1 && !echo?(slaves[0])
+make_raw(slaves[0])
+Termios.update(slaves[0]) {|t| t.lflag |= Termios::ECHO }
+
+# a forked child does not restore what its parent remembered
+echo_off(slaves[1])
+pid = fork { exit!(Termios.restore_all) }
+Process.wait(pid)
+check "child restores none", $?.exitstatus == 0 && !echo?(slaves[1])
+Termios.restore_all
+
+# a crash restores without running Ruby code
+master, slave = Termios.openpty
+rd, wr = IO.pipe
+pid = fork do
+  rd.close
+  $stderr.reopen(File::NULL)
+  Termios.remember(slave)
+  echo_off(slave)
+  wr.write("x")
+  wr.close
+  Process.kill(:SEGV, $$)
+  sleep 5
+  exit! 0
+end
+wr.close
+rd.read(1)
+Process.wait(pid)
+check "child crashed", $?.signaled?
+check "restored at crash", echo?(slave)
+
+pairs.flatten.each(&:close)
+[master, slave].each(&:close)
+puts "ok"
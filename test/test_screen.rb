@@ -0,0 +1,55 @@
+# Checks Termios::Screen against the slave of a pseudo terminal pair.
+require_relative 'helper'
+
+def output(master)
+  data = String.new
+  data << master.readpartial(4096) while master.wait_readable(0.1)
+  data.force_encoding(Encoding::UTF_8)
+end
+
+master, slave = raw_pair
+Termios.setwinsize(slave, [4, 10])
+screen = Termios::Screen.new(slave, false)
+check "size", screen.rows == 4 && screen.cols == 10
+
+check "put returns the next column", screen.put(1, 2, "abc") == 5
+n = screen.flush
+out = output(master)
+check "first flush redraws", out.start_with?("\e[0m\e[H\e[2J") && out.bytesize == n
+check "cells placed", out.include?("\e[2;3Habc")
+check "nothing changed", screen.flush == 0
+
+screen.put(1, 3, "X")
+check "one cell", output(master) == "" && screen.flush > 0
+check "only the change", output(master) == "\e[2;4HX"
+
+screen.put(0, 0, "bold", 1, -1, Termios::Screen::BOLD)
+screen.flush
+out = output(master)
+check "SGR and reset", out.include?("\e[0;1;31mbold") && out.end_with?("\e[0m")
+
+screen.put(2, 8, "clipped")
+screen.flush
+check "clipped at the right edge", output(master).include?("cl")
+
+# written as UTF-8 whatever the encoding of the string
+screen.put(3, 0, "日本".encode("Shift_JIS"))
+screen.flush
+check "converted to UTF-8", output(master).include?("日本")
+screen.put(3, 0, "\xff\x01".b)
+screen.flush
+check "binary and controls as ?", output(master).include?("??")
+screen.put(3, 5, "\u0085x")
+screen.flush
+check "C1 controls as ?", output(master).include?("?x")
+
+screen.invalidate
+screen.flush
+check "invalidate redraws", output(master).start_with?("\e[0m\e[H\e[2J")
+screen.clear
+screen.flush
+check "clear", output(master).include?("    ")
+
+master.close
+slave.close
+puts "ok"
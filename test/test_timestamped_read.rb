@@ -0,0 +1,38 @@
+# Checks Termios.timestamped_read over a pty pair.
+require_relative 'helper'
+
+master, slave = Termios.openpty
+Termios.update(slave) {|t| t.lflag &= ~(Termios::ICANON | Termios::ECHO) }
+
+master.write("abc")
+before = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+chunks = Termios.timestamped_read(slave)
+after = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+check "one chunk", chunks.size == 1
+check "data", chunks[0][0] == "abc"
+check "monotonic stamp", chunks[0][1].between?(before, after)
+
+chunks = Termios.timestamped_read(slave, timeout: 0.05)
+check "empty after timeout", chunks == []
+
+master.write("x" * 100)
+chunks = Termios.timestamped_read(slave, 10, chunks: 4, timeout: 0.2,
+                                  realtime: true)
+check "chunks of maxlen", chunks.size == 4 && chunks.all? {|c| c[0] == "x" * 10 }
+check "realtime stamp", chunks.all? {|c| c.size == 3 && (c[2] - Time.now.to_f).abs < 5 }
+check "stamps ordered", chunks.map {|c| c[1] } == chunks.map {|c| c[1] }.sort
+Termios.flush(slave, Termios::TCIFLUSH)
+
+begin
+  Termios.timestamped_read(slave, 1 << 62, chunks: 16)
+  check "overflow raises", false
+rescue ArgumentError
+end
+
+master.close
+start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+chunks = Termios.timestamped_read(slave, timeout: 5)
+check "returns at hangup", chunks == [] &&
+  Process.clock_gettime(Process::CLOCK_MONOTONIC) - start < 1
+
+puts "ok"
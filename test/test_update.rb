@@ -0,0 +1,41 @@
+# Checks Termios.update on pseudo terminals.
+require_relative 'helper'
+
+def mutexes
+  GC.start
+  ObjectSpace.each_object(Thread::Mutex).count
+end
+
+master, slave = Termios.openpty
+t = Termios.update(slave) { |tt| tt.lflag &= ~Termios::ECHO }
+check "returns the parameter", t.is_a?(Termios::Termios)
+check "sets the parameter", Termios.tcgetattr(slave).lflag & Termios::ECHO == 0
+
+# threads changing different flags of one port keep each other's changes
+flags = [Termios::ICRNL, Termios::IXON, Termios::IXOFF, Termios::INLCR]
+Termios.update(slave) { |tt| tt.iflag &= ~flags.inject(:|) }
+flags.map { |flag|
+  Thread.new do
+    50.times do
+      Termios.update(slave) { |tt| Thread.pass; tt.iflag ^= flag }
+    end
+    Termios.update(slave) { |tt| tt.iflag |= flag }
+  end
+}.each(&:join)
+check "no lost updates", flags.all? { |flag| Termios.tcgetattr(slave).iflag & flag != 0 }
+
+begin
+  Termios.update(slave) { raise "in block" }
+rescue RuntimeError
+end
+check "unlocked after an exception", Termios.update(slave) { true }
+
+# the locks of descriptors no longer updated are dropped
+before = mutexes
+pairs = Array.new(50) { Termios.openpty }
+pairs.each { |m, _| Termios.update(m) { } }
+pairs.flatten.each(&:close)
+check "locks are dropped", mutexes - before < 10
+
+[master, slave].each(&:close)
+puts "ok"
@@ -0,0 +1,49 @@
+# Checks Termios.watch_modem_lines with Termios::ModemLineDouble; pseudo
+# terminals have no modem lines.
+require_relative 'helper'
+require 'stringio'
+
+def pop(queue)
+  Thread.new { queue.pop }.join(2)&.value
+end
+
+$stderr = StringIO.new
+threads = Thread.list.size
+
+port = Termios::ModemLineDouble.new
+other = Termios::ModemLineDouble.new(Termios::TIOCM_CTS)
+queue = Termios.watch_modem_lines([port, other], interval: 0.005)
+
+port.up(:TIOCM_CD)
+ev = pop(queue)
+check "CD raised", ev && ev[0].equal?(port) && ev[1] == :TIOCM_CD && ev[2] == true
+check "monotonic stamp", ev[3] <= Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+other.down(:TIOCM_CTS)
+ev = pop(queue)
+check "CTS lowered", ev && ev[0].equal?(other) && ev[1] == :TIOCM_CTS && ev[2] == false
+
+port.up(:TIOCM_RTS)		# not in the mask
+port.up(:TIOCM_DSR)
+ev = pop(queue)
+check "mask", ev && ev[1] == :TIOCM_DSR
+
+def port.tiocmget
+  raise Errno::EIO, "TIOCMGET" if @broken
+  super
+end
+port.instance_variable_set(:@broken, true)
+ev = pop(queue)
+check "failure reported", ev && ev[0].equal?(port) && ev[1] == :error &&
+  ev[2].is_a?(Errno::EIO)
+
+# close the queue while lines keep changing
+toggler = Thread.new { 2000.times {|i| other.tiocmset(i.odd? ? Termios::TIOCM_CD : 0); sleep 0.0005 } }
+sleep 0.05
+queue.close
+toggler.join
+sleep 0.1
+check "watcher stopped", Thread.list.size == threads
+check "no exception in the watcher", !$stderr.string.include?("ClosedQueueError")
+
+puts "ok"